@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+#	benchmark of --pipeline: md2roff between a slow producer and a slow
+#	consumer, with and without the pipeline. With one document the wall time
+#	of the pipeline should be near the read time plus the largest of convert
+#	and write; with the parts read as separate files (fifos fed slowly) near
+#	the largest of read, convert and write.
+#
+#	usage: bench-pipeline.sh [FILE [DELAY]]
+#
+
+md2roff=${MD2ROFF:-./md2roff}
+src=${1:-md2roff.md}
+delay=${2:-0.05}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# about 16 MB of input
+i=0; : > "$tmp/doc.md"
+while [ $(wc -c < "$tmp/doc.md") -lt 16000000 ]; do
+	cat "$src" >> "$tmp/doc.md"
+	i=$((i + 1))
+done
+split -b 1048576 "$tmp/doc.md" "$tmp/part."
+"$md2roff" "$tmp/doc.md" > "$tmp/doc.roff"
+
+produce() {
+	for f in "$tmp"/part.*; do cat "$f"; sleep "$delay"; done
+	}
+consume() {
+	while n=$(dd bs=1048576 count=1 iflag=fullblock 2>/dev/null | wc -c) && [ "$n" -gt 0 ]; do
+		sleep "$delay"
+	done
+	}
+now() { date +%s%N; }
+report() { echo "$1 $(( ($(now) - $2) / 1000000 )) ms"; }
+
+t=$(now); produce > /dev/null; report "read:          " $t
+t=$(now); "$md2roff" "$tmp/doc.md" > /dev/null; report "convert:       " $t
+t=$(now); consume < "$tmp/doc.roff"; report "write:         " $t
+t=$(now); produce | "$md2roff" - | consume; report "sequential:    " $t
+t=$(now); produce | "$md2roff" --pipeline - | consume; report "--pipeline:    " $t
+
+# the parts as files
+mkdir "$tmp/fifo"
+for f in "$tmp"/part.*; do mkfifo "$tmp/fifo/${f##*/}"; done
+feed() {
+	for f in "$tmp"/part.*; do cat "$f" > "$tmp/fifo/${f##*/}"; sleep "$delay"; done &
+	}
+feed; t=$(now); "$md2roff" --sync-io "$tmp"/fifo/* | consume; report "files:         " $t
+wait
+feed; t=$(now); "$md2roff" --pipeline "$tmp"/fifo/* | consume; report "files pipeline:" $t
+wait
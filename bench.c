@@ -0,0 +1,379 @@
+/*
+ *	bench.c
+ *	Microbenchmarks of the md2roff kernels.
+ *
+ *	The program includes md2roff.c (without its main) and runs each kernel
+ *	on fixed synthetic input, so the numbers are comparable between builds.
+ *	The time is reported per unit (byte of input, or call for roff()), and
+ *	the hardware counters of perf_event_open(2) next to it: cycles and
+ *	instructions per unit, branch and cache misses per 1000 units. When the
+ *	counters are not available (no permission, no PMU, not Linux) their
+ *	columns are '-' and only the time is measured.
+ *
+ *	usage: bench [-t MS] [NAME ...]
+ *		-t MS	minimum time of each kernel, in milliseconds (default 200)
+ *		NAME	runs only the kernels whose name contains one of these
+ *
+ *	License GPL3+
+ *	CC: std C99
+ */
+
+#define MD2ROFF_NO_MAIN
+#include "md2roff.c"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/perf_event.h>)
+#define HAVE_PERF
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+#endif
+
+/*
+ *	hardware counters
+ */
+#define PC_COUNT	4
+static const char *pc_names[PC_COUNT] = { "cycles", "instructions", "branch-misses", "cache-misses" };
+static int		pc_fd[PC_COUNT] = { -1, -1, -1, -1 };
+
+/*
+ * opens the counters of this thread; returns the number of them opened
+ */
+static int pc_open() {
+	int n = 0;
+#if defined(HAVE_PERF)
+	static const uint64_t config[PC_COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES };
+
+	for ( int i = 0; i < PC_COUNT; i ++ ) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		pc_fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if ( pc_fd[i] >= 0 )
+			n ++;
+		else
+			fprintf(stderr, "bench: %s: counter not available (%s)\n", pc_names[i], strerror(errno));
+		}
+#endif
+	return n;
+	}
+
+static void pc_start() {
+#if defined(HAVE_PERF)
+	for ( int i = 0; i < PC_COUNT; i ++ ) {
+		if ( pc_fd[i] >= 0 ) {
+			ioctl(pc_fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pc_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+/*
+ * stops the counters and stores their values in 'v', -1 = not available;
+ * the values of multiplexed counters are scaled to the whole time.
+ */
+static void pc_stop(double *v) {
+	for ( int i = 0; i < PC_COUNT; i ++ ) {
+		v[i] = -1;
+#if defined(HAVE_PERF)
+		uint64_t r[3];
+		if ( pc_fd[i] < 0 )
+			continue;
+		ioctl(pc_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if ( read(pc_fd[i], r, sizeof(r)) == (ssize_t) sizeof(r) && r[2] > 0 )
+			v[i] = (double) r[0] * r[1] / r[2];
+#endif
+		}
+	}
+
+/*
+ *	synthetic input
+ */
+static const char *b_words[] = {
+	"the", "markdown", "document", "is", "converted", "to", "roff", "and",
+	"manpage", "32bit", "of", "man page", "file", "option", "a", "with",
+	"text,", "lines.", "(see", "below)", "non-root", "user", "zeroes", NULL };
+
+static char		*b_text;		// paragraphs of plain text
+static size_t	b_text_len;
+static char		*b_line;		// one long line with runs of spaces
+static size_t	b_line_len;
+static char		*b_syn;			// man page with a long SYNOPSIS
+static char		*b_emph;		// paragraphs of emphasis and inline code
+static char		*b_link;		// paragraphs of links
+static char		b_file[] = "/tmp/md2roff-bench-XXXXXX";
+static unsigned	b_seed = 1;
+
+static unsigned b_rand() {
+	b_seed = b_seed * 1103515245 + 12345;
+	return (b_seed >> 16) & 0x7fff;
+	}
+
+/*
+ * returns about 'size' bytes made of 'unit' (a printf format of one int)
+ */
+static char *b_repeat(const char *head, const char *unit, size_t size) {
+	size_t	len = strlen(head), alloc = size + 4096;
+	char	*s = (char *) malloc(alloc);
+
+	panicif(s == NULL, "out of memory");
+	strcpy(s, head);
+	for ( int i = 0; len < size; i ++ )
+		len += snprintf(s + len, alloc - len, unit, i);
+	return s;
+	}
+
+static void b_input() {
+	size_t	alloc = 64 * 1024, len = 0;
+	int		col = 0;
+	FILE	*fp;
+
+	b_text = (char *) malloc(alloc + 64);
+	while ( len < alloc ) {
+		const char *w = b_words[b_rand() % (sizeof(b_words) / sizeof(b_words[0]) - 1)];
+		len += sprintf(b_text + len, "%s", w);
+		col += strlen(w) + 1;
+		if ( col > 72 ) {
+			b_text[len ++] = '\n';
+			if ( b_rand() % 6 == 0 )
+				b_text[len ++] = '\n';
+			col = 0;
+			}
+		else
+			b_text[len ++] = ( b_rand() % 8 == 0 ) ? '\t' : ' ';
+		}
+	b_text[len] = '\0';
+	b_text_len = len;
+
+	b_line_len = 4096;
+	b_line = (char *) malloc(b_line_len + 1);
+	for ( size_t i = 0; i < b_line_len; i ++ )
+		b_line[i] = ( b_rand() % 5 == 0 ) ? ' ' : ( b_rand() % 17 == 0 ) ? ',' : 'a' + b_rand() % 26;
+	b_line[b_line_len] = '\0';
+
+	b_syn = b_repeat("# BENCH 1 2026-01-01\n\n## NAME\n\nbench - synthetic page\n\n## SYNOPSIS\n\n",
+		"bench%d [-a] [-b file] [--long=value] {start|stop} file ...\n"
+		"-c *count* -d [--debug]\n\n", 64 * 1024);
+	b_emph = b_repeat("",
+		"Some *emphasis* and **strong** words, __under__ _line_ and `code %d`\n"
+		"spans; *one* **two** *three* in a row, and a\\*star.\n\n", 64 * 1024);
+	b_link = b_repeat("[r1]: https://example.org/ref\n\n",
+		"See [the page %d](https://example.org/a) and <https://example.org/b>,\n"
+		"[a reference][r1] and the mail <user@example.org>.\n\n", 64 * 1024);
+
+	int fd = mkstemp(b_file);
+	panicif(fd < 0, "mkstemp failed");
+	panicif((fp = fdopen(fd, "w")) == NULL, "fdopen failed");
+	for ( int i = 0; i < 16; i ++ )
+		fwrite(b_text, 1, b_text_len, fp);
+	fclose(fp);
+	}
+
+/*
+ *	kernels; each runs once over its input and returns the number of units
+ */
+static size_t k_sqzdup() {
+	free(sqzdup(b_line));
+	return b_line_len;
+	}
+
+static size_t k_flushln() {
+	static char bf[8192];
+
+	memcpy(bf, b_line, b_line_len);
+	flushln(bf + b_line_len, bf);
+	return b_line_len;
+	}
+
+static size_t k_zdic_match() {
+	const char *p = b_text, *rp;
+	int n;
+
+	while ( *p )
+		p += ( (n = zdic_match(p, &rp)) != 0 ) ? n : 1;
+	return b_text_len;
+	}
+
+static size_t k_loadfile() {
+	free(loadfile(b_file));
+	return b_text_len * 16;
+	}
+
+static size_t k_println() {
+	for ( const char *p = b_text; *p; p = println(p) );
+	return b_text_len;
+	}
+
+static size_t k_println_z() {
+	man_ofc = 1;
+	for ( const char *p = b_text; *p; p = println_text(p) );
+	man_ofc = 0;
+	return b_text_len;
+	}
+
+static size_t b_doc(const char *src, macropackage_t pack, int style) {
+	mpack = pack;
+	opt_name_style = style;
+	md2roff("bench", src);
+	mpack = mp_man;
+	opt_name_style = 0;
+	return strlen(src);
+	}
+
+static size_t k_syn0() { return b_doc(b_syn, mp_man, 0); }
+static size_t k_syn1() { return b_doc(b_syn, mp_man, 1); }
+static size_t k_syn2() { return b_doc(b_syn, mp_man, 2); }
+static size_t k_syn3() { return b_doc(b_syn, mp_mdoc, 3); }
+static size_t k_emph() { return b_doc(b_emph, mp_man, 0); }
+static size_t k_link() { return b_doc(b_link, mp_man, 0); }
+
+/*
+ * roff() per element type; the packages are set by the caller
+ */
+#define ROFF_CALLS	1000
+static int		b_type;
+
+static size_t k_roff() {
+	for ( int i = 0; i < ROFF_CALLS; i ++ ) {
+		switch ( b_type ) {
+		case url_mark:	roff(url_mark, "the page", "https://example.org/a", '.'); break;
+		case img_mark:	roff(img_mark, "figure", "fig.eps", 216, 144); break;
+		case tbl_open:	roff(tbl_open, 3, "lcr"); roff(tbl_close); break;
+		case fn_item:	roff(fn_item, i); break;
+		case man_ref:	roff(man_ref, "ls 1", ','); break;
+		case cblock_open: roff(cblock_open); roff(cblock_end); break;
+		case box_open:	roff(box_open); roff(box_close); break;
+		case fn_open:	roff(fn_open); roff(fn_close); break;
+		case ol_open:
+			roff(ol_open);
+			roff(li_open); roff(li_end);
+			roff(li_open); roff(li_end);
+			roff(lst_close);
+			stk_list_p = 0;
+			break;
+		default:
+			roff(b_type);
+			}
+		}
+	return ROFF_CALLS;
+	}
+
+typedef struct {
+	const char	*name;
+	size_t		(*fn)();
+	const char	*unit;
+	} bench_t;
+
+static const bench_t b_list[] = {
+	{ "sqzdup",			k_sqzdup,		"B" },
+	{ "flushln",		k_flushln,		"B" },
+	{ "zdic_match",		k_zdic_match,	"B" },
+	{ "loadfile",		k_loadfile,		"B" },
+	{ "println",		k_println,		"B" },
+	{ "println_text -z", k_println_z,	"B" },
+	{ "synopsis 0 man",	k_syn0,			"B" },
+	{ "synopsis 1 man",	k_syn1,			"B" },
+	{ "synopsis 2 man",	k_syn2,			"B" },
+	{ "synopsis 3 mdoc", k_syn3,		"B" },
+	{ "emphasis",		k_emph,			"B" },
+	{ "links",			k_link,			"B" },
+	{ NULL, NULL, NULL } };
+
+static const struct { const char *name; int type; } b_types[] = {
+	{ "par_end", par_end }, { "ln_brk", ln_brk }, { "url_mark", url_mark },
+	{ "img_mark", img_mark }, { "cblock", cblock_open }, { "list", ol_open },
+	{ "box", box_open }, { "new_sh", new_sh }, { "new_ss", new_ss },
+	{ "tbl", tbl_open }, { "fn", fn_open }, { "fn_item", fn_item },
+	{ "man_ref", man_ref }, { NULL, 0 } };
+
+static const char *b_packs[] = { "mm", "man", "mdoc", "mom", "ms" }; // order of macropackage_t
+
+static int		b_ms = 200;
+static char		**b_filter;
+static int		b_nfilter;
+
+static double b_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+	}
+
+/*
+ * runs 'fn' for at least b_ms and prints a line of results
+ */
+static void b_run(const char *name, size_t (*fn)(), const char *unit) {
+	double	t0, t, v[PC_COUNT];
+	size_t	units = 0;
+	int		i;
+
+	for ( i = 0; i < b_nfilter; i ++ )
+		if ( strstr(name, b_filter[i]) )
+			break;
+	if ( b_nfilter && i == b_nfilter )
+		return;
+	fn(); // warm up
+	pc_start();
+	t0 = b_now();
+	do {
+		units += fn();
+		t = b_now() - t0;
+		} while ( t < b_ms * 1e6 );
+	pc_stop(v);
+
+	printf("%-24s %-4s %9.2f", name, unit, t / units);
+	for ( i = 0; i < PC_COUNT; i ++ ) {
+		if ( v[i] < 0 )
+			printf(" %10s", "-");
+		else
+			printf(" %10.2f", v[i] / units * ( i < 2 ? 1 : 1000 ));
+		}
+	printf("\n");
+	fflush(stdout);
+	}
+
+int main(int argc, char *argv[]) {
+	char	name[64];
+
+	for ( int i = 1; i < argc; i ++ ) {
+		if ( strcmp(argv[i], "-t") == 0 && i + 1 < argc )
+			b_ms = atoi(argv[++ i]);
+		else if ( argv[i][0] == '-' ) {
+			fprintf(stderr, "usage: bench [-t MS] [NAME ...]\n");
+			return EXIT_FAILURE;
+			}
+		else {
+			b_filter = argv + i;
+			b_nfilter = argc - i;
+			break;
+			}
+		}
+	panicif((fout = fopen("/dev/null", "w")) == NULL, "/dev/null: %s", strerror(errno));
+	b_input();
+	if ( pc_open() == 0 )
+		fprintf(stderr, "bench: only the times are reported\n");
+
+	printf("%-24s %-4s %9s %10s %10s %10s %10s\n", "kernel", "unit", "ns/unit",
+		"cyc/unit", "ins/unit", "brmiss/1K", "cmiss/1K");
+	for ( int i = 0; b_list[i].name; i ++ )
+		b_run(b_list[i].name, b_list[i].fn, b_list[i].unit);
+	for ( int k = 0; k < 5; k ++ ) {
+		for ( int i = 0; b_types[i].name; i ++ ) {
+			mpack = (macropackage_t) k;
+			b_type = b_types[i].type;
+			snprintf(name, sizeof(name), "roff %s %s", b_types[i].name, b_packs[k]);
+			b_run(name, k_roff, "call");
+			}
+		}
+	mpack = mp_man;
+	unlink(b_file);
+	return EXIT_SUCCESS;
+	}
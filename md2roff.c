@@ -23,21 +23,60 @@
  *	See LICENSE for details.
  */
 
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <time.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
-#include <regex.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
 
 // options
 typedef enum { mp_mm, mp_man, mp_mdoc, mp_mom, mp_ms } macropackage_t;
 macropackage_t	mpack = mp_man;
 int	man_ofc = 0, write_lock = 0, std_q = 1;
 int opt_name_style = 0;
+const char *opt_xrefs = NULL;	// MANPATH of --check-xrefs
+const char *opt_whatis = NULL;	// file of --whatis
+const char *opt_outdir = NULL;	// directory of -O
+int opt_check = 0, opt_jobs = 0;	// --check, --jobs (0 = all cores)
+int opt_sync_io = 0;			// do not use io_uring
+int opt_pipeline = 0;			// --pipeline
+int opt_if_changed = 0;			// --if-changed
+int opt_split = 0, opt_split_gz = 0;	// --split-pages[=gz]
+const char *opt_from_tar = NULL;	// archive of --from-tar, "-" = stdin
+int opt_to_tar = 0, opt_to_tar_gz = 0;	// --to-tar[=gz]
+const char *opt_parse_cache = NULL;	// file of --parse-cache
+int opt_tabs = 0;				// --expand-tabs, tab size, 0 = keep the tabs
+int opt_highlight = 0;			// --highlight
+int opt_peephole = 1;			// --no-peephole = 0
+const char *opt_sections = NULL;	// --only-sections, --exclude-sections
+int opt_sec_exclude = 0;
 typedef struct { const char *wrong, *correct; } dict_line_t;
 dict_line_t mdic[] = {
 { "bitmask", "bit mask" },
@@ -80,6 +119,301 @@ dict_line_t mdic[] = {
 { "nonprivileged", "unprivileged" },
 { NULL, NULL } };
 
+/*
+ *	character classes
+ *
+ *	One table of the bytes, the same in any locale, in place of ctype.h:
+ *	the classes of ASCII, and for the bytes of UTF-8 sequences whether they
+ *	begin one or continue it. The bytes of UTF-8 are never spaces, digits
+ *	or punctuation; ch_word() counts them as letters, of any script.
+ */
+#define CH_SPACE	0x01	// space, \t, \n, \v, \f, \r
+#define CH_BLANK	0x02	// space, \t
+#define CH_DIGIT	0x04
+#define CH_UPPER	0x08
+#define CH_LOWER	0x10
+#define CH_PUNCT	0x20	// ASCII punctuation
+#define CH_CONT		0x40	// UTF-8 continuation byte
+#define CH_LEAD		0x80	// UTF-8 first byte of a sequence
+
+static const uint8_t ch_cls[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,	// 00
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	// 10
+	0x03, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,	// 20
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,	// 30
+	0x20, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,	// 40
+	0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x20, 0x20, 0x20, 0x20, 0x20,	// 50
+	0x20, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,	// 60
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x20, 0x20, 0x20, 0x20, 0x00,	// 70
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,	// 80
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,	// 90
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,	// A0
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,	// B0
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,	// C0
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,	// D0
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,	// E0
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,	// F0
+	};
+
+#define ch_is(c, m)		(ch_cls[(unsigned char) (c)] & (m))
+#define ch_space(c)		ch_is(c, CH_SPACE)
+#define ch_blank(c)		ch_is(c, CH_BLANK)
+#define ch_digit(c)		ch_is(c, CH_DIGIT)
+#define ch_alnum(c)		ch_is(c, CH_UPPER | CH_LOWER | CH_DIGIT)
+#define ch_punct(c)		ch_is(c, CH_PUNCT)
+#define ch_word(c)		ch_is(c, CH_UPPER | CH_LOWER | CH_DIGIT | CH_CONT | CH_LEAD)
+#define ch_tolower(c)	((c) + (ch_is(c, CH_UPPER) ? 32 : 0))	// 'c' is evaluated twice
+#define ch_toupper(c)	((c) - (ch_is(c, CH_LOWER) ? 32 : 0))
+
+/*
+ * decodes the UTF-8 sequence at 'p' (before 'e') to 'cp' and returns its
+ * length; an invalid byte is one character, U+FFFD.
+ */
+static int ch_decode(const char *p, const char *e, uint32_t *cp) {
+	const unsigned char *s = (const unsigned char *) p;
+	int			n = ( s[0] >= 0xF0 ) ? 4 : ( s[0] >= 0xE0 ) ? 3 : 2;
+	uint32_t	c;
+
+	if ( s[0] < 0x80 ) {
+		*cp = s[0];
+		return 1;
+		}
+	*cp = 0xFFFD;
+	if ( !ch_is(s[0], CH_LEAD) || s[0] > 0xF4 || n > e - p )
+		return 1;
+	c = s[0] & (0x7F >> n);
+	for ( int i = 1; i < n; i ++ ) {
+		if ( !ch_is(s[i], CH_CONT) )
+			return 1;
+		c = (c << 6) | (s[i] & 0x3F);
+		}
+	*cp = c;
+	return n;
+	}
+
+// the spaces and the punctuation (P and S categories) out of ASCII, by blocks
+static const struct { uint32_t lo, hi; uint8_t cls; } ch_uni[] = {
+	{ 0x00A0, 0x00A0, CH_SPACE }, { 0x00A1, 0x00A9, CH_PUNCT }, { 0x00AB, 0x00AC, CH_PUNCT },
+	{ 0x00AE, 0x00B1, CH_PUNCT }, { 0x00B4, 0x00B4, CH_PUNCT }, { 0x00B6, 0x00B8, CH_PUNCT },
+	{ 0x00BB, 0x00BB, CH_PUNCT }, { 0x00BF, 0x00BF, CH_PUNCT }, { 0x00D7, 0x00D7, CH_PUNCT },
+	{ 0x00F7, 0x00F7, CH_PUNCT }, { 0x02C2, 0x02C5, CH_PUNCT }, { 0x02D2, 0x02DF, CH_PUNCT },
+	{ 0x037E, 0x037E, CH_PUNCT }, { 0x0387, 0x0387, CH_PUNCT }, { 0x055A, 0x055F, CH_PUNCT },
+	{ 0x0589, 0x058A, CH_PUNCT }, { 0x05BE, 0x05BE, CH_PUNCT }, { 0x05C0, 0x05C0, CH_PUNCT },
+	{ 0x05C3, 0x05C3, CH_PUNCT }, { 0x05C6, 0x05C6, CH_PUNCT }, { 0x05F3, 0x05F4, CH_PUNCT },
+	{ 0x060C, 0x060D, CH_PUNCT }, { 0x061B, 0x061B, CH_PUNCT }, { 0x061F, 0x061F, CH_PUNCT },
+	{ 0x066A, 0x066D, CH_PUNCT }, { 0x06D4, 0x06D4, CH_PUNCT }, { 0x0964, 0x0965, CH_PUNCT },
+	{ 0x0970, 0x0970, CH_PUNCT }, { 0x0E3F, 0x0E3F, CH_PUNCT }, { 0x0E4F, 0x0E4F, CH_PUNCT },
+	{ 0x0E5A, 0x0E5B, CH_PUNCT }, { 0x1680, 0x1680, CH_SPACE }, { 0x2000, 0x200A, CH_SPACE },
+	{ 0x2010, 0x2027, CH_PUNCT }, { 0x202F, 0x202F, CH_SPACE }, { 0x2030, 0x205E, CH_PUNCT },
+	{ 0x205F, 0x205F, CH_SPACE }, { 0x207A, 0x207E, CH_PUNCT }, { 0x208A, 0x208E, CH_PUNCT },
+	{ 0x20A0, 0x20C0, CH_PUNCT }, { 0x2100, 0x214F, CH_PUNCT }, { 0x2190, 0x245F, CH_PUNCT },
+	{ 0x249C, 0x24E9, CH_PUNCT }, { 0x2500, 0x2775, CH_PUNCT }, { 0x2794, 0x2BFF, CH_PUNCT },
+	{ 0x2E00, 0x2E5D, CH_PUNCT }, { 0x3000, 0x3000, CH_SPACE }, { 0x3001, 0x3003, CH_PUNCT },
+	{ 0x3008, 0x3020, CH_PUNCT }, { 0x3030, 0x3030, CH_PUNCT }, { 0x303D, 0x303D, CH_PUNCT },
+	{ 0x30A0, 0x30A0, CH_PUNCT }, { 0x30FB, 0x30FB, CH_PUNCT }, { 0xFE10, 0xFE19, CH_PUNCT },
+	{ 0xFE30, 0xFE6B, CH_PUNCT }, { 0xFF01, 0xFF0F, CH_PUNCT }, { 0xFF1A, 0xFF20, CH_PUNCT },
+	{ 0xFF3B, 0xFF40, CH_PUNCT }, { 0xFF5B, 0xFF65, CH_PUNCT }, { 0xFFE0, 0xFFEE, CH_PUNCT },
+	{ 0x1F300, 0x1FAFF, CH_PUNCT } };
+
+/*
+ * returns the class of the character at 'p' (before 'e'): CH_SPACE,
+ * CH_PUNCT or 0 for the letters, the digits and the rest.
+ */
+static int ch_class(const char *p, const char *e) {
+	int			lo = 0, hi = sizeof(ch_uni) / sizeof(ch_uni[0]) - 1;
+	uint32_t	c;
+
+	if ( !ch_is(*p, CH_LEAD) )
+		return ch_is(*p, CH_SPACE | CH_PUNCT);
+	ch_decode(p, e, &c);
+	while ( lo <= hi ) {
+		int mid = (lo + hi) / 2;
+		if ( c < ch_uni[mid].lo )
+			hi = mid - 1;
+		else if ( c > ch_uni[mid].hi )
+			lo = mid + 1;
+		else
+			return ch_uni[mid].cls;
+		}
+	return 0;
+	}
+
+/*
+ * writes to 'd' the upper case of the character at 'p' and returns the
+ * length of both; the letters of ASCII, Latin-1, Latin Extended-A, Greek
+ * and Cyrillic are converted, the others are copied.
+ */
+static int ch_upper(const char *p, char *d) {
+	uint32_t	c, u;
+	int			n = ch_decode(p, p + 4, &c);
+
+	if ( n == 1 ) {
+		*d = ch_toupper(*p);
+		return 1;
+		}
+	u = c;
+	if ( (c >= 0xE0 && c <= 0xFE && c != 0xF7) || (c >= 0x3B1 && c <= 0x3CB && c != 0x3C2) || (c >= 0x430 && c <= 0x44F) )
+		u = c - 0x20;
+	else if ( c == 0xFF )
+		u = 0x178;
+	else if ( c == 0x3C2 )
+		u = 0x3A3;
+	else if ( c >= 0x450 && c <= 0x45F )
+		u = c - 0x50;
+	else if ( c == 0x3AC || c == 0x3CC )
+		u = ( c == 0x3AC ) ? 0x386 : 0x38C;
+	else if ( c >= 0x3AD && c <= 0x3AF )
+		u = c - 0x25;
+	else if ( c >= 0x3CD && c <= 0x3CE )
+		u = c - 0x3F;
+	else if ( (c >= 0x100 && c <= 0x137) || (c >= 0x14A && c <= 0x177) )
+		u = c & ~1;
+	else if ( ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) && !(c & 1) )
+		u = c - 1;
+	if ( u == c ) {
+		memcpy(d, p, n);
+		return n;
+		}
+	d[0] = 0xC0 | (u >> 6);		// all of them are two bytes
+	d[1] = 0x80 | (u & 0x3F);
+	return 2;
+	}
+
+/*
+ *	-z corrections; the entries of mdic[] are grouped by their first letter
+ *	and they are matched on the plain text while it is copied to the output,
+ *	so the code, the links and the man references are not changed.
+ */
+#define MDIC_SIZE	(sizeof(mdic) / sizeof(mdic[0]))
+static unsigned char zdic_idx[MDIC_SIZE];	// entries sorted by first letter
+static unsigned char zdic_start[256], zdic_end[256];
+static unsigned char zdic_pair[256 * 256 / 8];	// bitmap of the first two letters
+static bool zdic_ready = false;
+
+// true if a word of the dictionary may begin at 'p'
+#define ZDIC_MAYBE(p)	(zdic_pair[(((unsigned char) (p)[0] << 8) | (unsigned char) (p)[1]) >> 3] \
+							& (1 << ((unsigned char) (p)[1] & 7)))
+
+// the matches of the whole text, from the --parse-cache file
+typedef struct { uint32_t off; uint16_t len, word; } zspan_t;
+static const zspan_t *zdic_spans;
+static const char	*zdic_text;
+static uint32_t		zdic_len, zdic_count, zdic_cur;
+
+static void zdic_init() {
+	int n = 0;
+
+	for ( int c = 0; c < 256; c ++ ) {
+		zdic_start[c] = n;
+		if ( c == ch_tolower(c) ) {
+			for ( int i = 0; mdic[i].wrong; i ++ )
+				if ( ch_tolower(mdic[i].wrong[0]) == c )
+					zdic_idx[n ++] = i;
+			}
+		zdic_end[c] = n;
+		}
+	for ( int c = 0; c < 256; c ++ ) { // upper case uses the same entries
+		if ( c != ch_tolower(c) ) {
+			zdic_start[c] = zdic_start[ch_tolower(c)];
+			zdic_end[c] = zdic_end[ch_tolower(c)];
+			}
+		}
+	for ( int i = 0; mdic[i].wrong; i ++ ) {
+		unsigned char c1 = mdic[i].wrong[0], c2 = mdic[i].wrong[1];
+		unsigned char a[2] = { ch_tolower(c1), ch_toupper(c1) }, b[2] = { ch_tolower(c2), ch_toupper(c2) };
+		for ( int j = 0; j < 4; j ++ ) {
+			int k = (a[j >> 1] << 8) | b[j & 1];
+			zdic_pair[k >> 3] |= 1 << (k & 7);
+			}
+		}
+	zdic_ready = true;
+	}
+
+/*
+ * if a word of the dictionary begins at 'p' (case insensitive), stores
+ * its entry in 'word' and returns its length; the longest one wins.
+ */
+static int zdic_find(const char *p, int *word) {
+	unsigned char c = *p;
+	int best = 0, n;
+
+	if ( !zdic_ready )
+		zdic_init();
+	if ( *p == '\0' || !ZDIC_MAYBE(p) )
+		return 0;
+	for ( int k = zdic_start[c]; k < zdic_end[c]; k ++ ) {
+		const char *w = mdic[zdic_idx[k]].wrong;
+		for ( n = 1; w[n] && ch_tolower(p[n]) == ch_tolower(w[n]); n ++ );
+		if ( w[n] == '\0' && n > best ) {
+			best = n;
+			*word = zdic_idx[k];
+			}
+		}
+	return best;
+	}
+
+/*
+ * like zdic_find(), from the matches of the parse cache; they are sorted
+ * and the text is mostly visited in order, so the search goes on from the
+ * last one.
+ */
+static int zdic_cached(const char *p, int *word) {
+	uint32_t off = p - zdic_text, lo, hi;
+
+	if ( zdic_cur > 0 && zdic_spans[zdic_cur - 1].off >= off ) { // back, binary search
+		for ( lo = 0, hi = zdic_cur - 1; lo < hi; ) {
+			uint32_t mid = (lo + hi) / 2;
+			if ( zdic_spans[mid].off < off )
+				lo = mid + 1;
+			else
+				hi = mid;
+			}
+		zdic_cur = lo;
+		}
+	while ( zdic_cur < zdic_count && zdic_spans[zdic_cur].off < off )
+		zdic_cur ++;
+	if ( zdic_cur == zdic_count || zdic_spans[zdic_cur].off != off )
+		return 0;
+	*word = zdic_spans[zdic_cur].word;
+	return zdic_spans[zdic_cur].len;
+	}
+
+/*
+ * if a word of the dictionary begins at 'p' (case insensitive), stores
+ * its correction in 'rp' and returns its length; the longest one wins.
+ */
+int zdic_match(const char *p, const char **rp) {
+	int word, n;
+
+	if ( zdic_spans && p >= zdic_text && p < zdic_text + zdic_len )
+		n = zdic_cached(p, &word);
+	else
+		n = zdic_find(p, &word);
+	if ( n )
+		*rp = mdic[word].correct;
+	return n;
+	}
+
+/*
+ * returns a copy of the text 's' with the -z corrections
+ */
+char *zdic_dup(const char *s) {
+	char *r = (char *) malloc(strlen(s) * 3 + 1), *d = r;
+	const char *rp;
+	int n;
+
+	while ( *s ) {
+		if ( (n = zdic_match(s, &rp)) != 0 ) {
+			while ( *rp ) *d ++ = *rp ++;
+			s += n;
+			}
+		else
+			*d ++ = *s ++;
+		}
+	*d = '\0';
+	return r;
+	}
+
 /*
  * if 'when' is true, print error message and quit
  */
@@ -96,6 +430,30 @@ void panicif(int when, const char *fmt, ...) {
 	va_end(ap);
 	}
 
+/*
+ *	output, the roff code is written to 'fout' (stdout or the -O file)
+ */
+FILE	*fout;
+
+int oputs(const char *s) {
+	fputs(s, fout);
+	return putc('\n', fout);
+	}
+
+int oputc(int c) {
+	return putc(c, fout);
+	}
+
+int oprintf(const char *fmt, ...) {
+	va_list	ap;
+	int		n;
+
+	va_start(ap, fmt);
+	n = vfprintf(fout, fmt, ap);
+	va_end(ap);
+	return n;
+	}
+
 /*
  * clone string
  */
@@ -106,6 +464,18 @@ char *strdup(const char *s) {
 	return d;
 	}
 
+/*
+ * clone the first 'len' bytes of string
+ */
+char *substr(const char *s, int len) {
+	char *d = (char *) malloc(len + 1);
+	if ( d ) {
+		memcpy(d, s, len);
+		d[len] = '\0';
+		}
+	return d;
+	}
+
 /*
  *	squeeze (& strdup)
  */
@@ -117,20 +487,20 @@ char *sqzdup(const char *source) {
 	p = (char *) source;
 	d = rp;
 
-	while ( isspace(*p) ) p ++;
+	while ( ch_space(*p) ) p ++;
 
 	while ( *p ) {
-		if ( isspace(*p) ) {
+		if ( ch_space(*p) ) {
 			if ( !lc ) {
 				lc = 1;
 				if ( p > source ) {
-					if ( isalnum(*(p-1)) || strchr(",;.)}]", *(p-1)) )
+					if ( ch_word(*(p-1)) || strchr(",;.)}]", *(p-1)) )
 						*d ++ = ' ';
 					else {
 						char *nc = p;
-						while ( isspace(*nc) )
+						while ( ch_space(*nc) )
 							nc ++;
-						if ( isalnum(*nc) )
+						if ( ch_word(*nc) )
 							*d ++ = ' ';
 						}
 					}
@@ -145,7 +515,7 @@ char *sqzdup(const char *source) {
 
 	*d = '\0';
 	if ( d > rp ) {
-		if ( isspace(*(d - 1)) ) 
+		if ( ch_space(*(d - 1)) ) 
 			*(d - 1) = '\0';
 		}
 	
@@ -153,96 +523,352 @@ char *sqzdup(const char *source) {
 	}
 
 /*
- * regex find & replace
+ *	input normalization
+ *
+ *	The text is given to the parser without the UTF-8 BOM, with LF line
+ *	endings (CRLF and CR are converted), with U+FFFD in place of the NUL
+ *	characters and, with --expand-tabs, with the tabs expanded to spaces.
+ *	It works on chunks, so the input is never copied as a whole; the runs
+ *	of ordinary bytes are found eight bytes at a time.
+ */
+typedef struct {
+	bool	started, cr;		// after the BOM, the last byte was CR
+	int		col;				// column, for the tabs
+	int		bom;				// bytes of a BOM split by the chunks
+	bool	keep_tabs;			// norm_tabs() expands them later
+	} norm_t;
+
+#define NORM_MAX(n)		(((n) + 2) * (size_t) (( opt_tabs > 3 ) ? opt_tabs : 3))	// output size of a chunk
+#define SWAR_ONES		0x0101010101010101ULL
+#define SWAR_ZERO(v)	(((v) - SWAR_ONES) & ~(v) & (SWAR_ONES << 7))
+
+/*
+ * returns the length of the prefix of 's' without CR, NUL or tab
+ */
+static size_t norm_span(const char *s, size_t n, int tabs) {
+	size_t	i = 0;
+	uint64_t v;
+
+	for ( ; i + 8 <= n; i += 8 ) {
+		memcpy(&v, s + i, 8);
+		if ( SWAR_ZERO(v) | SWAR_ZERO(v ^ (SWAR_ONES * '\r'))
+				| (tabs ? SWAR_ZERO(v ^ (SWAR_ONES * '\t')) : 0) )
+			break;
+		}
+	for ( ; i < n; i ++ )
+		if ( s[i] == '\0' || s[i] == '\r' || (s[i] == '\t' && tabs) )
+			break;
+	return i;
+	}
+
+/*
+ * writes to 'dst' the bytes of a BOM that turned out to be text, at most
+ * 2; returns their number
  */
-char* regex_find_and_replace(const char *src, regex_t *re, const char *rp) {
-	size_t	size = 0x10000 + strlen(src);
-	char	*buf = (char *) malloc(size);
-	char	*pos;
-	int		sub, so, n;
-	regmatch_t pmatch[10]; /* regoff_t is int so size is int */
+size_t norm_end(norm_t *st, char *dst) {
+	size_t	n = st->bom;
 
-	strcpy(buf, src);
-	if ( regexec(re, buf, 10, pmatch, 0) != REG_NOMATCH ) {
-		// first do preliminary replacements in the replacement text i.e. \1 -> first match
-		for ( pos = (char *) rp; *pos; pos ++ ) {
-			if (*pos == '\\' && *(pos + 1) > '0' && *(pos + 1) <= '9') {
-				so = pmatch [*(pos + 1) - 48].rm_so;
-				n = pmatch [*(pos + 1) - 48].rm_eo - so;
-				if ( so < 0 || strlen(rp) + n - 1 > size ) return buf;
-				memmove(pos + n, pos + 2, strlen(pos) - 1);
-				memmove(pos, buf + so, n);
-				pos = pos + n - 2;
+	memcpy(dst, "\xEF\xBB\xBF", n);
+	st->col += ( n > 0 );	// the lead byte
+	st->bom = 0;
+	st->started = true;
+	return n;
+	}
+
+/*
+ * normalizes the 'n' bytes of 'src' to 'dst', that has room for
+ * NORM_MAX(n) bytes, and returns the number of bytes written. 'dst' can
+ * be 'src' if there are no NULs and the tabs are not expanded.
+ */
+size_t norm_chunk(norm_t *st, char *dst, const char *src, size_t n) {
+	const char *s = src, *e = src + n;
+	char	*d = dst;
+	size_t	k;
+	int		tabs = ( st->keep_tabs ) ? 0 : opt_tabs;
+
+	while ( !st->started && s < e ) { // the BOM, a byte at a time
+		if ( *s == "\xEF\xBB\xBF"[st->bom] ) {
+			s ++;
+			if ( ++ st->bom == 3 ) {
+				st->bom = 0;
+				st->started = true;
 				}
 			}
-	
-		sub = pmatch [1].rm_so; // repeated replace when sub >= 0
-		for ( pos = buf; !regexec(re, pos, 1, pmatch, 0); ) {
-			n = pmatch [0].rm_eo - pmatch [0].rm_so;
-			pos += pmatch [0].rm_so;
-			if ( strlen(buf) - n + strlen(rp) + 1 > size )
-				break;
-			memmove(pos + strlen(rp), pos + n, strlen(pos) - n + 1);
-			memmove(pos, rp, strlen (rp));
-			pos += strlen(rp);
-			if ( sub >= 0 ) break;
+		else
+			d += norm_end(st, d);
+		}
+	if ( st->cr && s < e && *s == '\n' ) // CRLF split by the chunks
+		s ++;
+	st->cr = false;
+	while ( s < e ) {
+		k = norm_span(s, e - s, tabs);
+		if ( d != s )
+			memmove(d, s, k);
+		if ( tabs ) { // the column of the run
+			const char *r = s + k;
+			while ( r > s && r[-1] != '\n' ) r --;
+			if ( r > s ) st->col = 0;
+			for ( ; r < s + k; r ++ )
+				if ( (*r & 0xC0) != 0x80 )
+					st->col ++;
+			}
+		d += k;
+		s += k;
+		if ( s == e )
+			break;
+		switch ( *s ++ ) {
+		case '\r':
+			*d ++ = '\n';
+			st->col = 0;
+			if ( s < e && *s == '\n' )
+				s ++;
+			else if ( s == e )
+				st->cr = true;
+			break;
+		case '\0':
+			memcpy(d, "\xEF\xBF\xBD", 3);
+			d += 3;
+			st->col ++;
+			break;
+		case '\t':
+			do { *d ++ = ' '; } while ( ++ st->col % opt_tabs );
+			break;
 			}
 		}
-	
-	return realloc(buf, strlen(buf) + 1);
+	return d - dst;
 	}
-	
+
+/*
+ * expands the tabs of the normalized text of 'len' bytes of '*buf' (of
+ * size '*alloc') in place, from the end; the widths of the tabs are found
+ * first, so the buffer grows by what they add. Returns the new length.
+ */
+static size_t norm_tabs(char **buf, size_t *alloc, size_t len) {
+	const char *s, *e = *buf + len, *t, *nl;
+	uint8_t	*width;
+	size_t	ntabs = 0, extra = 0, k;
+	int		col = 0;
+	char	*d;
+
+	for ( t = *buf; (t = memchr(t, '\t', e - t)) != NULL; t ++ )
+		ntabs ++;
+	if ( ntabs == 0 )
+		return len;
+	panicif((width = (uint8_t *) malloc(ntabs)) == NULL, "out of memory");
+	for ( k = 0, s = *buf; (t = memchr(s, '\t', e - s)) != NULL; s = t + 1, k ++ ) {
+		if ( (nl = memrchr(s, '\n', t - s)) != NULL ) {
+			s = nl + 1;
+			col = 0;
+			}
+		for ( ; s < t; s ++ )
+			if ( (*s & 0xC0) != 0x80 )
+				col ++;
+		width[k] = opt_tabs - col % opt_tabs;
+		col += width[k];
+		extra += width[k] - 1;
+		}
+	if ( len + extra + 1 > *alloc ) {
+		*alloc = len + extra + 1;
+		panicif((*buf = (char *) realloc(*buf, *alloc)) == NULL, "out of memory");
+		}
+	s = *buf + len;
+	d = (char *) s + extra;
+	while ( d > s ) {
+		if ( *-- s == '\t' ) {
+			d -= width[-- k];
+			memset(d, ' ', width[k]);
+			}
+		else
+			*-- d = *s;
+		}
+	free(width);
+	return len + extra;
+	}
+
+/*
+ * normalizes the 'len' bytes of the buffer '*buf' (of size '*alloc') in
+ * place, without a copy; the NULs and the tabs, that make the text
+ * longer, are expanded from the end. Returns the new length.
+ */
+size_t norm_buffer(char **buf, size_t *alloc, size_t len) {
+	norm_t	st = { false, false, 0, 0, true };
+	size_t	nuls = 0;
+	char	*s, *d;
+
+	for ( s = *buf; (s = memchr(s, '\0', *buf + len - s)) != NULL; s ++ )
+		nuls ++;
+	if ( nuls ) { // U+FFFD from the end
+		if ( len + 2 * nuls + 1 > *alloc ) {
+			*alloc = len + 2 * nuls + 1;
+			panicif((*buf = (char *) realloc(*buf, *alloc)) == NULL, "out of memory");
+			}
+		s = *buf + len;
+		d = s + 2 * nuls;
+		while ( d > s ) {
+			if ( *-- s == '\0' ) {
+				d -= 3;
+				memcpy(d, "\xEF\xBF\xBD", 3);
+				}
+			else
+				*-- d = *s;
+			}
+		len += 2 * nuls;
+		}
+	len = norm_chunk(&st, *buf, *buf, len);
+	len += norm_end(&st, *buf + len);
+	if ( opt_tabs )
+		len = norm_tabs(buf, alloc, len);
+	(*buf)[len] = '\0';
+	return len;
+	}
+
 /*
  * Loads the `filename` file into memory and return a pointer to its contents.
- * The pointer must freed by the user.
+ * The pointer must freed by the user. The text is normalized.
  */
 char *loadfile(const char *filename) {
-	int len = -1, c, alloc;
-	FILE *fp;
-	char *buf;
+	struct stat st;
+	size_t	len = 0, alloc;
+	ssize_t	n;
+	char	*buf;
+	int		fd = STDIN_FILENO;
 
-	if ( filename == NULL ) {
-		len = 0;
-		alloc = 1024;
-		buf = (char *) malloc(alloc);
-		while ( (c = fgetc(stdin)) != EOF ) {
-			buf[len] = c;
-			len ++;
-			if ( len >= alloc ) {
-				alloc += 1024;
-				buf = (char *) realloc(buf, alloc);
-				}
+	if ( filename )
+		panicif((fd = open(filename, O_RDONLY)) == -1, "Unable to open '%s'", filename);
+	panicif(fstat(fd, &st) == -1, "fstat failed");
+	if ( S_ISREG(st.st_mode) ) { // all at once
+		alloc = st.st_size + 1;
+		panicif((buf = (char *) malloc(alloc)) == NULL, "out of memory");
+		while ( len < (size_t) st.st_size && (n = read(fd, buf + len, st.st_size - len)) != 0 ) {
+			panicif(n == -1 && errno != EINTR, "read failed");
+			if ( n > 0 ) len += n;
 			}
+		len = norm_buffer(&buf, &alloc, len);
 		}
-	else {
-		panicif((fp = fopen(filename, "r")) == NULL, "Unable to open '%s'", filename);
-		panicif((fseek(fp, 0L, SEEK_END) == -1), "fseek failed");
-		panicif((len = ftell(fp)) == -1, "ftell failed");
-		panicif((fseek(fp, 0L, SEEK_SET) == -1), "fseek failed");
-		buf = (char *) malloc(len+1);
-		panicif((fread(buf, len, 1, fp) == -1), "fread failed");
-		buf[len] = '\0';
-		fclose(fp);
-		if ( man_ofc ) {
-			char pat[256], *np;
-			regex_t regex;
-			int reti;
-			for ( int i = 0; mdic[i].wrong; i ++ ) {
-				strcpy(pat, mdic[i].wrong);
-				reti = regcomp(&regex, pat, REG_EXTENDED | REG_ICASE);
-        		if ( reti == 0 ) { // compilation passed
-					np = regex_find_and_replace(buf, &regex, mdic[i].correct);
-					free(buf);
-					buf = np;
-					regfree(&regex);
-					}
+	else { // stream, a chunk at a time
+		static char chunk[64 * 1024];
+		norm_t	ns = { false, false, 0, 0, false };
+
+		alloc = NORM_MAX(sizeof(chunk)) + 1;
+		panicif((buf = (char *) malloc(alloc)) == NULL, "out of memory");
+		while ( (n = read(fd, chunk, sizeof(chunk))) != 0 ) {
+			if ( n == -1 ) {
+				panicif(errno != EINTR, "read failed");
+				continue;
 				}
+			if ( len + NORM_MAX(n) + 1 > alloc ) {
+				alloc = alloc * 2 + NORM_MAX(n);
+				panicif((buf = (char *) realloc(buf, alloc)) == NULL, "out of memory");
+				}
+			len += norm_chunk(&ns, buf + len, chunk, n);
 			}
+		len += norm_end(&ns, buf + len);
+		buf[len] = '\0';
 		}
-
+	if ( filename )
+		close(fd);
 	return buf;
 	}
 
+/*
+ * creates the directory 'dir' and its parents (mkdir -p)
+ */
+void mkdirs(const char *dir) {
+	char	buf[4096];
+
+	snprintf(buf, sizeof(buf), "%s", dir);
+	for ( char *s = buf + 1; *s; s ++ ) {
+		if ( *s == '/' ) {
+			*s = '\0';
+			mkdir(buf, 0755);
+			*s = '/';
+			}
+		}
+	mkdir(buf, 0755);
+	}
+
+/*
+ * creates a temporary file next to 'path' and opens it for writing;
+ * its name is stored in 'tmpname'. See atomic_close().
+ */
+FILE *atomic_open(const char *path, char *tmpname, size_t size) {
+	int fd;
+	FILE *fp;
+
+	snprintf(tmpname, size, "%s.XXXXXX", path);
+	if ( (fd = mkstemp(tmpname)) == -1 )
+		return NULL;
+	fchmod(fd, 0644);
+	if ( (fp = fdopen(fd, "w")) == NULL ) {
+		close(fd);
+		unlink(tmpname);
+		}
+	return fp;
+	}
+
+/*
+ * returns true if the file 'path' holds the same bytes as the open file
+ * 'fd', or with 'fd' -1, as the 'size' bytes of 'buf'. The files are read
+ * by blocks and the first different block stops the comparison.
+ */
+#define SAME_BLOCK	(64 * 1024)
+bool same_file(const char *path, int fd, const char *buf, size_t size) {
+	struct stat	st;
+	char		*a, *b;
+	int			pfd;
+	bool		same = false;
+	ssize_t		n;
+
+	if ( fd >= 0 ) {
+		if ( fstat(fd, &st) != 0 )
+			return false;
+		size = st.st_size;
+		}
+	if ( (pfd = open(path, O_RDONLY)) == -1 )
+		return false;
+	if ( fstat(pfd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size != size ) {
+		close(pfd);
+		return false;
+		}
+	panicif((a = (char *) malloc(2 * SAME_BLOCK)) == NULL, "out of memory");
+	b = a + SAME_BLOCK;
+	for ( off_t off = 0; ; off += n ) {
+		if ( (n = pread(pfd, a, SAME_BLOCK, off)) <= 0 ) {
+			same = ( n == 0 && (size_t) off == size );
+			break;
+			}
+		if ( fd >= 0 ) {
+			if ( pread(fd, b, n, off) != n || memcmp(a, b, n) != 0 )
+				break;
+			}
+		else if ( (size_t) (off + n) > size || memcmp(a, buf + off, n) != 0 )
+			break;
+		}
+	free(a);
+	close(pfd);
+	return same;
+	}
+
+/*
+ * closes the temporary file 'tmpname' and renames it to 'path', so the
+ * readers see either the old or the new file; returns 0 on success. With
+ * --if-changed a 'path' of the same bytes is left as it is, with its mtime.
+ */
+int atomic_close(FILE *fp, const char *tmpname, const char *path) {
+	int err = ferror(fp);
+
+	if ( opt_if_changed && !err && fflush(fp) == 0 && same_file(path, fileno(fp), NULL, 0) ) {
+		fclose(fp);
+		unlink(tmpname);
+		return 0;
+		}
+	if ( fclose(fp) != 0 || err || rename(tmpname, path) != 0 ) {
+		unlink(tmpname);
+		return -1;
+		}
+	return 0;
+	}
+
 /*
  * adds the string 'str' to buffer 'buf' and returns
  * a pointer to new position in buf.
@@ -265,7 +891,7 @@ const char *println(const char *src) {
 
 	while ( *p ) {
 		if ( !write_lock )
-			putchar(*p);
+			oputc(*p);
 		p ++;
 		if ( *(p-1) == '\n' )
 			break;
@@ -274,77 +900,274 @@ const char *println(const char *src) {
 	}
 
 /*
-*	types of elements
-*/
-enum { none,
-		par_end, ln_brk,
-		cblock_end, cblock_open,
-		li_open, li_end,
-		ol_open, ul_open, lst_close,
-		man_ref, ol, ul,
-		bq_open, bq_close,
-		box_open, box_close,
-		url_mark,
-		tbl_open, tbl_close,
-		new_sh, new_ss, new_s4 };
+ * prints the line of text 'src' like println(), with the -z corrections
+ */
+const char *println_text(const char *src) {
+	const char *p = src, *rp;
+	int n;
+
+	if ( !man_ofc )
+		return println(src);
+	while ( *p ) {
+		if ( (n = zdic_match(p, &rp)) != 0 ) {
+			if ( !write_lock )
+				oprintf("%s", rp);
+			p += n;
+			continue;
+			}
+		if ( !write_lock )
+			oputc(*p);
+		p ++;
+		if ( *(p-1) == '\n' )
+			break;
+		}
+	return p;
+	}
 
 /*
-*	list (enumeration/itemize) stack
-*/
-#define	MAX_LIST_SIZE	32
-int		stk_list[MAX_LIST_SIZE];	// type of list
-int		stk_count[MAX_LIST_SIZE];	// counter of item
-int		stk_list_p = 0;				// top pointer, always points to first free
-int		bq_level = 0, prev_bq_level = 0;
+ *	line index
+ *
+ *	Built in one pass over the document before the conversion: the offset
+ *	of each line, its class and blockquote depth, and the first blank line
+ *	of its paragraph. The block decisions of md2roff() and the line numbers
+ *	of the diagnostics are taken from it instead of scanning the text.
+ */
+enum { LN_TEXT, LN_BLANK, LN_FENCE, LN_HEADER, LN_RULE, LN_ULIST, LN_OLIST };
+
+typedef struct {
+	uint32_t	off;		// offset of the line
+	uint32_t	para;		// the blank line that ends the paragraph
+	uint8_t		cls, level, bq;	// class, header level, blockquote depth
+	} lnent_t;
+
+typedef struct {
+	lnent_t		*tab;
+	int			count, alloc;
+	uint32_t	size;		// of the document
+	} lnidx_t;
+
+static lnidx_t	ln_idx;
+static int		ln_cur;
+static const char *ln_source, *ln_pos;	// the document, the line of the last src_line()
+static int		ln_num;
 
 /*
-*	write the roff code of 'type'
-*/
-void roff(int type, ...) {
-	va_list	ap;
-	char	*title, *link;
-	char	punc;
+ * classifies the line from 'p' to 'e'; the counts stop at 255
+ */
+static void ln_classify(lnent_t *L, const char *p, const char *e) {
+	const char *s;
 
-	if ( write_lock ) {
-		va_start(ap, type);
-		va_end(ap);
-		return;
+	L->level = L->bq = 0;
+	for ( s = p; *s == '>' && L->bq < 255; s ++ )
+		L->bq ++;
+	L->cls = LN_BLANK;
+	for ( const char *b = s; b < e; b ++ )
+		if ( !ch_space(*b) ) {
+			L->cls = LN_TEXT;
+			break;
+			}
+	if ( L->cls == LN_BLANK )
+		;
+	else if ( *s == '#' ) {
+		while ( s[L->level] == '#' && L->level < 255 ) L->level ++;
+		L->cls = LN_HEADER;
 		}
-	va_start(ap, type);
+	else if ( strncmp(s, "```", 3) == 0 )
+		L->cls = LN_FENCE;
+	else if ( strncmp(s, "===", 3) == 0 || strncmp(s, "---", 3) == 0 || strncmp(s, "***", 3) == 0 )
+		L->cls = LN_RULE;
+	else if ( (*s == '*' || *s == '+' || *s == '-') && (s[1] == ' ' || s[1] == '\t') )
+		L->cls = LN_ULIST;
+	else if ( ch_digit(*s) ) {
+		while ( ch_digit(*s) ) s ++;
+		if ( *s == '.' )
+			L->cls = LN_OLIST;
+		}
+	}
 
-	//
-	if ( bq_level != prev_bq_level ) {
-		int i;
-		if ( bq_level < prev_bq_level ) {
-			for ( i = bq_level; i < prev_bq_level; i ++ )
-				puts(".RE");
-			}
-		else {
-			for ( i = prev_bq_level; i < bq_level; i ++ )
-				puts(".RS");
+/*
+ * builds the index of 'source'
+ */
+void ln_build(const char *source) {
+	const char *p = source, *e;
+	size_t	size = strlen(source);
+	lnent_t	*L;
+
+	ln_idx.count = 0;
+	ln_idx.size = size;
+	ln_cur = 0;
+	for ( ;; ) {
+		if ( (e = memchr(p, '\n', source + size - p)) == NULL )
+			e = source + size;
+		if ( ln_idx.count == ln_idx.alloc ) {
+			ln_idx.alloc = ( ln_idx.alloc ) ? ln_idx.alloc * 2 : 1024;
+			ln_idx.tab = (lnent_t *) realloc(ln_idx.tab, ln_idx.alloc * sizeof(lnent_t));
+			panicif(ln_idx.tab == NULL, "out of memory");
 			}
-		prev_bq_level = bq_level;
+		L = &ln_idx.tab[ln_idx.count ++];
+		L->off = p - source;
+		ln_classify(L, p, e);
+		if ( *e == '\0' )
+			break;
+		p = e + 1;
 		}
-	
-	//
-	switch ( type ) {
+	for ( int i = ln_idx.count - 1; i >= 0; i -- ) // the end of the paragraphs
+		ln_idx.tab[i].para = ( ln_idx.tab[i].cls == LN_BLANK || i == ln_idx.count - 1 )
+			? (uint32_t) i : ln_idx.tab[i + 1].para;
+	}
+
+/*
+ * returns the index of the line of 'p'; it is cheap in the order of the
+ * text.
+ */
+int ln_find(const char *p) {
+	uint32_t off = p - ln_source;
+	int		i = ln_cur, lo, hi;
+
+	for ( int k = 0; k < 8 && i + 1 < ln_idx.count && ln_idx.tab[i + 1].off <= off; k ++ )
+		i ++;
+	if ( ln_idx.tab[i].off > off || (i + 1 < ln_idx.count && ln_idx.tab[i + 1].off <= off) ) {
+		for ( lo = 0, hi = ln_idx.count - 1; lo < hi; ) { // binary search
+			int mid = (lo + hi + 1) / 2;
+			if ( ln_idx.tab[mid].off <= off )
+				lo = mid;
+			else
+				hi = mid - 1;
+			}
+		i = lo;
+		}
+	return ln_cur = i;
+	}
+
+/*
+ * returns the end of the line 'i' (the '\n' or the '\0')
+ */
+const char *ln_end(int i) {
+	return ( i + 1 < ln_idx.count ) ? ln_source + ln_idx.tab[i + 1].off - 1 : ln_source + ln_idx.size;
+	}
+
+/*
+ * returns the entry of the line that begins at 'p'; if 'p' is in the
+ * middle of its line, the rest of the line is classified in a copy.
+ */
+const lnent_t *ln_at(const char *p) {
+	static lnent_t	part;
+	int i = ln_find(p);
+
+	if ( p == ln_source + ln_idx.tab[i].off )
+		return &ln_idx.tab[i];
+	part = ln_idx.tab[i];
+	ln_classify(&part, p, ln_end(i));
+	return &part;
+	}
+
+/*
+ * returns the end of the paragraph of 'p', the beginning of the first
+ * blank line after it, or the end of the document.
+ */
+const char *ln_para_end(const char *p) {
+	const lnent_t *L = &ln_idx.tab[ln_idx.tab[ln_find(p)].para];
+	return ( L->cls == LN_BLANK ) ? ln_source + L->off : ln_source + ln_idx.size;
+	}
+
+/*
+ * returns the end of the block of text of 'p', before the next line that
+ * is not text (blank, header, list item, fence, rule) or is in another
+ * blockquote level.
+ */
+const char *em_block(const char *p) {
+	int i = ln_find(p), bq = ln_idx.tab[i].bq;
+
+	while ( i + 1 < ln_idx.count && ln_idx.tab[i + 1].cls == LN_TEXT && ln_idx.tab[i + 1].bq == bq )
+		i ++;
+	return ln_end(i);
+	}
+
+/*
+ * returns the line number of 'p'; 'ln_pos' is set to the beginning of
+ * its line.
+ */
+int src_line(const char *p) {
+	int i = ln_find(p);
+
+	ln_pos = ln_source + ln_idx.tab[i].off;
+	return ln_num = i + 1;
+	}
+
+/*
+*	types of elements
+*/
+enum { none,
+		par_end, ln_brk,
+		cblock_end, cblock_open,
+		li_open, li_end,
+		ol_open, ul_open, lst_close,
+		man_ref, ol, ul,
+		bq_open, bq_close,
+		box_open, box_close,
+		url_mark, img_mark,
+		tbl_open, tbl_close,
+		fn_open, fn_close, fn_item,
+		new_sh, new_ss, new_s4 };
+
+/*
+*	list (enumeration/itemize) stack
+*/
+#define	MAX_LIST_SIZE	32
+int		stk_list[MAX_LIST_SIZE];	// type of list
+int		stk_count[MAX_LIST_SIZE];	// counter of item
+int		stk_list_p = 0;				// top pointer, always points to first free
+int		bq_level = 0, prev_bq_level = 0;
+
+/*
+*	write the roff code of 'type'
+*/
+void roff(int type, ...) {
+	va_list	ap;
+	char	*title, *link;
+	char	punc;
+	int		w, h;
+
+	if ( write_lock ) {
+		va_start(ap, type);
+		va_end(ap);
+		return;
+		}
+	va_start(ap, type);
+
+	//
+	if ( bq_level != prev_bq_level ) {
+		int i;
+		if ( bq_level < prev_bq_level ) {
+			for ( i = bq_level; i < prev_bq_level; i ++ )
+				oputs(".RE");
+			}
+		else {
+			for ( i = prev_bq_level; i < bq_level; i ++ )
+				oputs(".RS");
+			}
+		prev_bq_level = bq_level;
+		}
+	
+	//
+	switch ( type ) {
 	case none:
 		break;
 		
 	// new paragraph
 	case par_end:
 		switch ( mpack ) {
-		case mp_mdoc:	puts(".Pp"); break;
-		default:		puts(".PP");
+		case mp_mdoc:	oputs(".Pp"); break;
+		default:		oputs(".PP");
 			}
 		break;
 
 	// line break
 	case ln_brk:
 		switch ( mpack ) {
-		case mp_mom:	puts(".BR"); break;	// or .br or .EL or .LINEBREAK ????
-		case mp_ms:		puts(".BR"); break;
-		default:		puts(".br");
+		case mp_mom:	oputs(".BR"); break;	// or .br or .EL or .LINEBREAK ????
+		case mp_ms:		oputs(".BR"); break;
+		default:		oputs(".br");
 			}
 		break;
 
@@ -357,76 +1180,95 @@ void roff(int type, ...) {
 		case mp_man:
 			if ( strchr(link, '@') ) {
 				if ( strlen(title) && strcmp(title, link) != 0 )
-					printf(".MT %s\n%s\n", link, title);
+					oprintf(".MT %s\n%s\n", link, title);
 				else
-					printf(".MT %s\n", link);
+					oprintf(".MT %s\n", link);
 				if ( punc )
-					printf(".ME %c\n", punc);
+					oprintf(".ME %c\n", punc);
 				else
-					printf(".ME\n");
+					oprintf(".ME\n");
 				}
 			else {
 				if ( strlen(title) && strcmp(title, link) != 0 )
-					printf(".UR %s\n%s\n", link, title);
+					oprintf(".UR %s\n%s\n", link, title);
 				else
-					printf(".UR %s\n", link);
+					oprintf(".UR %s\n", link);
 				if ( punc )
-					printf(".UE %c\n", punc);
+					oprintf(".UE %c\n", punc);
 				else
-					printf(".UE\n");
+					oprintf(".UE\n");
 				}
 			break;
 		case mp_mdoc:
 			if ( strchr(link, '@') )
-				printf(".An %s Aq Mt %s\n", title, link);
+				oprintf(".An %s Aq Mt %s\n", title, link);
 			else
-				printf(".Lk %s \"%s\"\n", link, title);
+				oprintf(".Lk %s \"%s\"\n", link, title);
 			break;
 		case mp_mm: // there is no such thing...
 		case mp_ms:
-			printf("%s <%s>\n", title, link);
+			oprintf("%s <%s>\n", title, link);
 			break;
 		case mp_mom:
-			printf("%s \\*[UL]%s\\*[ULX]\n", title, link);
+			oprintf("%s \\*[UL]%s\\*[ULX]\n", title, link);
 			}
 		break;
 		
+	// image; the size is in points, 0 = unknown
+	case img_mark:
+		title = va_arg(ap, char *);
+		link = va_arg(ap, char *);
+		w = va_arg(ap, int);
+		h = va_arg(ap, int);
+		if ( w == 0 || mpack == mp_man || mpack == mp_mdoc ) {
+			oprintf("[image: %s]\n", ( *title ) ? title : link);
+			break;
+			}
+		switch ( mpack ) {
+		case mp_mom:
+			oprintf(".PDF_IMAGE %s %dp %dp\n", link, w, h);
+			break;
+		default:
+			oprintf(".PSPIC %s %dp %dp\n", link, w, h);
+			}
+		break;
+
 	// cartouche top
 	case box_open:
 		switch ( mpack ) {
-		case mp_mom: puts(".DRH"); break;
-		case mp_man: puts(".B"); break;
-		case mp_ms: puts(".B1"); break;
-		default: puts(".FT B");
+		case mp_mom: oputs(".DRH"); break;
+		case mp_man: oputs(".B"); break;
+		case mp_ms: oputs(".B1"); break;
+		default: oputs(".FT B");
 			}
 		break;
 
 	// cartouche bottom
 	case box_close:
 		switch ( mpack ) {
-		case mp_mom: puts(".DRH"); break;
-		case mp_ms: puts(".B2"); break;
-		default: puts(".FT P"); 
+		case mp_mom: oputs(".DRH"); break;
+		case mp_ms: oputs(".B2"); break;
+		default: oputs(".FT P"); 
 			}
 		break;
 
 	// code block - begin
 	case cblock_open:
 		switch ( mpack ) {
-		case mp_mom:  printf(".CODE\n"); break;
-		case mp_mdoc: printf(".Bd -literal -offset indent\n"); break;
-		case mp_ms: puts(".DS I"); break;
-		default: printf(".in +4n\n.EX\n");
+		case mp_mom:  oprintf(".CODE\n"); break;
+		case mp_mdoc: oprintf(".Bd -literal -offset indent\n"); break;
+		case mp_ms: oputs(".DS I"); break;
+		default: oprintf(".in +4n\n.EX\n");
 			}
 		break;
 
 	// code block - end
 	case cblock_end:
 		switch ( mpack ) {
-		case mp_mom:  printf(".CODE OFF\n"); break;
-		case mp_mdoc: printf(".Ed\n"); break;
-		case mp_ms: puts(".DE"); break;
-		default: printf(".EE\n.in\n");
+		case mp_mom:  oprintf(".CODE OFF\n"); break;
+		case mp_mdoc: oprintf(".Ed\n"); break;
+		case mp_ms: oputs(".DE"); break;
+		default: oprintf(".EE\n.in\n");
 			}
 		break;
 
@@ -438,16 +1280,16 @@ void roff(int type, ...) {
 		switch ( mpack ) {
 		case mp_mom:
 			switch ( stk_list_p ) {
-			case 1: puts(".LIST DIGIT"); break;
-			case 2: puts(".LIST ALPHA"); break;
-			case 3: puts(".LIST DIGIT"); break;
-			case 4:	puts(".LIST alpha"); break;
+			case 1: oputs(".LIST DIGIT"); break;
+			case 2: oputs(".LIST ALPHA"); break;
+			case 3: oputs(".LIST DIGIT"); break;
+			case 4:	oputs(".LIST alpha"); break;
 			default:
-				puts(".LIST DIGIT");
+				oputs(".LIST DIGIT");
 				};
 			break;
-		case mp_mdoc: puts(".Bl -enum -offset indent"); break;
-		case mp_mm: puts(".AL"); break;
+		case mp_mdoc: oputs(".Bl -enum -offset indent"); break;
+		case mp_mm: oputs(".AL"); break;
 			}
 		break;
 
@@ -458,87 +1300,120 @@ void roff(int type, ...) {
 		stk_list_p ++;
 		switch ( mpack ) {
 		case mp_mom:
-			printf(".LIST %s", ((stk_list_p % 2) ? "BULLET" : "DASH"));
+			oprintf(".LIST %s", ((stk_list_p % 2) ? "BULLET" : "DASH"));
 			break;
 		case mp_mdoc:
-			printf(".Bl -%s -offset indent", ((stk_list_p % 2) ? "bullet" : "dash"));
+			oprintf(".Bl -%s -offset indent", ((stk_list_p % 2) ? "bullet" : "dash"));
 			break;
-		case mp_mm:	puts(".BL");
+		case mp_mm:	oputs(".BL");
 			}
 		break;
 
 	// close list
 	case lst_close:
 		switch ( mpack ) {
-		case mp_mom:  puts(".LIST OFF"); break;
-		case mp_mdoc: puts(".El");
+		case mp_mom:  oputs(".LIST OFF"); break;
+		case mp_mdoc: oputs(".El");
 			}
 		break;
 
 	// list item - begin
 	case li_open:
 		switch ( mpack ) {
-		case mp_mom:  puts(".ITEM"); break;
-		case mp_mdoc: puts(".It"); break;
+		case mp_mom:  oputs(".ITEM"); break;
+		case mp_mdoc: oputs(".It"); break;
 		case mp_man:
 		case mp_ms:
 			if ( stk_list_p ) {
 				if ( stk_list[stk_list_p-1] == ul )
-					puts(".IP \\(bu 4");
+					oputs(".IP \\(bu 4");
 				else {
-					printf(".IP %d. 4\n", stk_count[stk_list_p-1]);
+					oprintf(".IP %d. 4\n", stk_count[stk_list_p-1]);
 					stk_count[stk_list_p-1] ++;
 					}
 				}
 			break;
-		default: puts(".LI");
+		default: oputs(".LI");
 			}
 		break;
 		
 	// list item - end
 	case li_end:
-		if ( mpack == mp_mm ) puts(".LE");
+		if ( mpack == mp_mm ) oputs(".LE");
 		break;
 
 	// new big header/section
 	case new_sh:
 		switch ( mpack ) {
-		case mp_mom:  printf(".HEADING 1 \""); break;
-		case mp_mdoc: printf(".Sh "); break;
-		case mp_ms: puts(".SH "); break; /* .SH\n...\n.LP|.PP\n */
-		default: printf(".SH ");
+		case mp_mom:  oprintf(".HEADING 1 \""); break;
+		case mp_mdoc: oprintf(".Sh "); break;
+		case mp_ms: oputs(".SH "); break; /* .SH\n...\n.LP|.PP\n */
+		default: oprintf(".SH ");
 			}
 		break;
 
 	// new medium header/secrtion
 	case new_ss:
 		switch ( mpack ) {
-		case mp_mom:  printf(".HEADING 2 \""); break;
-		case mp_mdoc: printf(".Ss "); break;
-		case mp_ms: puts(".SH "); break;
-		default: printf(".SS ");
+		case mp_mom:  oprintf(".HEADING 2 \""); break;
+		case mp_mdoc: oprintf(".Ss "); break;
+		case mp_ms: oputs(".SH "); break;
+		default: oprintf(".SS ");
 			}
 		break;
 
 	// new small header/secrtion
 	case new_s4:
 		switch ( mpack ) {
-		case mp_mom:  printf(".HEADING 3 \""); break;
-		case mp_ms: puts(".SH "); break;
-		case mp_mdoc: printf(".Ss "); break;
-		default: printf(".SS ");
+		case mp_mom:  oprintf(".HEADING 3 \""); break;
+		case mp_ms: oputs(".SH "); break;
+		case mp_mdoc: oprintf(".Ss "); break;
+		default: oprintf(".SS ");
+			}
+		break;
+
+	// table, 'align' is one of 'l', 'c', 'r' per column
+	case tbl_open: {
+		int ncols = va_arg(ap, int);
+		const char *align = va_arg(ap, const char *);
+		oprintf(".TS\nallbox tab(\t);\n");
+		for ( int i = 0; i < ncols; i ++ )	// header row
+			oprintf("%s%cB", (i) ? " " : "", align[i]);
+		oprintf("\n");
+		for ( int i = 0; i < ncols; i ++ )	// body rows
+			oprintf("%s%c", (i) ? " " : "", align[i]);
+		oprintf(" .\n");
+		}
+		break;
+	case tbl_close:
+		switch ( mpack ) {
+		default: oprintf(".TE\n");
 			}
 		break;
 
-	// table
-	case tbl_open:
+	// footnote
+	case fn_open:
 		switch ( mpack ) {
-		default: printf(".TS\ntab(|);\n.\n");
+		case mp_mom: oputs(".FOOTNOTE"); break;
+		case mp_ms:
+		case mp_mm: oputs(".FS"); break;
+		default: break;
 			}
 		break;
-	case tbl_close:
+	case fn_close:
 		switch ( mpack ) {
-		default: printf(".TE\n");
+		case mp_mom: oputs(".FOOTNOTE OFF"); break;
+		case mp_ms:
+		case mp_mm: oputs(".FE"); break;
+		default: break;
+			}
+		break;
+
+	// item of the NOTES section (man, mdoc)
+	case fn_item:
+		switch ( mpack ) {
+		case mp_mdoc: oputs(".It"); break;
+		default: oprintf(".IP \" %d.\" 4\n", va_arg(ap, int));
 			}
 		break;
 
@@ -547,24 +1422,24 @@ void roff(int type, ...) {
 		link = va_arg(ap, char *);
 		punc = va_arg(ap, int);
 		switch ( mpack ) {
-		case mp_mdoc: printf(".Xr %s\n", link); break;
+		case mp_mdoc: oprintf(".Xr %s\n", link); break;
 		case mp_man: {
 			char *tmp = strdup(link);
 			char *p = strchr(tmp, ' ');
 			if ( p ) {
 				*p = '\0';
-				printf(".BR %s (%s)", tmp, p+1);
+				oprintf(".BR %s (%s)", tmp, p+1);
 				}
 			else
-				printf(".BR %s", link);
+				oprintf(".BR %s", link);
 			free(tmp);
 			if ( punc )
-				printf("%c\n", punc);
+				oprintf("%c\n", punc);
 			else
-				printf("\n");
+				oprintf("\n");
 			}
 			break;
-		default: printf("%s\n", link);
+		default: oprintf("%s\n", link);
 			}
 		break;
 		}
@@ -579,11 +1454,11 @@ char *flushln(char *d, char *bf) {
 	if ( d > bf ) {
 		*d = '\0';
 		d = bf;
-		while ( isspace(*d) )
+		while ( ch_space(*d) )
 			d ++;
 		if ( *d ) {
 			char *z = sqzdup(d);
-			if ( !write_lock ) puts(z);
+			if ( !write_lock ) oputs(z);
 			free(z);
 			}
 		}
@@ -591,491 +1466,2801 @@ char *flushln(char *d, char *bf) {
 	}
 
 /*
- *	this converts the file 'docname',
- *	that is loaded in 'source', to *-roff.
+ *	strong and emphasis
+ *
+ *	The delimiter runs of '*' and '_' of a block are paired as CommonMark
+ *	does: the flanking of a run tells if it can open and/or close, the
+ *	closers are taken from left to right and each one looks back on the
+ *	stack for the nearest opener of the same character; two characters are
+ *	matched when both runs have them (strong), otherwise one (emphasis). A
+ *	bottom is kept for each kind of closer, below it the search already
+ *	failed, so the block is resolved in linear time whatever the number of
+ *	stray delimiters. The characters that are not matched are plain text.
+ *	With -q (!std_q), '*' is strong and '_' is emphasis, whatever the
+ *	number of characters matched.
  */
-#define KEY_GNUSYN "SYNTAX:"
-#define KEY_NDCCMD "COMMAND:"
-static char *month[] = {
-"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
-NULL };
+#define EM_MAX_RUNS		8192	// runs of a block, the rest are plain text
 
-//
-#define MAX_STR	255
-const char *get_man_header(const char *source, char *name, char *section, char *date) {
-	const char *p = source;
-	char *d;
-	
-	while ( isblank(*p) ) p ++;
-	d = name;
-	while ( *p ) {
-		if ( isspace(*p) ) break;
-		if ( d - name >= MAX_STR ) break;
-		*d ++ = toupper(*p ++);
-		}
-	*d = '\0';
-	
-	while ( isblank(*p) ) p ++;
-	d = section;
-	while ( *p ) {
-		if ( isspace(*p) ) break;
-		if ( d - section >= MAX_STR ) break;
-		*d ++ = *p ++;
-		}
-	*d = '\0';
-	
-	while ( isblank(*p) ) p ++;
-	if ( *p != '\n' ) {
-		d = date;
-		while ( *p ) {
-			if ( isspace(*p) ) break;
-			if ( d - date >= MAX_STR ) break;
-			*d ++ = *p ++;
+typedef struct {
+	uint32_t	off;			// from the beginning of the block
+	uint32_t	len, left;		// length, characters not matched
+	int			prev, next;		// on the stack, -1 = none
+	int			op, nops;		// its matches in 'ops'
+	char		ch;
+	bool		can_open, can_close;
+	} em_run_t;
+
+typedef struct {
+	int			run;
+	uint8_t		n, open;		// characters, opener or closer
+	} em_op_t;
+
+typedef struct {
+	em_run_t	*runs;
+	em_op_t		*ops, *sorted;
+	int			count, alloc, nops, ops_alloc, cur;
+	const char	*base, *end;	// the block
+	int			strong, emph, changes;	// of the output: depths, font changes
+	} em_block_t;
+
+static em_block_t	em_text, em_cell;	// md2roff(), put_inline()
+static const bool	em_stop[256] = { ['\\'] = 1, ['`'] = 1, ['['] = 1, ['*'] = 1, ['_'] = 1 };
+
+bool link_ref(const char *label, int len);
+
+// of the classes of ch_class()
+#define em_space(k)		((k) & CH_SPACE)
+#define em_punct(k)		((k) & CH_PUNCT)
+
+// the class of the character before 'p' in the block 's', or of 'prev'
+static int em_before(const char *s, const char *p, int prev) {
+	const char *t = p - 1;
+
+	if ( p == s )
+		return ( prev == 0 ) ? CH_SPACE : ch_is(prev, CH_SPACE | CH_PUNCT);
+	while ( t > s && ch_is(*t, CH_CONT) && p - t < 4 )
+		t --;
+	return ch_class(t, p);
+	}
+
+/*
+ * returns the end of the link that begins at 'p' as md2roff() converts it,
+ * or NULL.
+ */
+static const char *em_link(const char *p, const char *e) {
+	const char *t = p + 1, *q, *r;
+
+	if ( (q = memchr(t, ']', e - t)) == NULL )
+		return NULL;
+	if ( q + 1 < e && q[1] == '(' && (r = memchr(q + 2, ')', e - (q + 2))) != NULL )
+		return r + 1;
+	if ( q + 1 < e && q[1] == '[' ) {
+		for ( r = q + 2; r < e && *r != ']' && *r != '\n'; r ++ );
+		if ( r < e && *r == ']' ) {
+			if ( r > q + 2 )
+				return ( link_ref(q + 2, r - (q + 2)) ) ? r + 1 : NULL;
+			return ( link_ref(t, q - t) ) ? r + 1 : NULL;
 			}
-		*d = '\0';
 		}
-	else {
-		time_t tt = time(0);   // get time now
-		struct tm *t = localtime(&tt);
-		sprintf(date, "%s %d %d", month[t->tm_mon], t->tm_mday,  t->tm_year+1900);
+	return ( link_ref(t, q - t) ) ? q + 1 : NULL;
+	}
+
+static void em_op(em_block_t *b, int run, int n, int open) {
+	if ( b->nops == b->ops_alloc ) {
+		b->ops_alloc = ( b->ops_alloc ) ? b->ops_alloc * 2 : 256;
+		b->ops = (em_op_t *) realloc(b->ops, b->ops_alloc * sizeof(em_op_t));
+		b->sorted = (em_op_t *) realloc(b->sorted, b->ops_alloc * sizeof(em_op_t));
+		panicif(b->ops == NULL || b->sorted == NULL, "out of memory");
 		}
-	
-	return p;
+	b->ops[b->nops].run = run;
+	b->ops[b->nops].n = n;
+	b->ops[b->nops ++].open = open;
 	}
 
-#define dcopy(c) { for ( const char *s = (c); *s; *d ++ = *s ++ ); }
-void md2roff(const char *docname, const char *source) {
-	const char *p = source, *pnext, *pstart;
-	char	*dest, *d;
-	bool	bline = true, bcode = false;
-	bool	bold = false, italics = false;
-	bool	inside_list = false;
-	bool	title_level = 0;
-	char	secname[256], appname[256], appsec[256], appdate[256];
+static void em_unlink(em_run_t *r, int i) {
+	if ( r[i].prev >= 0 ) r[r[i].prev].next = r[i].next;
+	if ( r[i].next >= 0 ) r[r[i].next].prev = r[i].prev;
+	}
 
-	stk_list_p = 0; // reset stack
-	secname[0] = '\0';
-	dest = (char *) malloc(64*1024);
-	d = dest;
+/*
+ * pairs the delimiters of the block 's'..'e'; 'prev' is the character
+ * before it. Inline code and, with 'links', the links are skipped as
+ * md2roff() does.
+ */
+void em_resolve(em_block_t *b, const char *s, const char *e, int prev, bool links) {
+	const char *p = s, *q;
+	int		bottom[2][2][3], last = -1;
 
-	puts(".\\# roff document");
-	puts(".\\# DO NOT MODIFY THIS FILE! It was generated by md2roff");
-	switch ( mpack ) {
-	case mp_mm:
-		puts(".do mso m.tmac"); // mm package, AL BL DL LI LE
-		break;
-	case mp_ms:
-		puts(".do mso ms.tmac"); // ms package
-		while ( isspace(*p) ) p ++;
-		if ( p[0] == '#' && isblank(p[1]) ) {
-			puts(".TL");
+	b->base = s;
+	b->end = e;
+	b->count = b->nops = b->cur = 0;
+	b->strong = b->emph = b->changes = 0;
+	while ( p < e ) {
+		while ( p < e && !em_stop[(unsigned char) *p] )
+			p ++;
+		if ( p == e )
+			break;
+		if ( *p == '\\' ) {
 			p += 2;
-			char *pn = (char *) p;
-			while ( *pn && *pn != '\n' ) pn ++;
-			*pn = '\0';
-			puts(p);
-			p = (const char*) (pn + 1);
-			puts(".\\# .AU");
-			puts(".\\# Author");
-			puts(".\\# .AI");
-			puts(".\\# Author's institution(s)");
-			puts(".\\# .ND date");
-			puts(".\\# .AB");
-			puts(".\\# Abstract; to be placed on the cover sheet of a paper.");
-			puts(".\\# Line length is 5/6 of normal; use .11 here to change.");
-			puts(".\\# .AE");
-			puts(".PP");
+			continue;
 			}
-		break;
-	case mp_mdoc:
-	case mp_man:
-		if ( mpack == mp_mdoc )
-			puts(".do mso mdoc.tmac"); // BSD man
-		else
-			puts(".do mso man.tmac"); // Linux man
-		
-		while ( isspace(*p) ) p ++;
-		if ( p[0] == '#' && isblank(p[1]) ) {
-			p = get_man_header(p+2, appname, appsec, appdate);
-			if ( mpack == mp_mdoc ) {
-				printf(".Dd $Mdocdate: %s $\n", appdate);
-				printf(".Dt %s %s\n", appname, appsec);
-				printf(".Os\n");
-				while ( *p != '\n' ) p ++;
-				}
-			else { // linux man
-				printf(".TH %s %s %s", appname, appsec, appdate);
-				if ( *p != '\n' )
-					p = println(p);
-				else
-					printf("\n");
+		if ( *p == '`' ) {
+			if ( (q = memchr(p + 1, '`', e - (p + 1))) != NULL ) {
+				p = q + 1;
+				continue;
 				}
-			while ( isspace(*p) ) p ++;
 			}
-		else { // no header specified
-			time_t tt = time(0);   // get time now
-			struct tm *t = localtime(&tt);
-			
-			strcpy(appname, docname);
-			if ( mpack == mp_mdoc ) {
-				printf(".Dd $Mdocdate: %s %d %d $\n",
-					month[t->tm_mon], t->tm_mday,  t->tm_year+1900);
-				printf(".Dt %s %s\n", appname, "7");
-				printf(".Os\n");
-				}
-			else {
-				printf(".TH %s 7 %d-%02d-%02d document\n", docname,
-					t->tm_year+1900, t->tm_mon+1, t->tm_mday);
-				}
+		else if ( links && *p == '[' && p[1] != '^' && (q = em_link(p, e)) != NULL ) {
+			p = q;
+			continue;
 			}
-		break;
-	case mp_mom:
-		puts(".do mso mom.tmac"); // mom
-		printf(".TITLE \"%s\"\n", docname);
-		printf(".AUTHOR \"md2roff\"\n");
-		printf(".PAPER A4\n");
-		printf(".PRINTSTYLE TYPESET\n");
-		printf(".START\n");
-		break;
-		}
-
-	while ( *p ) {
+		else if ( (*p == '*' || *p == '_') && b->count < EM_MAX_RUNS ) {
+			int		pc = em_before(s, p, prev), nc;
+			bool	left, right;
+			em_run_t *r;
 
-		//////////////////////////////////
-		// inside code block
-		//////////////////////////////////
-		if ( bcode ) {
-			d = flushln(d, dest); // we dont care
-			
-			if ( strncmp(p, "```", 3) == 0 ) { // end of code-block
-				p += 3;
-				while ( *p != '\n' ) p ++;
-				if ( *p == '\n' ) p ++;
-				bcode = false;
-				roff(cblock_end);
-				d = flushln(d, dest);
-				continue;
-				}
-			else {
-				bool xchg_dot = false;
-				if ( *p == '.' ) {
-					if ( mpack == mp_mom )
-						puts(".ESC_CHAR !");
-					else
-						puts(".cc !");
-					xchg_dot = true;
+			for ( q = p; q < e && *q == *p; q ++ );
+			nc = ( q < e ) ? ch_class(q, e) : CH_SPACE;
+			left = !em_space(nc) && (!em_punct(nc) || em_space(pc) || em_punct(pc));
+			right = !em_space(pc) && (!em_punct(pc) || em_space(nc) || em_punct(nc));
+			if ( left || right ) {
+				if ( b->count == b->alloc ) {
+					b->alloc = ( b->alloc ) ? b->alloc * 2 : 64;
+					b->runs = (em_run_t *) realloc(b->runs, b->alloc * sizeof(em_run_t));
+					panicif(b->runs == NULL, "out of memory");
 					}
-				p = println(p);
-				if ( xchg_dot ) {
-					if ( mpack == mp_mom )
-						puts(".ESC_CHAR .");
-					else
-						puts("!cc .");
+				r = &b->runs[b->count];
+				r->off = p - s;
+				r->len = r->left = q - p;
+				r->ch = *p;
+				r->nops = 0;
+				if ( *p == '*' ) {
+					r->can_open = left;
+					r->can_close = right;
 					}
-				continue;
+				else {
+					r->can_open = left && (!right || em_punct(pc));
+					r->can_close = right && (!left || em_punct(nc));
+					}
+				r->prev = last;
+				r->next = -1;
+				if ( last >= 0 )
+					b->runs[last].next = b->count;
+				last = b->count ++;
 				}
+			p = q;
+			continue;
 			}
+		p ++;
+		}
 
-		//////////////////////////////////
-		// ignore escape characters
-		if ( *p == '\\' ) {
-			p ++;
-			switch (*p) {
-			case 'n': *d ++ = '\n'; break;
-			case 'r': *d ++ = '\r'; break;
-			case 't': *d ++ = '\t'; break;
-			case 'f': *d ++ = '\f'; break;
-			case 'b': *d ++ = '\b'; break;
-			case 'a': *d ++ = '\a'; break;
-			case 'e': *d ++ = '\033'; break;
-			default:
-				*d ++ = *p;
-				}
-			p ++;
-			bline = false;
+	// the closers, from left to right
+	for ( int i = 0; i < 2 * 2 * 3; i ++ )
+		(&bottom[0][0][0])[i] = -1;
+	for ( int c = ( b->count ) ? 0 : -1; c >= 0; ) {
+		em_run_t *cr = &b->runs[c];
+		int		*bot, o;
+
+		if ( !cr->can_close ) {
+			c = cr->next;
 			continue;
 			}
-		
-		//////////////////////////////////
-		// beginning of line
-		//////////////////////////////////
-		if ( bline ) {
-			bline = false;
-			bq_level = 0;
-			if ( *p == '>' ) { // open blockquote
-				while ( *p == '>' ) { p ++; bq_level ++; }
-				d = flushln(d, dest);
-				roff(none);
-				d = flushln(d, dest);
+		bot = &bottom[cr->ch == '_'][cr->can_open][cr->len % 3];
+		for ( o = cr->prev; o > *bot; o = b->runs[o].prev ) {
+			em_run_t *or = &b->runs[o];
+			if ( or->ch == cr->ch && or->can_open
+					&& !((or->can_close || cr->can_open) && (or->len + cr->len) % 3 == 0
+						&& (or->len % 3 || cr->len % 3)) )
+				break;
+			}
+		if ( o > *bot ) {
+			em_run_t *or = &b->runs[o];
+			int n = ( or->left >= 2 && cr->left >= 2 ) ? 2 : 1;
+
+			em_op(b, o, n, 1);
+			em_op(b, c, n, 0);
+			or->left -= n;
+			cr->left -= n;
+			or->next = c;	// the runs between them are text
+			cr->prev = o;
+			if ( or->left == 0 )
+				em_unlink(b->runs, o);
+			if ( cr->left == 0 ) {
+				em_unlink(b->runs, c);
+				c = cr->next;
 				}
+			}
+		else {
+			*bot = cr->prev;
+			o = cr->next;
+			if ( !cr->can_open )
+				em_unlink(b->runs, c);
+			c = o;
+			}
+		}
 
-			//
-			if ( *p == '\n' ) { // empty line
-				d = flushln(d, dest);
-				
-				if ( stk_list_p ) {
-					roff(li_end);
-					roff(lst_close);
-					stk_list_p --;
+	// the matches of each run, in their order
+	for ( int i = 0; i < b->nops; i ++ )
+		b->runs[b->ops[i].run].nops ++;
+	for ( int i = 0, n = 0; i < b->count; i ++ ) {
+		b->runs[i].op = n;
+		n += b->runs[i].nops;
+		b->runs[i].nops = 0;
+		}
+	for ( int i = 0; i < b->nops; i ++ ) {
+		em_run_t *r = &b->runs[b->ops[i].run];
+		b->sorted[r->op + r->nops ++] = b->ops[i];
+		}
+	}
+
+/*
+ * the font of the output after a match of 'n' characters of 'ch'
+ */
+static char *em_font(em_block_t *b, char *d, int ch, int n, int dir) {
+	bool	mom = (mpack == mp_mom);
+	int		ws = b->strong > 0, we = b->emph > 0;
+
+	if ( (std_q) ? n == 2 : ch == '*' )
+		b->strong += dir;
+	else
+		b->emph += dir;
+	if ( ws == (b->strong > 0) && we == (b->emph > 0) )
+		return d;
+	if ( b->strong == 0 && b->emph == 0 ) {
+		if ( b->changes == 1 )
+			d = stradd(d, (mom) ? "\\*[PREV]" : "\\fP");
+		else
+			d = stradd(d, (mom) ? "\\*[ROM]" : "\\fR");
+		b->changes = 0;
+		return d;
+		}
+	if ( b->strong && b->emph )
+		d = stradd(d, (mom) ? "\\*[BDI]" : "\\f(BI");
+	else if ( b->strong )
+		d = stradd(d, (mom) ? "\\*[BD]" : "\\fB");
+	else
+		d = stradd(d, (mom) ? "\\*[IT]" : "\\fI");
+	b->changes ++;
+	return d;
+	}
+
+/*
+ * returns the roff text of the delimiter run at 'p' of the block and
+ * stores its length in 'len'; the closers are first, then the characters
+ * that are text and the openers. With 'space', a space is written before
+ * an opener that follows ',', ';' or '.'.
+ */
+const char *em_put(em_block_t *b, const char *p, int *len, bool space) {
+	static char	*buf;
+	static size_t alloc;
+	em_run_t	*r;
+	char		*d;
+	size_t		need;
+
+	if ( b->cur && b->base + b->runs[b->cur - 1].off >= p )
+		b->cur = 0;
+	while ( b->cur < b->count && b->base + b->runs[b->cur].off < p )
+		b->cur ++;
+	r = &b->runs[b->cur];
+	need = ( b->cur < b->count ) ? r->len + r->nops * 8 + 2 : 2;
+	if ( need > alloc ) {
+		alloc = need + 64;
+		buf = (char *) realloc(buf, alloc);
+		panicif(buf == NULL, "out of memory");
+		}
+	if ( b->cur == b->count || b->base + r->off != p ) {
+		buf[0] = *p;
+		buf[1] = '\0';
+		*len = 1;
+		return buf;
+		}
+	d = buf;
+	for ( int i = 0; i < r->nops; i ++ )
+		if ( !b->sorted[r->op + i].open )
+			d = em_font(b, d, r->ch, b->sorted[r->op + i].n, -1);
+	if ( space && d == buf && r->left == 0 && r->nops && p > b->base && strchr(",;.", p[-1]) )
+		*d ++ = ' ';
+	for ( uint32_t i = 0; i < r->left; i ++ )
+		*d ++ = r->ch;
+	for ( int i = r->nops - 1; i >= 0; i -- )
+		if ( b->sorted[r->op + i].open )
+			d = em_font(b, d, r->ch, b->sorted[r->op + i].n, 1);
+	*d = '\0';
+	*len = r->len;
+	b->cur ++;
+	return buf;
+	}
+
+/*
+ * writes the 'len' bytes of 's' as one line of text, with inline code,
+ * strong and emphasis; used for table cells and footnotes.
+ */
+void put_inline(const char *s, int len) {
+	const char *e = s + len, *rp;
+	bool	code = false;
+	int		n;
+	bool	mom = (mpack == mp_mom);
+
+	if ( len && (*s == '.' || *s == '\'') )
+		oprintf("\\&");
+	em_resolve(&em_cell, s, e, ' ', false);
+	while ( s < e ) {
+		if ( *s == '\\' ) { // GFM: only the ASCII punctuation is escaped, '|' also in code
+			if ( s + 1 < e && ((!code && ch_punct(s[1])) || s[1] == '|') ) {
+				if ( s[1] == '\\' )
+					oprintf("\\e");
+				else
+					oputc(s[1]);
+				s += 2;
+				}
+			else {
+				oprintf("\\e");
+				s ++;
+				}
+			continue;
+			}
+		if ( *s == '`' ) {
+			code = !code;
+			if ( code )
+				oprintf("%s", (mom) ? "\\*[CODE]" : "\\f[CR]");
+			else
+				oprintf("%s", (mom) ? "\\*[CODE OFF]" : "\\fP");
+			s ++;
+			continue;
+			}
+		if ( !code && (*s == '*' || *s == '_') ) {
+			oprintf("%s", em_put(&em_cell, s, &n, false));
+			s += n;
+			continue;
+			}
+		if ( *s == '\n' ) { // joined lines
+			oputc(' ');
+			s ++;
+			while ( s < e && ch_blank(*s) ) s ++;
+			continue;
+			}
+		if ( man_ofc && !code && (n = zdic_match(s, &rp)) != 0 && s + n <= e ) {
+			oprintf("%s", rp);
+			s += n;
+			continue;
+			}
+		oputc(( ch_space(*s) ) ? ' ' : *s);
+		s ++;
+		}
+	if ( code )
+		oprintf("%s", (mom) ? "\\*[PREV]" : "\\fR");
+	}
+
+/*
+ *	GFM pipe tables
+ *
+ *	The tbl format line must be written before the data, so the rows are
+ *	buffered; each cell is kept as an (offset, length) span into the
+ *	source, thus the memory is proportional to the table and nothing is
+ *	copied until the output.
+ */
+#define MAX_TBL_COLS	64
+typedef struct { int off, len; } span_t;
+
+/*
+ * returns the end of the line that begins at 'p' (the '\n' or the '\0')
+ */
+static const char *eoln(const char *p) {
+	const char *e = strchr(p, '\n');
+	return ( e ) ? e : p + strlen(p);
+	}
+
+/*
+ * splits the row 'p'..'e' to cells, stores up to 'max' of them in 'cells'
+ * as spans relative to 'base' and returns the number of cells found.
+ */
+static int tbl_split(const char *base, const char *p, const char *e, span_t *cells, int max) {
+	const char *s, *t;
+	int n = 0;
+
+	while ( p < e && ch_blank(*p) ) p ++;
+	if ( p < e && *p == '|' ) p ++;
+	while ( p < e ) {
+		s = p;
+		while ( p < e && *p != '|' ) {
+			if ( *p == '\\' && p + 1 < e ) p ++;
+			p ++;
+			}
+		t = p;
+		while ( s < t && ch_space(*s) ) s ++;
+		while ( t > s && ch_space(*(t-1)) ) t --;
+		if ( p == e && s == t && n ) // spaces after the last '|'
+			break;
+		if ( n < max ) {
+			cells[n].off = s - base;
+			cells[n].len = t - s;
+			}
+		n ++;
+		if ( p < e ) p ++;
+		}
+	return n;
+	}
+
+/*
+ * if the line 'p'..'e' is a delimiter row (| :-- | :-: | --: |), stores
+ * the alignment of each column in 'align' and returns the number of
+ * columns; otherwise returns 0.
+ */
+static int tbl_delim(const char *p, const char *e, char *align) {
+	int		n = 0, dashes;
+	bool	pipe = false, lc, rc;
+
+	while ( p < e && ch_blank(*p) ) p ++;
+	if ( p < e && *p == '|' ) { pipe = true; p ++; }
+	while ( p < e ) {
+		lc = rc = false;
+		dashes = 0;
+		while ( p < e && ch_blank(*p) ) p ++;
+		if ( p < e && *p == ':' ) { lc = true; p ++; }
+		while ( p < e && *p == '-' ) { dashes ++; p ++; }
+		if ( p < e && *p == ':' ) { rc = true; p ++; }
+		while ( p < e && ch_space(*p) ) p ++;
+		if ( dashes == 0 ) {
+			if ( p == e && n && !lc && !rc ) // spaces after the last '|'
+				break;
+			return 0;
+			}
+		if ( n == MAX_TBL_COLS )
+			return 0;
+		align[n ++] = ( lc && rc ) ? 'c' : (( rc ) ? 'r' : 'l');
+		if ( p < e ) {
+			if ( *p != '|' )
+				return 0;
+			pipe = true;
+			p ++;
+			}
+		}
+	align[n] = '\0';
+	return ( pipe ) ? n : 0;
+	}
+
+/*
+ * returns the number of columns if a table (header and delimiter row)
+ * begins at 'p', otherwise 0.
+ */
+int tbl_detect(const char *p, char *align) {
+	const char *e = eoln(p), *e2;
+	span_t	hdr[MAX_TBL_COLS];
+	int		ncols;
+
+	if ( *e != '\n' || memchr(p, '|', e - p) == NULL )
+		return 0;
+	e2 = eoln(e + 1);
+	if ( (ncols = tbl_delim(e + 1, e2, align)) == 0 )
+		return 0;
+	return ( tbl_split(p, p, e, hdr, MAX_TBL_COLS) == ncols ) ? ncols : 0;
+	}
+
+/*
+ * writes the text of a cell
+ */
+static void tbl_cell(const char *s, int len) {
+	if ( len > 40 )	// let tbl fill long cells
+		oprintf("T{\n");
+	put_inline(s, len);
+	if ( len > 40 )
+		oprintf("\nT}");
+	}
+
+/*
+ * writes a table row
+ */
+static void tbl_row(const char *base, const span_t *cells, int ncols) {
+	for ( int i = 0; i < ncols; i ++ ) {
+		if ( i ) oputc('\t');
+		tbl_cell(base + cells[i].off, cells[i].len);
+		}
+	oputc('\n');
+	}
+
+/*
+ * true if the line 'p' is a row of the body of a table
+ */
+static bool tbl_row_at(const char *p) {
+	while ( ch_blank(*p) ) p ++;
+	return !( *p == '\n' || *p == '\0' || *p == '#' || *p == '>' || strncmp(p, "```", 3) == 0 );
+	}
+
+/*
+ * converts the table that begins at 'p' and returns the pointer to the
+ * next line after it.
+ */
+const char *tbl_convert(const char *p, int ncols, const char *align) {
+	const char *base = p, *e;
+	span_t	hdr[MAX_TBL_COLS], *rows = NULL, *r;
+	int		nrows = 0, alloc = 0, n;
+
+	e = eoln(p);
+	tbl_split(base, p, e, hdr, ncols);
+	p = eoln(e + 1);	// skip delimiter row
+	if ( *p ) p ++;
+
+	// collect the body rows
+	while ( *p && tbl_row_at(p) ) {
+		if ( nrows == alloc ) {
+			alloc = ( alloc ) ? alloc * 2 : 64;
+			rows = (span_t *) realloc(rows, sizeof(span_t) * alloc * ncols);
+			panicif(rows == NULL, "out of memory");
+			}
+		r = rows + nrows * ncols;
+		e = eoln(p);
+		n = tbl_split(base, p, e, r, ncols);
+		for ( ; n < ncols; n ++ )
+			r[n].off = r[n].len = 0;
+		nrows ++;
+		p = ( *e ) ? e + 1 : e;
+		}
+
+	// output
+	if ( !write_lock ) {
+		roff(tbl_open, ncols, align);
+		tbl_row(base, hdr, ncols);
+		for ( int i = 0; i < nrows; i ++ )
+			tbl_row(base, rows + i * ncols, ncols);
+		roff(tbl_close);
+		}
+	free(rows);
+	return p;
+	}
+
+/*
+ *	highlighting of the code blocks (--highlight)
+ *
+ *	The info string of the fence selects the language. The lines are cut
+ *	into tokens by one lexer driven by the description of the language:
+ *	the keywords are bold, the comments are italic and the rest is copied
+ *	in spans. The keyword tables are perfect hashes made offline, FNV-1a
+ *	with a seed per language that gives no collisions, so a word costs one
+ *	hash and one compare.
+ */
+enum { HL_TOKENS, HL_DIFF, HL_INI };
+
+typedef struct {
+	const char	*names;			// info strings
+	int			mode;
+	const char	*line_cmt;		// line comment, NULL = none
+	bool		cmt_word;		// the line comment begins a word (sh)
+	bool		block_cmt;		// /* */ and preprocessor lines (c)
+	bool		targets;		// 'target:' lines (make)
+	const char	*quotes;		// string delimiters
+	const char	*const *kw;		// keywords, NULL = none
+	uint32_t	kw_seed, kw_mask;
+	} hl_lang_t;
+
+static const char *const hl_kw_sh[128] = {
+	"for", "if", "in", "", "", "printf", "", "",
+	"", "", "fi", "", "", "elif", "do", "exec",
+	"cd", "", "declare", "echo", "", "", "", "",
+	"", "exit", "", "", "", "", "", "",
+	"", "", "", "", "", "", "continue", "unset",
+	"export", "", "", "then", "", "", "", "read",
+	"", "", "", "test", "eval", "", "", "",
+	"", "", "", "case", "", "", "function", "shift",
+	"", "", "", "local", "", "", "", "",
+	"readonly", "", "alias", "", "", "else", "set", "esac",
+	"source", "", "", "", "", "time", "", "wait",
+	"", "", "", "", "", "", "", "",
+	"", "", "", "", "return", "", "", "while",
+	"trap", "break", "", "", "", "", "", "done",
+	"", "", "", "", "select", "", "until", "",
+	"", "", "", "", "", "", "", "" };
+
+static const char *const hl_kw_c[128] = {
+	"", "while", "", "", "", "", "", "",
+	"static", "", "char", "", "", "int", "", "",
+	"", "", "", "", "", "for", "float", "",
+	"", "union", "enum", "", "", "", "", "false",
+	"NULL", "", "", "", "const", "double", "restrict", "",
+	"", "inline", "", "", "", "", "", "continue",
+	"", "", "struct", "signed", "switch", "", "extern", "true",
+	"", "default", "", "", "else", "register", "", "",
+	"void", "", "", "", "", "", "", "",
+	"long", "", "", "", "", "", "if", "",
+	"goto", "", "", "", "", "", "volatile", "",
+	"", "break", "do", "", "typedef", "", "", "",
+	"", "case", "", "", "", "", "", "",
+	"", "bool", "", "", "", "", "", "",
+	"", "", "sizeof", "", "", "return", "", "",
+	"", "auto", "unsigned", "", "", "", "short", "" };
+
+static const char *const hl_kw_make[32] = {
+	"", "", "private", "ifeq", "", "", "", "define",
+	"", "", "", "ifdef", "", "sinclude", "override", "",
+	"", "unexport", "ifndef", "endef", "include", "", "", "ifneq",
+	"", "", "vpath", "else", "", "export", "endif", "" };
+
+static const hl_lang_t hl_langs[] = {
+	{ " sh bash shell zsh ksh ", HL_TOKENS, "#", true, false, false, "\"'`", hl_kw_sh, 30671, 127 },
+	{ " c h cpp c++ ", HL_TOKENS, "//", false, true, false, "\"'", hl_kw_c, 589, 127 },
+	{ " make makefile mk ", HL_TOKENS, "#", false, false, true, "", hl_kw_make, 99, 31 },
+	{ " ini conf cfg desktop ", HL_INI, NULL, false, false, false, "", NULL, 0, 0 },
+	{ " diff patch ", HL_DIFF, NULL, false, false, false, "", NULL, 0, 0 },
+	{ NULL, 0, NULL, false, false, false, NULL, NULL, 0, 0 } };
+
+static const hl_lang_t	*hl_lang;		// of the open code block, NULL = plain
+static bool			hl_comment;			// inside /* */
+static const char	*hl_bold, *hl_italic;
+static uint8_t		hl_cls[256];		// classes of the characters, for the language
+
+#define HL_WORD		1		// [A-Za-z0-9_]
+#define HL_QUOTE	2
+#define HL_ESC		4		// backslash
+#define HL_CMT		8		// may begin a comment
+
+/*
+ * selects the language of the info string 'p' of the fence (after the
+ * ```); NULL if it is not known or --highlight is not given.
+ */
+const hl_lang_t *hl_select(const char *p) {
+	char	name[32];
+	int		n = 0;
+
+	hl_lang = NULL;
+	hl_comment = false;
+	if ( !opt_highlight )
+		return NULL;
+	while ( *p == ' ' || *p == '\t' || *p == '{' || *p == '.' ) p ++;
+	name[n ++] = ' ';
+	for ( ; n < (int) sizeof(name) - 2 && *p && !ch_space(*p) && *p != '}' && *p != ','; p ++ )
+		name[n ++] = ch_tolower(*p);
+	name[n ++] = ' ';
+	name[n] = '\0';
+	if ( n == 2 )
+		return NULL;
+	for ( const hl_lang_t *L = hl_langs; L->names; L ++ )
+		if ( strstr(L->names, name) )
+			hl_lang = L;
+	if ( hl_lang ) {
+		memset(hl_cls, 0, sizeof(hl_cls));
+		for ( int c = 0; c < 128; c ++ )
+			if ( ch_alnum(c) || c == '_' )
+				hl_cls[c] = HL_WORD;
+		for ( const char *q = hl_lang->quotes; *q; q ++ )
+			hl_cls[(unsigned char) *q] = HL_QUOTE;
+		hl_cls['\\'] = HL_ESC;
+		if ( hl_lang->line_cmt )
+			hl_cls[(unsigned char) hl_lang->line_cmt[0]] = HL_CMT;
+		if ( hl_lang->block_cmt )
+			hl_cls['/'] = HL_CMT;
+		}
+	if ( mpack == mp_ms || mpack == mp_mm ) { // the displays are not in a fixed-width font
+		hl_bold = "\\fB";
+		hl_italic = "\\fI";
+		}
+	else {
+		hl_bold = "\\f[CB]";
+		hl_italic = "\\f[CI]";
+		}
+	return hl_lang;
+	}
+
+/*
+ * writes the span 's'..'e' with the font 'font' (NULL = as it is); the
+ * backslashes are escaped.
+ */
+static void hl_span(const char *font, const char *s, const char *e) {
+	const char *b;
+
+	if ( write_lock || s >= e )
+		return;
+	if ( font )
+		fputs(font, fout);
+	while ( (b = memchr(s, '\\', e - s)) != NULL ) {
+		fwrite(s, 1, b - s, fout);
+		fputs("\\e", fout);
+		s = b + 1;
+		}
+	fwrite(s, 1, e - s, fout);
+	if ( font )
+		fputs("\\fP", fout);
+	}
+
+static bool hl_keyword(const hl_lang_t *L, const char *w, int n) {
+	uint32_t	h = L->kw_seed;
+	const char	*k;
+
+	for ( int i = 0; i < n; i ++ )
+		h = (h ^ (unsigned char) w[i]) * 16777619u;
+	k = L->kw[(h >> 16) & L->kw_mask];
+	return strncmp(k, w, n) == 0 && k[n] == '\0';
+	}
+
+/*
+ * the tokens of the line 'p'..'e'
+ */
+static void hl_tokens(const hl_lang_t *L, const char *p, const char *e) {
+	const char *line = p, *s = p, *t;
+	size_t	cl = ( L->line_cmt ) ? strlen(L->line_cmt) : 0;
+
+	if ( hl_comment ) { // the rest of a /* */
+		for ( t = p; t + 1 < e && !(t[0] == '*' && t[1] == '/'); t ++ );
+		if ( t + 1 < e ) {
+			hl_comment = false;
+			t += 2;
+			}
+		else
+			t = e;
+		hl_span(hl_italic, p, t);
+		s = p = t;
+		}
+	else if ( L->targets && *p != '\t' && *p != '#' ) { // target: prerequisites
+		for ( t = p; t < e && *t != ':' && *t != '=' && *t != '$'; t ++ );
+		if ( t < e && t > p && *t == ':' && t[1] != '=' && t[1] != ':' ) {
+			hl_span(hl_bold, p, t);
+			s = p = t;
+			}
+		}
+	else if ( L->block_cmt ) { // preprocessor
+		for ( t = p; t < e && ch_blank(*t); t ++ );
+		if ( t < e && *t == '#' ) {
+			const char *w = t + 1;
+			while ( w < e && ch_blank(*w) ) w ++;
+			while ( w < e && hl_cls[(unsigned char) *w] == HL_WORD ) w ++;
+			hl_span(NULL, p, t);
+			hl_span(hl_bold, t, w);
+			s = p = w;
+			}
+		}
+	while ( p < e ) {
+		unsigned char c = *p;
+
+		switch ( hl_cls[c] ) {
+		case 0:
+			p ++;
+			break;
+		case HL_WORD:
+			for ( t = p; p < e && hl_cls[(unsigned char) *p] == HL_WORD; p ++ );
+			if ( L->kw && !ch_digit(c) && (t == line || !strchr("-$./", t[-1]))
+					&& hl_keyword(L, t, p - t) ) {
+				hl_span(NULL, s, t);
+				hl_span(hl_bold, t, p);
+				s = p;
+				}
+			break;
+		case HL_ESC:
+			p += ( p + 1 < e ) ? 2 : 1;
+			break;
+		case HL_QUOTE: // strings are text
+			for ( t = p + 1; t < e && *t != c; t ++ )
+				if ( *t == '\\' && c != '\'' && t + 1 < e )
+					t ++;
+			p = ( t < e ) ? t + 1 : e;
+			break;
+		case HL_CMT:
+			if ( L->block_cmt && c == '/' && p + 1 < e && p[1] == '*' ) {
+				for ( t = p + 2; t + 1 < e && !(t[0] == '*' && t[1] == '/'); t ++ );
+				if ( t + 1 < e )
+					t += 2;
+				else {
+					t = e;
+					hl_comment = true;
 					}
-				roff(par_end);
-				bline = true;
+				hl_span(NULL, s, p);
+				hl_span(hl_italic, p, t);
+				s = p = t;
+				}
+			else if ( (size_t) (e - p) >= cl && strncmp(p, L->line_cmt, cl) == 0
+					&& (!L->cmt_word || p == line || ch_space(p[-1])) ) {
+				hl_span(NULL, s, p);
+				hl_span(hl_italic, p, e);
+				s = p = e;
+				}
+			else
 				p ++;
-				continue;
+			break;
+			}
+		}
+	hl_span(NULL, s, e);
+	}
+
+/*
+ * writes the line of code 'p' highlighted and returns the next line
+ */
+const char *hl_line(const char *p) {
+	const char *e = eoln(p), *s, *q;
+
+	switch ( hl_lang->mode ) {
+	case HL_DIFF:
+		if ( strncmp(p, "+++", 3) == 0 || strncmp(p, "---", 3) == 0
+				|| strncmp(p, "diff ", 5) == 0 || strncmp(p, "index ", 6) == 0 )
+			hl_span(hl_bold, p, e);
+		else if ( *p == '+' )
+			hl_span(hl_bold, p, e);
+		else if ( *p == '-' || (p[0] == '@' && p[1] == '@') )
+			hl_span(hl_italic, p, e);
+		else
+			hl_span(NULL, p, e);
+		break;
+	case HL_INI:
+		for ( s = p; s < e && ch_blank(*s); s ++ );
+		if ( s < e && (*s == ';' || *s == '#') )
+			hl_span(hl_italic, p, e);
+		else if ( s < e && *s == '[' )
+			hl_span(hl_bold, p, e);
+		else if ( s < e && (q = memchr(s, '=', e - s)) != NULL ) {
+			hl_span(hl_bold, p, q);
+			hl_span(NULL, q, e);
+			}
+		else
+			hl_span(NULL, p, e);
+		break;
+	default:
+		hl_tokens(hl_lang, p, e);
+		}
+	if ( *e ) {
+		if ( !write_lock )
+			putc('\n', fout);
+		e ++;
+		}
+	return e;
+	}
+
+/*
+ *	index of the footnote and link definitions
+ *
+ *	an open addressing hash table keyed by the label; the labels and the
+ *	texts are spans of the source document.
+ */
+typedef struct {
+	const char	*key, *text;
+	int			klen, tlen;
+	int			num;		// footnote number, 0 = not referenced yet
+	} mdref_t;
+
+typedef struct {
+	mdref_t	*tab;
+	int		size, count;	// size is always power of 2
+	} mdindex_t;
+
+static mdindex_t fn_index, link_index;
+static mdref_t	**fn_list;	// referenced footnotes, by number
+static int		fn_count, fn_alloc;
+static int		fn_base;	// footnotes of the document before the fragment
+
+/*
+ * FNV-1a hash of the label, case insensitive
+ */
+static unsigned idx_hash(const char *key, int klen) {
+	unsigned h = 2166136261u;
+	for ( int i = 0; i < klen; i ++ ) {
+		h ^= (unsigned char) ch_tolower(key[i]);
+		h *= 16777619u;
+		}
+	return h;
+	}
+
+static bool idx_keyeq(const mdref_t *r, const char *key, int klen) {
+	if ( r->klen != klen )
+		return false;
+	for ( int i = 0; i < klen; i ++ )
+		if ( ch_tolower(r->key[i]) != ch_tolower(key[i]) )
+			return false;
+	return true;
+	}
+
+/*
+ * returns the entry of 'key' or NULL
+ */
+mdref_t *idx_find(const mdindex_t *ix, const char *key, int klen) {
+	unsigned i;
+	
+	if ( ix->size == 0 )
+		return NULL;
+	for ( i = idx_hash(key, klen) & (ix->size - 1); ix->tab[i].key; i = (i + 1) & (ix->size - 1) )
+		if ( idx_keyeq(&ix->tab[i], key, klen) )
+			return &ix->tab[i];
+	return NULL;
+	}
+
+/*
+ * adds 'key' to the index and returns its entry; if the key already
+ * exists returns NULL (the first definition wins).
+ */
+mdref_t *idx_add(mdindex_t *ix, const char *key, int klen) {
+	unsigned i;
+
+	if ( (ix->count + 1) * 2 > ix->size ) { // rehash
+		mdindex_t nx;
+		nx.size = ( ix->size ) ? ix->size * 2 : 64;
+		nx.count = ix->count;
+		nx.tab = (mdref_t *) calloc(nx.size, sizeof(mdref_t));
+		panicif(nx.tab == NULL, "out of memory");
+		for ( int j = 0; j < ix->size; j ++ ) {
+			if ( ix->tab[j].key ) {
+				for ( i = idx_hash(ix->tab[j].key, ix->tab[j].klen) & (nx.size - 1);
+						nx.tab[i].key; i = (i + 1) & (nx.size - 1) );
+				nx.tab[i] = ix->tab[j];
 				}
-			else if ( *p == '#' ) { // header
-				d = flushln(d, dest);
-				
-				pnext = strchr(p+1, '\n');
-				if ( pnext ) {
-					if ( *(pnext-1) != '#' ) {
-						int	level = 0;
-						while ( *p == '#' ) { level ++; p ++; }
-						while ( *p == ' ' || *p == '\t' ) p ++;
-						switch ( level ) {
-						case 1: roff(new_sh); break; // TH?
-						case 2: {
-							const char *s;
-							char *n;
-							for ( s = p, n = secname; *s != '\n'; *n ++ = *s ++ );
-							*n = '\0';
-							if ( man_ofc ) {
-								if ( strcmp(secname, "COPYRIGHT") == 0 \
-										|| strcmp(secname, "AUTHOR") == 0 \
-										|| strcmp(secname, "HOMEPAGE") == 0 \
-										|| strcmp(secname, "REPORTING BUGS") == 0 \
-										|| strcmp(secname, "AUTHOR") == 0 \
-										|| strcmp(secname, "AUTHORS") == 0 )
-									write_lock = 1;
-								else
-									write_lock = 0;
-								}
-							if ( !write_lock ) roff(new_sh);
-							}
-							break;
-						case 3: roff(new_ss); break;
-						case 4:
-						default:
-							if ( mpack == mp_ms ) {
-								roff(new_ss);
-								break;
-								}
-							
-							if ( mpack == mp_man ) {
-								d = flushln(d, dest);
-								printf(".TP\n");
-								int state = 'R';
-								dcopy("\\fB");
-								while ( isblank(*p) ) p ++;
-								while ( isalnum(*p) )
-									*d ++ = *p ++;
-								dcopy("\\fR");
-								while ( *p ) {
-									// continue to the next line
-									if ( *p == '\\' ) {
-										while ( *p && *p != '\n' ) p ++;
-										if ( *p == '\n' ) p ++;
-										continue;
-										}
-									
-									// end of string, reset to defaults and exit loop
-									if ( *p == '\n' || *p == '\r' ) {
-										if ( state != 'R' )
-											dcopy("\\fR");
-										break;
-										}
-									
-									// other characters
-									switch ( *p ) { // separator, nocolor
-									case ' ': case '\t':
-									case '[': case '{': case '(':
-									case ']': case '}': case ')':
-									case ',': case '|': case '.':
-									case '=':
-										if ( state != 'R' ) {
-											dcopy("\\fR");
-											state = 'R';
-											}
-										*d ++ = *p ++;
-										break;
-									case '+': case '!':
-										if ( state != 'B' ) {
-											dcopy("\\fB");
-											state = 'B';
-											}
-										*d ++ = *p ++;
-										break;
-									case '-': // short or long option, bold
-										if ( state != 'B' ) {
-											dcopy("\\fB");
-											state = 'B';
-											}
-										if ( p[1] == '-' ) // double minus
-											*d ++ = *p ++;
-										*d ++ = *p ++;
-										while ( isalnum(*p) )
-											*d ++ = *p ++;
-										break;
-									default: // normal parameter, italics
-										if ( state != 'I' ) {
-											dcopy("\\fI");
-											state = 'I';
-											}
-										*d ++ = *p ++;
-										}
-									}
-								d = flushln(d, dest);
-								}
-							else
-								roff(new_s4);
-							continue;
-							}
-						p = println(p);
-						if ( mpack == mp_ms )
-							puts(".PP");
-						bline = true;
-						continue;
-						}
-					else {
-						roff(box_open);
-						roff(ln_brk);
-						p = println(p);
-						roff(ln_brk);
-						roff(box_close);
-						continue;
+			}
+		free(ix->tab);
+		*ix = nx;
+		}
+	for ( i = idx_hash(key, klen) & (ix->size - 1); ix->tab[i].key; i = (i + 1) & (ix->size - 1) )
+		if ( idx_keyeq(&ix->tab[i], key, klen) )
+			return NULL;
+	ix->count ++;
+	ix->tab[i].key = key;
+	ix->tab[i].klen = klen;
+	return &ix->tab[i];
+	}
+
+void idx_free(mdindex_t *ix) {
+	free(ix->tab);
+	ix->tab = NULL;
+	ix->size = ix->count = 0;
+	}
+
+/*
+ * true if there is a link definition with the label 'label'
+ */
+bool link_ref(const char *label, int len) {
+	return idx_find(&link_index, label, len) != NULL;
+	}
+
+/*
+ * if a footnote definition '[^label]: text' begins at 'p', returns the
+ * pointer to the first line after it and stores the label and the text;
+ * otherwise returns NULL. Indented lines that follow are part of the text.
+ */
+const char *fn_def(const char *p, const char **key, int *klen, const char **text, int *tlen) {
+	const char *s, *e;
+
+	if ( p[0] != '[' || p[1] != '^' )
+		return NULL;
+	for ( s = p + 2; *s && *s != ']' && *s != '\n' && !ch_blank(*s); s ++ );
+	if ( *s != ']' || s[1] != ':' || s == p + 2 )
+		return NULL;
+	*key = p + 2;
+	*klen = s - (p + 2);
+	s += 2;
+	while ( ch_blank(*s) ) s ++;
+	*text = s;
+	e = eoln(s);
+	while ( *e && (e[1] == '\t' || strncmp(e + 1, "    ", 4) == 0) ) // continuation
+		e = eoln(e + 1);
+	*tlen = e - s;
+	while ( *tlen && ch_space(s[*tlen - 1]) ) (*tlen) --;
+	return ( *e ) ? e + 1 : e;
+	}
+
+/*
+ * if a link definition '[label]: url "title"' begins at 'p', returns the
+ * pointer to the first line after it and stores the label and the url;
+ * otherwise returns NULL.
+ */
+const char *link_def(const char *p, const char **key, int *klen, const char **url, int *ulen) {
+	const char *s, *e;
+
+	if ( p[0] != '[' || p[1] == '^' )
+		return NULL;
+	for ( s = p + 1; *s && *s != ']' && *s != '\n'; s ++ );
+	if ( *s != ']' || s[1] != ':' || s == p + 1 )
+		return NULL;
+	*key = p + 1;
+	*klen = s - (p + 1);
+	s += 2;
+	while ( ch_blank(*s) ) s ++;
+	if ( *s == '<' ) {
+		for ( e = s + 1; *e && *e != '>' && *e != '\n'; e ++ );
+		if ( *e != '>' )
+			return NULL;
+		*url = s + 1;
+		*ulen = e - (s + 1);
+		s = e + 1;
+		}
+	else {
+		for ( e = s; *e && !ch_space(*e); e ++ );
+		if ( e == s )
+			return NULL;
+		*url = s;
+		*ulen = e - s;
+		s = e;
+		}
+	while ( ch_blank(*s) ) s ++;
+	if ( *s == '"' || *s == '\'' || *s == '(' ) { // title, not used
+		char q = ( *s == '(' ) ? ')' : *s;
+		for ( e = s + 1; *e && *e != q && *e != '\n'; e ++ );
+		if ( *e != q )
+			return NULL;
+		s = e + 1;
+		while ( ch_blank(*s) ) s ++;
+		}
+	if ( *s && *s != '\n' )
+		return NULL;
+	return ( *s ) ? s + 1 : s;
+	}
+
+/*
+ * if a footnote or link definition begins at the line 'p' (indented up
+ * to 3 spaces), returns the pointer to the first line after it.
+ */
+const char *ref_def(const char *p) {
+	const char *key, *text;
+	int		klen, tlen;
+
+	for ( int i = 0; i < 3 && *p == ' '; i ++ ) p ++;
+	if ( *p != '[' )
+		return NULL;
+	if ( p[1] == '^' )
+		return fn_def(p, &key, &klen, &text, &tlen);
+	return link_def(p, &key, &klen, &text, &tlen);
+	}
+
+/*
+ * collects the footnote and the link definitions of the document into
+ * their indexes, in one pass over the lines.
+ */
+void refs_collect(const char *source) {
+	const char *p = source, *s, *pnext, *key, *text;
+	int		klen, tlen;
+	bool	bcode = false;
+	mdref_t	*r;
+
+	idx_free(&fn_index);
+	idx_free(&link_index);
+	fn_count = 0;
+	while ( *p ) {
+		s = p;
+		for ( int i = 0; i < 3 && *s == ' '; i ++ ) s ++;
+		pnext = NULL;
+		if ( strncmp(s, "```", 3) == 0 )
+			bcode = !bcode;
+		else if ( *s == '[' && !bcode ) {
+			if ( s[1] == '^' ) {
+				if ( (pnext = fn_def(s, &key, &klen, &text, &tlen)) != NULL ) {
+					if ( (r = idx_add(&fn_index, key, klen)) != NULL ) {
+						r->text = text;
+						r->tlen = tlen;
 						}
 					}
 				}
-			else if ( mpack == mp_man && strcmp(secname, "SYNOPSIS") == 0
-					&& (opt_name_style == 2 || strncmp(p, KEY_GNUSYN, strlen(KEY_GNUSYN)) == 0) ) { // SYNTAX BLOCK (.SY/.YS)
-				bool first;
-				
-				d = flushln(d, dest);
-				if ( opt_name_style != 2 )
-					p += strlen(KEY_GNUSYN);
-				dcopy(".SY ");
-				while ( isspace(*p) ) p ++;
-				while ( *p && *p != '\n' ) *d ++ = *p ++;
-				if ( *p ) *d ++ = *p ++;
-				while ( *p ) {
-					if ( !isblank(*p) ) {
-						if ( *p == '\n' )
-							break;
-						else {
-							int mode = 2;
-							if ( *p == '-' ) mode = 1;
-							if ( mode == 1 )
-								dcopy(".OP \\")
-							else 
-								dcopy(".RI ")
-							first = true;
-							while ( *p && *p != '\n' ) {
-								if ( *p == ' ' && first ) {
-									first = false;
-									if ( mode == 2 )
-										dcopy("\\ ");
-									}
-								else if ( !first ) {
-									if ( *p == ' ' ) {
-										dcopy("\\fR\\");
-										*d ++ = *p ++;
-										dcopy("\\f");
-										*d ++ = (mode == 1) ? 'I' : 'R';
-										continue;
-										}
-									else if ( strchr("[].-{}|", *p) ) {
-										dcopy("\\f");
-										*d ++ = (mode == 1) ? 'B' : 'R';
-										while ( strchr("[].-{}|", *p) )
-											*d ++ = *p ++;
-										dcopy("\\f");
-										*d ++ = (mode == 1) ? 'I' : 'R';
-										continue;
-										}
-									}
-								*d ++ = *p ++;
-								}
-							
-							if ( *p ) *d ++ = *p ++;
-							continue;
-							}
-						}
-					p ++;
+			else if ( (pnext = link_def(s, &key, &klen, &text, &tlen)) != NULL ) {
+				if ( (r = idx_add(&link_index, key, klen)) != NULL ) {
+					r->text = text;
+					r->tlen = tlen;
 					}
-				dcopy(".YS");
-				*d = '\0';
-				puts(dest);
-				d = dest;
-				continue;
 				}
-			else if ( mpack == mp_mdoc && strcmp(secname, "SYNOPSIS") == 0 && \
-					(opt_name_style == 3 || strncmp(p, KEY_GNUSYN, strlen(KEY_GNUSYN)) == 0) ) { // SYNTAX BLOCK (.Nm)
-				d = flushln(d, dest);
-				if ( opt_name_style != 3 )
-					p += strlen(KEY_GNUSYN);
-				dcopy(".Nm ");
-				while ( isspace(*p) ) p ++;
-				while ( *p && *p != '\n' ) *d ++ = *p ++;
-				if ( *p ) *d ++ = *p ++;
-				while ( *p ) {
-					if ( !isblank(*p) ) {
-						if ( *p == '\n' )
-							break;
-						else {
-							if ( p[0] == '-' || p[1] == '-' || p[2] == '-' )
-								dcopy(".Op ")
-							else
-								dcopy(".Ar ")
-							while ( *p && *p != '\n' ) {
-								switch ( *p ) {
-								case '-': dcopy(" Fl "); p ++; continue;
-								case '[': dcopy(" Oo "); p ++; continue;
-								case ']': dcopy(" Oc "); p ++; continue;
-								case ' ': dcopy(" Ar "); p ++; continue;
-									};
-								*d ++ = *p ++;
-								}
-							if ( *p ) *d ++ = *p ++;
-							continue;
-							}
-						}
-					p ++;
-					}
-				*d = '\0';
-				puts(dest);
-				d = dest;
-				continue;
+			}
+		if ( pnext )
+			p = pnext;
+		else {
+			p = eoln(p);
+			if ( *p ) p ++;
+			}
+		}
+	}
+
+/*
+ * numbers the footnote 'r' and returns its number
+ */
+int fn_number(mdref_t *r) {
+	if ( r->num == 0 ) {
+		if ( fn_count == fn_alloc ) {
+			fn_alloc = ( fn_alloc ) ? fn_alloc * 2 : 64;
+			fn_list = (mdref_t **) realloc(fn_list, sizeof(mdref_t *) * fn_alloc);
+			panicif(fn_list == NULL, "out of memory");
+			}
+		fn_list[fn_count ++] = r;
+		r->num = fn_count;
+		}
+	return fn_base + r->num;
+	}
+
+/*
+ * writes the NOTES section with the referenced footnotes (man, mdoc)
+ */
+void fn_notes() {
+	if ( fn_count == 0 || write_lock )
+		return;
+	bq_level = 0;
+	roff(new_sh);
+	oprintf("NOTES\n");
+	if ( mpack == mp_mdoc )
+		oputs(".Bl -enum");
+	for ( int i = 0; i < fn_count; i ++ ) {
+		roff(fn_item, i + 1);
+		put_inline(fn_list[i]->text, fn_list[i]->tlen);
+		oputc('\n');
+		}
+	if ( mpack == mp_mdoc )
+		oputs(".El");
+	}
+
+/*
+ *	cross-reference check (--check-xrefs)
+ *
+ *	The 'name.section' of the pages under the man directories are kept in a
+ *	sorted index which is cached in a file and memory-mapped:
+ *		header (magic, version, count, offset of the MANPATH)
+ *		uint32 offsets of the names, in sorted order
+ *		the names, '\0' terminated
+ *		the MANPATH, '\0' terminated, since the file name is only its hash
+ *	References that are not found there are checked again at the end of the
+ *	run against the pages of the same run.
+ */
+#define XREF_MAGIC		"md2rxref"
+#define XREF_VERSION	2
+typedef struct { char magic[8]; uint32_t version, count, manpath; } xref_hdr_t;
+typedef struct { char *ref, *file; int line; } xref_miss_t;
+
+static const char	*xref_img;		// the index image
+static size_t		xref_size;
+static mdindex_t	xref_batch;		// pages converted in this run
+static xref_miss_t	*xref_miss;
+static int			xref_nmiss, xref_amiss;
+static char			**xref_names;	// used only to build the index
+static int			xref_count, xref_alloc;
+
+static int xref_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+	}
+
+static void xref_addname(const char *name, int nlen, const char *sec, int slen) {
+	if ( xref_count == xref_alloc ) {
+		xref_alloc = ( xref_alloc ) ? xref_alloc * 2 : 4096;
+		xref_names = (char **) realloc(xref_names, sizeof(char *) * xref_alloc);
+		panicif(xref_names == NULL, "out of memory");
+		}
+	char *s = (char *) malloc(nlen + slen + 2);
+	memcpy(s, name, nlen);
+	s[nlen] = '.';
+	memcpy(s + nlen + 1, sec, slen);
+	s[nlen + slen + 1] = '\0';
+	xref_names[xref_count ++] = s;
+	}
+
+/*
+ * adds the pages of the directory 'dir' (a manN of a man directory)
+ */
+static void xref_scandir(const char *dir, const char *dsec) {
+	static const char *zext[] = { ".gz", ".bz2", ".xz", ".lzma", ".zst", ".Z", NULL };
+	DIR		*dp;
+	struct dirent *de;
+	char	*ext;
+	int		len;
+
+	if ( (dp = opendir(dir)) == NULL )
+		return;
+	while ( (de = readdir(dp)) != NULL ) {
+		if ( de->d_name[0] == '.' )
+			continue;
+		len = strlen(de->d_name);
+		for ( int i = 0; zext[i]; i ++ ) { // compressed
+			int zl = strlen(zext[i]);
+			if ( len > zl && strcmp(de->d_name + len - zl, zext[i]) == 0 ) {
+				len -= zl;
+				break;
 				}
-			else if ( mpack == mp_man && strcmp(secname, "SYNOPSIS") == 0
-					&& (opt_name_style == 1 || strncmp(p, KEY_NDCCMD, strlen(KEY_NDCCMD)) == 0) ) { // NDC's pretty style for commands
-				d = flushln(d, dest);
-				if ( opt_name_style != 1 )
-					p += strlen(KEY_NDCCMD);
-				int state = 'R';
-				dcopy("\\fB");
-				while ( isblank(*p) ) p ++;
-				while ( isalnum(*p) )
-					*d ++ = *p ++;
-				dcopy("\\fR");
-				while ( *p ) {
-					// continue to the next line
-					if ( *p == '\\' ) {
-						while ( *p && *p != '\n' ) p ++;
-						if ( *p == '\n' ) p ++;
-						continue;
-						}
-					
-					// end of string, reset to defaults and exit loop
-					if ( *p == '\n' || *p == '\r' ) {
-						if ( state != 'R' )
-							dcopy("\\fR");
-						break;
-						}
-					
-					// other characters
-					switch ( *p ) { // separator, nocolor
-					case ' ': case '\t':
+			}
+		for ( ext = de->d_name + len - 1; ext > de->d_name && *ext != '.'; ext -- );
+		if ( ext == de->d_name )
+			continue;
+		xref_addname(de->d_name, ext - de->d_name, ext + 1, len - (ext + 1 - de->d_name));
+		if ( *dsec && strncmp(ext + 1, dsec, len - (ext + 1 - de->d_name)) != 0 ) // i.e. man3/foo.3ssl
+			xref_addname(de->d_name, ext - de->d_name, dsec, strlen(dsec));
+		}
+	closedir(dp);
+	}
+
+/*
+ * calls 'fn' for each manN directory of the 'manpath', or for each man
+ * directory itself when 'fn' is NULL; returns the latest mtime.
+ */
+static time_t xref_walk(const char *manpath, void (*fn)(const char *, const char *)) {
+	char	dir[4096], sub[4096];
+	const char *p = manpath, *e;
+	struct stat st;
+	time_t	latest = 0;
+	DIR		*dp;
+	struct dirent *de;
+
+	while ( *p ) {
+		e = strchr(p, ':');
+		if ( e == NULL ) e = p + strlen(p);
+		snprintf(dir, sizeof(dir), "%.*s", (int) (e - p), p);
+		p = ( *e ) ? e + 1 : e;
+		if ( stat(dir, &st) == -1 || (dp = opendir(dir)) == NULL )
+			continue;
+		if ( st.st_mtime > latest ) latest = st.st_mtime;
+		while ( (de = readdir(dp)) != NULL ) {
+			if ( strncmp(de->d_name, "man", 3) != 0 )
+				continue;
+			if ( snprintf(sub, sizeof(sub), "%s/%s", dir, de->d_name) >= (int) sizeof(sub) )
+				continue;
+			if ( stat(sub, &st) == -1 || !S_ISDIR(st.st_mode) )
+				continue;
+			if ( st.st_mtime > latest ) latest = st.st_mtime;
+			if ( fn )
+				fn(sub, de->d_name + 3);
+			}
+		closedir(dp);
+		}
+	return latest;
+	}
+
+/*
+ * the name of the cache file of the 'manpath'
+ */
+static bool xref_cachename(const char *manpath, char *buf, size_t size) {
+	const char *base = getenv("XDG_CACHE_HOME");
+	char	dir[4096];
+	int		n;
+
+	if ( base && *base )
+		n = snprintf(dir, sizeof(dir), "%s/md2roff", base);
+	else if ( (base = getenv("HOME")) != NULL && *base )
+		n = snprintf(dir, sizeof(dir), "%s/.cache/md2roff", base);
+	else
+		return false;
+	if ( n >= (int) sizeof(dir) )
+		return false;
+	mkdirs(dir);
+	n = snprintf(buf, size, "%s/xrefs-%08x", dir, idx_hash(manpath, strlen(manpath)));
+	return n < (int) size;
+	}
+
+/*
+ * checks the names of the index image 'img': they follow one another from
+ * the end of the offsets to the MANPATH, each one '\0' terminated, in
+ * sorted order; so the lookup never reads outside of the file.
+ */
+static bool xref_records(const char *img, size_t size) {
+	const xref_hdr_t *h = (const xref_hdr_t *) img;
+	const uint32_t *off = (const uint32_t *) (img + sizeof(xref_hdr_t));
+	size_t	pos = sizeof(xref_hdr_t) + (size_t) h->count * 4, len;
+
+	if ( pos > h->manpath || h->manpath >= size )
+		return false;
+	for ( uint32_t i = 0; i < h->count; i ++ ) {
+		if ( off[i] != pos || pos >= h->manpath )
+			return false;
+		len = strnlen(img + pos, h->manpath - pos);
+		if ( pos + len == h->manpath )	// not terminated
+			return false;
+		if ( i && strcmp(img + off[i - 1], img + pos) >= 0 )
+			return false;
+		pos += len + 1;
+		}
+	return pos == h->manpath;
+	}
+
+/*
+ * maps the index file 'fname' if it is valid and it is of the 'manpath'
+ */
+static bool xref_map(const char *fname, const char *manpath) {
+	struct stat st;
+	int		fd;
+	void	*img;
+	const xref_hdr_t *h;
+
+	if ( (fd = open(fname, O_RDONLY)) == -1 )
+		return false;
+	if ( fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(xref_hdr_t) ) {
+		close(fd);
+		return false;
+		}
+	img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( img == MAP_FAILED )
+		return false;
+	h = (const xref_hdr_t *) img;
+	if ( memcmp(h->magic, XREF_MAGIC, 8) != 0 || h->version != XREF_VERSION
+			|| sizeof(xref_hdr_t) + (size_t) h->count * 4 > (size_t) st.st_size
+			|| h->manpath >= (size_t) st.st_size
+			|| strlen(manpath) + 1 != (size_t) st.st_size - h->manpath
+			|| memcmp((const char *) img + h->manpath, manpath, st.st_size - h->manpath) != 0
+			|| !xref_records((const char *) img, st.st_size) ) {
+		munmap(img, st.st_size);
+		return false;
+		}
+	xref_img = (const char *) img;
+	xref_size = st.st_size;
+	return true;
+	}
+
+/*
+ * loads the index of the 'manpath' from the cache, or builds it
+ */
+void xref_load(const char *manpath) {
+	char	cname[4096], tname[4096 + 16];
+	struct stat st;
+	xref_hdr_t h;
+	size_t	size, pos;
+	char	*img;
+	int		n = 0, fd;
+	bool	cache = xref_cachename(manpath, cname, sizeof(cname));
+
+	if ( cache && stat(cname, &st) == 0 && xref_walk(manpath, NULL) < st.st_mtime && xref_map(cname, manpath) )
+		return;
+
+	// build
+	xref_walk(manpath, xref_scandir);
+	qsort(xref_names, xref_count, sizeof(char *), xref_cmp);
+	size = sizeof(h);
+	for ( int i = 0; i < xref_count; i ++ ) {
+		if ( i && strcmp(xref_names[i], xref_names[i-1]) == 0 )
+			continue;
+		size += 4 + strlen(xref_names[i]) + 1;
+		n ++;
+		}
+	size += strlen(manpath) + 1;
+	img = (char *) malloc(size);
+	panicif(img == NULL, "out of memory");
+	memcpy(h.magic, XREF_MAGIC, 8);
+	h.version = XREF_VERSION;
+	h.count = n;
+	h.manpath = size - (strlen(manpath) + 1);
+	memcpy(img, &h, sizeof(h));
+	pos = sizeof(h) + (size_t) n * 4;
+	n = 0;
+	for ( int i = 0; i < xref_count; i ++ ) {
+		if ( !(i && strcmp(xref_names[i], xref_names[i-1]) == 0) ) {
+			uint32_t off = pos;
+			memcpy(img + sizeof(h) + (size_t) n * 4, &off, 4);
+			strcpy(img + pos, xref_names[i]);
+			pos += strlen(xref_names[i]) + 1;
+			n ++;
+			}
+		}
+	strcpy(img + pos, manpath);
+	for ( int i = 0; i < xref_count; i ++ )
+		free(xref_names[i]);
+	free(xref_names);
+	xref_names = NULL;
+	xref_count = xref_alloc = 0;
+
+	// store it in the cache; if it fails, use the memory image
+	if ( cache ) {
+		snprintf(tname, sizeof(tname), "%s.XXXXXX", cname);
+		if ( (fd = mkstemp(tname)) != -1 ) {
+			bool ok = (write(fd, img, size) == (ssize_t) size);
+			if ( close(fd) == 0 && ok && rename(tname, cname) == 0 && xref_map(cname, manpath) ) {
+				free(img);
+				return;
+				}
+			unlink(tname);
+			}
+		}
+	xref_img = img;
+	xref_size = size;
+	}
+
+/*
+ * returns true if the page 'name.sec' exists; if 'sec' is empty any
+ * section matches. Binary search in the index.
+ */
+bool xref_lookup(const char *name, const char *sec) {
+	const xref_hdr_t *h = (const xref_hdr_t *) xref_img;
+	const uint32_t *off = (const uint32_t *) (xref_img + sizeof(xref_hdr_t));
+	char	key[512];
+	int		lo = 0, hi = h->count, mid, c, klen;
+
+	klen = snprintf(key, sizeof(key), "%s.%s", name, sec);
+	while ( lo < hi ) { // lower bound
+		mid = (lo + hi) / 2;
+		if ( strcmp(xref_img + off[mid], key) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+		}
+	if ( lo == (int) h->count )
+		return false;
+	c = ( *sec ) ? strcmp(xref_img + off[lo], key) : strncmp(xref_img + off[lo], key, klen);
+	return c == 0;
+	}
+
+/*
+ * splits the reference 'ref' ("page section") to name and section
+ */
+static void xref_split(const char *ref, char *name, char *sec) {
+	while ( ch_blank(*ref) ) ref ++;
+	for ( int i = 0; *ref && !ch_space(*ref) && i < 255; i ++ ) *name ++ = *ref ++;
+	*name = '\0';
+	while ( ch_blank(*ref) ) ref ++;
+	for ( int i = 0; *ref && !ch_space(*ref) && i < 255; i ++ ) *sec ++ = *ref ++;
+	*sec = '\0';
+	}
+
+/*
+ * the page 'name' 'sec' is converted in this run
+ */
+void xref_page(const char *name, const char *sec) {
+	char	key[512];
+	int		len = snprintf(key, sizeof(key), "%s.%s", name, sec);
+
+	idx_add(&xref_batch, strdup(key), len);
+	}
+
+/*
+ * checks the reference 'ref' of the document 'docname' at 'line'
+ */
+void xref_ref(const char *ref, const char *docname, int line) {
+	char	name[256], sec[256];
+
+	if ( xref_img == NULL )
+		xref_load(opt_xrefs);
+	xref_split(ref, name, sec);
+	if ( *name == '\0' || xref_lookup(name, sec) )
+		return;
+	if ( xref_nmiss == xref_amiss ) {
+		xref_amiss = ( xref_amiss ) ? xref_amiss * 2 : 64;
+		xref_miss = (xref_miss_t *) realloc(xref_miss, sizeof(xref_miss_t) * xref_amiss);
+		panicif(xref_miss == NULL, "out of memory");
+		}
+	xref_miss[xref_nmiss].ref = strdup(ref);
+	xref_miss[xref_nmiss].file = strdup(docname);
+	xref_miss[xref_nmiss].line = line;
+	xref_nmiss ++;
+	}
+
+/*
+ * reports the dangling references and returns their number
+ */
+int xref_report() {
+	char	name[256], sec[256], key[512];
+	int		count = 0, klen;
+
+	for ( int i = 0; i < xref_nmiss; i ++ ) {
+		xref_split(xref_miss[i].ref, name, sec);
+		klen = snprintf(key, sizeof(key), "%s.%s", name, sec);
+		if ( *sec && idx_find(&xref_batch, key, klen) )
+			continue;
+		fprintf(stderr, "%s:%d: dangling reference to %s(%s)\n",
+			xref_miss[i].file, xref_miss[i].line, name, sec);
+		count ++;
+		}
+	return count;
+	}
+
+/*
+ *	whatis entries (--whatis)
+ *
+ *	The NAME section ("name1, name2 \\- description") of each man page of
+ *	the run gives one "name (section) - description" entry per name; at the
+ *	end they are sorted, the duplicates are removed and the file is written.
+ */
+static char	**whatis_list;
+static int	whatis_count, whatis_alloc;
+
+static void whatis_push(const char *name, int nlen, const char *sec, const char *desc) {
+	int len = nlen + strlen(sec) + strlen(desc) + 8;
+	char *s = (char *) malloc(len);
+
+	panicif(s == NULL, "out of memory");
+	snprintf(s, len, "%.*s (%s) - %s", nlen, name, sec, desc);
+	if ( whatis_count == whatis_alloc ) {
+		whatis_alloc = ( whatis_alloc ) ? whatis_alloc * 2 : 256;
+		whatis_list = (char **) realloc(whatis_list, sizeof(char *) * whatis_alloc);
+		panicif(whatis_list == NULL, "out of memory");
+		}
+	whatis_list[whatis_count ++] = s;
+	}
+
+/*
+ * adds the entries of the page 'name' 'sec' whose NAME section text
+ * begins at 'p' (ends at an empty line or at the next header).
+ */
+void whatis_add(const char *name, const char *sec, const char *p) {
+	char	*text, *d, *sep, *desc, *n, *ne;
+	const char *e = p;
+
+	while ( *e && *e != '#' ) { // find the end of the paragraph
+		const char *s = e;
+		while ( ch_blank(*s) ) s ++;
+		if ( *s == '\n' || *s == '\0' )
+			break;
+		e = eoln(e);
+		if ( *e ) e ++;
+		}
+	d = text = (char *) malloc(e - p + 1);
+	panicif(text == NULL, "out of memory");
+	for ( ; p < e; p ++ ) { // plain text, one line
+		if ( *p == '\\' && p + 1 < e ) {
+			*d ++ = *(++ p);
+			continue;
+			}
+		if ( *p == '*' || *p == '`' || (*p == '_' && (d == text || !ch_word(d[-1]))) )
+			continue;
+		if ( ch_space(*p) ) {
+			if ( d > text && d[-1] != ' ' )
+				*d ++ = ' ';
+			continue;
+			}
+		*d ++ = *p;
+		}
+	while ( d > text && d[-1] == ' ' ) d --;
+	*d = '\0';
+	if ( *text == '\0' ) {
+		free(text);
+		return;
+		}
+
+	if ( (sep = strstr(text, " - ")) != NULL ) {
+		*sep = '\0';
+		desc = sep + 3;
+		for ( n = text; *n; n = ne ) { // each name
+			while ( *n == ' ' || *n == ',' ) n ++;
+			for ( ne = n; *ne && *ne != ','; ne ++ );
+			int nlen = ne - n;
+			while ( nlen && n[nlen - 1] == ' ' ) nlen --;
+			if ( nlen )
+				whatis_push(n, nlen, sec, desc);
+			}
+		}
+	else { // only description, the page name in lowercase
+		char lname[256];
+		int	i;
+		for ( i = 0; name[i] && i < 255; i ++ )
+			lname[i] = ch_tolower(name[i]);
+		lname[i] = '\0';
+		whatis_push(lname, i, sec, text);
+		}
+	free(text);
+	}
+
+/*
+ * writes the whatis file; returns 0 on success
+ */
+int whatis_write(const char *path) {
+	char	tmpname[4096];
+	FILE	*fp;
+
+	qsort(whatis_list, whatis_count, sizeof(char *), xref_cmp);
+	if ( (fp = atomic_open(path, tmpname, sizeof(tmpname))) == NULL )
+		return -1;
+	for ( int i = 0; i < whatis_count; i ++ )
+		if ( i == 0 || strcmp(whatis_list[i], whatis_list[i-1]) != 0 )
+			fprintf(fp, "%s\n", whatis_list[i]);
+	return atomic_close(fp, tmpname, path);
+	}
+
+/*
+ *	images
+ *
+ *	.PSPIC loads only EPS files and .PDF_IMAGE only PDF files. The size is
+ *	read from the header of the file (PNG IHDR, JPEG SOF marker, EPS
+ *	%%BoundingBox, PDF /MediaBox), in points, and it is cached by path and
+ *	modification time for all the files of the run. A PNG or JPEG image
+ *	is written with the file of the same name and the extension of the
+ *	package (.eps or .pdf) when it has been converted next to it, at the
+ *	size of the picture.
+ */
+#define IMG_MAX_WIDTH	432		// 6i, in points
+#define IMG_DPI			96		// of the images without resolution
+
+enum { IMG_NONE, IMG_EPS, IMG_PDF, IMG_PNG, IMG_JPEG };
+static const char *img_fmt_name[] = { "unknown", "EPS", "PDF", "PNG", "JPEG" };
+
+typedef struct {
+	char	*path;
+	time_t	mtime;
+	int		fmt;				// IMG_
+	int		w, h;				// 0 = unknown
+	} img_t;
+
+static img_t	*img_tab;
+static int		img_size, img_count;	// size is always power of 2
+
+static unsigned img_hash(const char *s) {
+	unsigned h = 2166136261u;
+	for ( ; *s; s ++ ) {
+		h ^= (unsigned char) *s;
+		h *= 16777619u;
+		}
+	return h;
+	}
+
+static unsigned img_be16(const unsigned char *b) { return (b[0] << 8) | b[1]; }
+static unsigned img_be32(const unsigned char *b) { return ((unsigned) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]; }
+
+// the pixels 'w', 'h' at 'dpi' in points
+static void img_points(unsigned long w, unsigned long h, unsigned dpi, int *pw, int *ph) {
+	if ( dpi == 0 )
+		dpi = IMG_DPI;
+	w = w * 72 / dpi;
+	h = h * 72 / dpi;
+	*pw = ( w > INT_MAX ) ? INT_MAX : (int) w;
+	*ph = ( h > INT_MAX ) ? INT_MAX : (int) h;
+	}
+
+/*
+ * PNG: the IHDR chunk and the pHYs chunk, if it comes before IDAT
+ */
+static bool img_png(FILE *fp, int *w, int *h) {
+	unsigned char b[33];
+	unsigned dpi = IMG_DPI;
+
+	if ( fread(b, 1, 33, fp) != 33 || memcmp(b, "\x89PNG\r\n\x1a\n", 8) != 0 || memcmp(b + 12, "IHDR", 4) != 0 )
+		return false;
+	unsigned long pw = img_be32(b + 16), ph = img_be32(b + 20);
+	for ( int i = 0; i < 16 && fread(b, 1, 8, fp) == 8; i ++ ) {
+		unsigned len = img_be32(b);
+		if ( memcmp(b + 4, "IDAT", 4) == 0 )
+			break;
+		if ( memcmp(b + 4, "pHYs", 4) == 0 && len == 9 ) {
+			if ( fread(b, 1, 9, fp) == 9 && b[8] == 1 ) // pixels per meter
+				dpi = ((unsigned long) img_be32(b) * 254 + 5000) / 10000;
+			break;
+			}
+		if ( fseek(fp, (long) len + 4, SEEK_CUR) != 0 )
+			break;
+		}
+	img_points(pw, ph, dpi, w, h);
+	return true;
+	}
+
+/*
+ * JPEG: the segments until the first SOF marker; the JFIF APP0 segment
+ * gives the resolution. Returns true if it is a JPEG file, even without
+ * the size.
+ */
+static bool img_jpeg(FILE *fp, int *w, int *h) {
+	unsigned char b[16];
+	unsigned dpi = IMG_DPI, len;
+	int		c;
+
+	if ( fread(b, 1, 2, fp) != 2 || b[0] != 0xFF || b[1] != 0xD8 )
+		return false;
+	for ( ;; ) {
+		while ( (c = getc(fp)) != 0xFF )
+			if ( c == EOF )
+				return true;
+		while ( (c = getc(fp)) == 0xFF ); // fill bytes
+		if ( c == EOF || c == 0xD9 || c == 0xDA ) // end, start of scan
+			return true;
+		if ( c == 0x01 || (c >= 0xD0 && c <= 0xD7) ) // no length
+			continue;
+		if ( fread(b, 1, 2, fp) != 2 || (len = img_be16(b)) < 2 )
+			return true;
+		if ( c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC ) {
+			if ( fread(b, 1, 5, fp) == 5 )
+				img_points(img_be16(b + 3), img_be16(b + 1), dpi, w, h);
+			return true;
+			}
+		if ( c == 0xE0 && len >= 16 ) { // JFIF
+			if ( fread(b, 1, 14, fp) != 14 )
+				return true;
+			if ( memcmp(b, "JFIF", 5) == 0 ) {
+				if ( b[7] == 1 )		// dots per inch
+					dpi = img_be16(b + 8);
+				else if ( b[7] == 2 )	// dots per cm
+					dpi = img_be16(b + 8) * 254 / 100;
+				}
+			len -= 14;
+			}
+		if ( fseek(fp, len - 2, SEEK_CUR) != 0 )
+			return true;
+		}
+	}
+
+/*
+ * EPS: the %%BoundingBox of the header comments; the DOS EPS binary
+ * header gives the offset of the PostScript part. Returns true if it is
+ * an EPS file, even without the size.
+ */
+static bool img_eps(FILE *fp, int *w, int *h) {
+	char	ln[256];
+	unsigned char b[8];
+	int		llx, lly, urx, ury;
+
+	if ( fread(b, 1, 8, fp) != 8 )
+		return false;
+	if ( memcmp(b, "\xC5\xD0\xD3\xC6", 4) == 0 ) {
+		long off = b[4] | (b[5] << 8) | (b[6] << 16) | ((long) b[7] << 24);
+		if ( fseek(fp, off, SEEK_SET) != 0 )
+			return false;
+		}
+	else if ( memcmp(b, "%!", 2) == 0 )
+		rewind(fp);
+	else
+		return false;
+	for ( int i = 0; i < 256 && fgets(ln, sizeof(ln), fp); i ++ ) {
+		if ( strncmp(ln, "%%BoundingBox:", 14) == 0
+				&& sscanf(ln + 14, "%d %d %d %d", &llx, &lly, &urx, &ury) == 4 ) {
+			*w = urx - llx;
+			*h = ury - lly;
+			break;
+			}
+		if ( strncmp(ln, "%%EndComments", 13) == 0 || (ln[0] != '%' && ln[0] != '\n') )
+			break;
+		}
+	return true;
+	}
+
+/*
+ * PDF: the first /MediaBox of the file, which is mapped; the page tree
+ * and its inherited box usually come after the content streams, at the
+ * end of the file. A /MediaBox in a compressed object stream is not
+ * found. Returns true if it is a PDF file, even without the size.
+ */
+static bool img_pdf(FILE *fp, int *w, int *h) {
+	struct stat st;
+	char	*img, *p, *end, *e, num[64];
+	double	box[4];
+	int		i;
+
+	if ( fstat(fileno(fp), &st) != 0 || st.st_size < 5 )
+		return false;
+	img = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if ( img == MAP_FAILED )
+		return false;
+	end = img + st.st_size;
+	if ( memcmp(img, "%PDF-", 5) != 0 ) {
+		munmap(img, st.st_size);
+		return false;
+		}
+	if ( (p = memmem(img, st.st_size, "/MediaBox", 9)) != NULL ) {
+		for ( p += 9; p < end && ch_space(*p); p ++ );
+		if ( p < end && *p ++ == '[' ) {
+			for ( i = 0; i < 4; i ++ ) {	// the text is not terminated
+				while ( p < end && ch_space(*p) ) p ++;
+				snprintf(num, sizeof(num), "%.*s", (int) (( end - p < (long) sizeof(num) - 1 ) ? end - p : (long) sizeof(num) - 1), p);
+				if ( (box[i] = strtod(num, &e)) == 0 && e == num )
+					break;
+				p += e - num;
+				}
+			if ( i == 4 ) {
+				*w = (int) (box[2] - box[0] + 0.5);
+				*h = (int) (box[3] - box[1] + 0.5);
+				}
+			}
+		}
+	munmap(img, st.st_size);
+	return true;
+	}
+
+/*
+ * returns the entry of the image 'path', with its format and its size
+ * in points (zero if the file cannot be read or has unknown format).
+ */
+const img_t *img_probe(const char *path) {
+	static bool (*probe[])(FILE *, int *, int *) = { NULL, img_eps, img_pdf, img_png, img_jpeg };
+	struct stat st;
+	unsigned i;
+	img_t	*e;
+	FILE	*fp;
+	int		w = 0, h = 0;
+
+	if ( stat(path, &st) != 0 )
+		st.st_mtime = 0;
+	if ( (img_count + 1) * 2 > img_size ) { // rehash
+		img_t *old = img_tab;
+		int	osize = img_size;
+		img_size = ( img_size ) ? img_size * 2 : 64;
+		img_tab = (img_t *) calloc(img_size, sizeof(img_t));
+		panicif(img_tab == NULL, "out of memory");
+		for ( int j = 0; j < osize; j ++ ) {
+			if ( old[j].path ) {
+				for ( i = img_hash(old[j].path) & (img_size - 1); img_tab[i].path; i = (i + 1) & (img_size - 1) );
+				img_tab[i] = old[j];
+				}
+			}
+		free(old);
+		}
+	for ( i = img_hash(path) & (img_size - 1); img_tab[i].path; i = (i + 1) & (img_size - 1) )
+		if ( strcmp(img_tab[i].path, path) == 0 )
+			break;
+	e = &img_tab[i];
+	if ( e->path ) {
+		if ( e->mtime == st.st_mtime )
+			return e;
+		}
+	else {
+		e->path = strdup(path);
+		img_count ++;
+		}
+	e->mtime = st.st_mtime;
+	e->fmt = IMG_NONE;
+	if ( (fp = fopen(path, "rb")) != NULL ) {
+		for ( int f = IMG_EPS; f <= IMG_JPEG; f ++ ) {
+			rewind(fp);
+			if ( probe[f](fp, &w, &h) ) {
+				e->fmt = f;
+				break;
+				}
+			}
+		fclose(fp);
+		}
+	if ( w <= 0 || h <= 0 )
+		w = h = 0;
+	else if ( w > IMG_MAX_WIDTH ) { // fit the line
+		h = (int) ((long) h * IMG_MAX_WIDTH / w);
+		w = IMG_MAX_WIDTH;
+		if ( h == 0 ) h = 1;
+		}
+	e->w = w;
+	e->h = h;
+	return e;
+	}
+
+/*
+ * writes the image 'file' of the document 'docname'; relative paths are
+ * relative to the directory of the document, and the path that is read
+ * is the one written. A PNG or JPEG image is replaced by its conversion
+ * to the format of the package, if there is one; otherwise, as any image
+ * that the macro of the package cannot load, it is written as text.
+ */
+void img_put(const char *docname, const char *alt, const char *file, int line) {
+	char	path[4096], conv[4096];
+	const char *slash = strrchr(docname, '/'), *dot, *base;
+	const img_t *e, *c;
+	int		fmt = ( mpack == mp_mom ) ? IMG_PDF : IMG_EPS;	// of .PDF_IMAGE, .PSPIC
+	int		w, h;
+
+	if ( *file != '/' && slash )
+		snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - docname), docname, file);
+	else
+		snprintf(path, sizeof(path), "%s", file);
+	e = img_probe(path);
+	w = e->w;
+	h = e->h;
+	if ( mpack == mp_man || mpack == mp_mdoc ) {
+		roff(img_mark, alt, path, 0, 0);
+		return;
+		}
+	if ( e->fmt == IMG_PNG || e->fmt == IMG_JPEG ) { // file.png -> file.eps
+		base = strrchr(path, '/');
+		dot = strrchr(( base ) ? base : path, '.');
+		snprintf(conv, sizeof(conv), "%.*s.%s", (int) (( dot ) ? dot - path : (long) strlen(path)), path,
+			( fmt == IMG_PDF ) ? "pdf" : "eps");
+		c = img_probe(conv);
+		if ( c->fmt != fmt ) {
+			fprintf(stderr, "%s:%d: the image '%s' is %s and there is no '%s', it is written as text\n",
+				docname, line, path, img_fmt_name[e->fmt], conv);
+			roff(img_mark, alt, path, 0, 0);
+			return;
+			}
+		strcpy(path, conv);
+		if ( w == 0 ) { // the size of the picture, else of its conversion
+			w = c->w;
+			h = c->h;
+			}
+		}
+	else if ( e->fmt != fmt ) {
+		fprintf(stderr, "%s:%d: the image '%s' is not %s, it is written as text\n",
+			docname, line, path, img_fmt_name[fmt]);
+		roff(img_mark, alt, path, 0, 0);
+		return;
+		}
+	if ( w == 0 )
+		fprintf(stderr, "%s:%d: unable to read the size of the image '%s'\n", docname, line, path);
+	roff(img_mark, alt, path, w, h);
+	}
+
+/*
+ *	include directive, '<!-- include: path.md -->' in a line of its own
+ *
+ *	The fragment is converted in the section of the include point and its
+ *	roff output is cached for the rest of the run, keyed by the path, the
+ *	package and the options; it is converted again if its modification
+ *	time, or the one of a file that it includes, changes. The path is
+ *	relative to the directory of the document. The footnote numbers of a
+ *	fragment are written as marks, INC_FN_MARK and its own number, which
+ *	are numbered after the footnotes of the including text when the output
+ *	is written, so the output does not depend on the include point.
+ */
+#define INC_MAX_DEPTH	16
+#define INC_FN_MARK		'\001'	// not valid in groff input, so not in the fragments
+
+typedef struct {
+	char	*path;
+	struct timespec mtime;
+	} inc_dep_t;
+
+typedef struct {
+	inc_dep_t *tab;
+	int		count, alloc;
+	} inc_deps_t;
+
+typedef struct {
+	char	*key;				// path, package, options and section
+	struct timespec mtime;
+	char	*roff;
+	size_t	len;
+	mdref_t	*notes;				// its footnotes, numbered after the document's
+	int		nnotes;
+	inc_deps_t deps;			// the files that it includes, at any depth
+	} inc_t;
+
+static inc_t	*inc_tab;
+static int		inc_size, inc_count;	// size is always power of 2
+static struct { dev_t dev; ino_t ino; } inc_stack[INC_MAX_DEPTH + 1];
+static int		inc_depth;
+static const char *inc_secname;			// set while a fragment is converted
+static inc_deps_t *inc_deps;			// of the fragment that is converted
+
+/*
+ * if the line 'p' is an include directive stores the path of the file
+ * and returns the next line; otherwise returns NULL.
+ */
+const char *inc_directive(const char *docname, const char *p, char *path, size_t size) {
+	const char *s = p, *e, *slash;
+
+	while ( *s == ' ' && s < p + 3 ) s ++;
+	if ( strncmp(s, "<!--", 4) != 0 )
+		return NULL;
+	for ( s += 4; ch_blank(*s); s ++ );
+	if ( strncmp(s, "include:", 8) != 0 )
+		return NULL;
+	for ( s += 8; ch_blank(*s); s ++ );
+	for ( e = s; *e && *e != '\n' && strncmp(e, "-->", 3) != 0; e ++ );
+	if ( strncmp(e, "-->", 3) != 0 )
+		return NULL;
+	p = e + 3;
+	while ( e > s && ch_blank(e[-1]) ) e --;
+	if ( e == s )
+		return NULL;
+	slash = strrchr(docname, '/');
+	if ( *s != '/' && slash )
+		snprintf(path, size, "%.*s/%.*s", (int) (slash - docname), docname, (int) (e - s), s);
+	else
+		snprintf(path, size, "%.*s", (int) (e - s), s);
+	while ( ch_blank(*p) ) p ++;
+	if ( *p == '\n' ) p ++;
+	return p;
+	}
+
+void md2roff(const char *docname, const char *source);
+
+#define inc_same_time(a, b)	((a).tv_sec == (b).tv_sec && (a).tv_nsec == (b).tv_nsec)
+
+// adds the file 'path' of time 'mtime' to the dependencies 'd'
+static void inc_dep_add(inc_deps_t *d, const char *path, struct timespec mtime) {
+	if ( d->count == d->alloc ) {
+		d->alloc = ( d->alloc ) ? d->alloc * 2 : 8;
+		panicif((d->tab = (inc_dep_t *) realloc(d->tab, d->alloc * sizeof(inc_dep_t))) == NULL, "out of memory");
+		}
+	d->tab[d->count].path = strdup(path);
+	d->tab[d->count ++].mtime = mtime;
+	}
+
+static void inc_deps_free(inc_deps_t *d) {
+	for ( int k = 0; k < d->count; k ++ )
+		free(d->tab[k].path);
+	free(d->tab);
+	memset(d, 0, sizeof(*d));
+	}
+
+// true if the fragment 'e' and the files that it includes did not change
+static bool inc_valid(const inc_t *e, const struct stat *st) {
+	struct stat ds;
+
+	if ( e->roff == NULL || !inc_same_time(e->mtime, st->st_mtim) )
+		return false;
+	for ( int k = 0; k < e->deps.count; k ++ )
+		if ( stat(e->deps.tab[k].path, &ds) != 0 || !inc_same_time(ds.st_mtim, e->deps.tab[k].mtime) )
+			return false;
+	return true;
+	}
+
+/*
+ * returns the entry of 'key', new if it is not in the cache
+ */
+static inc_t *inc_entry(const char *key) {
+	unsigned i;
+
+	if ( (inc_count + 1) * 2 > inc_size ) { // rehash
+		inc_t	*old = inc_tab;
+		int		osize = inc_size;
+		inc_size = ( inc_size ) ? inc_size * 2 : 64;
+		inc_tab = (inc_t *) calloc(inc_size, sizeof(inc_t));
+		panicif(inc_tab == NULL, "out of memory");
+		for ( int j = 0; j < osize; j ++ ) {
+			if ( old[j].key ) {
+				for ( i = img_hash(old[j].key) & (inc_size - 1); inc_tab[i].key; i = (i + 1) & (inc_size - 1) );
+				inc_tab[i] = old[j];
+				}
+			}
+		free(old);
+		}
+	for ( i = img_hash(key) & (inc_size - 1); inc_tab[i].key; i = (i + 1) & (inc_size - 1) )
+		if ( strcmp(inc_tab[i].key, key) == 0 )
+			return &inc_tab[i];
+	inc_tab[i].key = strdup(key);
+	inc_count ++;
+	return &inc_tab[i];
+	}
+
+/*
+ * writes the output of a fragment, with the footnote marks numbered from
+ * 'base': as marks again if a fragment is being converted, otherwise as
+ * the numbers of the document.
+ */
+static void inc_write(const char *s, size_t len, int base) {
+	const char *e = s + len, *m;
+	char	*t;
+
+	while ( (m = memchr(s, INC_FN_MARK, e - s)) != NULL ) {
+		fwrite(s, 1, m - s, fout);
+		if ( inc_deps )
+			fprintf(fout, "%c%ld%c", INC_FN_MARK, base + strtol(m + 1, &t, 10), INC_FN_MARK);
+		else
+			fprintf(fout, "%ld", fn_base + base + strtol(m + 1, &t, 10));
+		s = t + 1;
+		}
+	fwrite(s, 1, e - s, fout);
+	}
+
+/*
+ * writes the fragment 'path' included by 'docname' at 'line' in the
+ * section 'secname'.
+ */
+void inc_put(const char *docname, int line, const char *path, const char *secname) {
+	struct stat st;
+	char	key[4096 + 512];
+	inc_t	*e;
+	int		base = fn_count;
+
+	if ( stat(path, &st) != 0 || !S_ISREG(st.st_mode) ) {
+		fprintf(stderr, "%s:%d: unable to include '%s'\n", docname, line, path);
+		return;
+		}
+	if ( inc_depth == 0 ) { // the document itself
+		struct stat ds;
+		inc_stack[0].dev = inc_stack[0].ino = 0;
+		if ( stat(docname, &ds) == 0 ) {
+			inc_stack[0].dev = ds.st_dev;
+			inc_stack[0].ino = ds.st_ino;
+			}
+		}
+	for ( int k = 0; k <= inc_depth; k ++ ) {
+		if ( inc_stack[k].dev == st.st_dev && inc_stack[k].ino == st.st_ino ) {
+			fprintf(stderr, "%s:%d: include cycle, '%s'\n", docname, line, path);
+			return;
+			}
+		}
+	if ( inc_depth == INC_MAX_DEPTH ) {
+		fprintf(stderr, "%s:%d: includes nested too deep, '%s'\n", docname, line, path);
+		return;
+		}
+
+	// the cache
+	snprintf(key, sizeof(key), "%s\n%d%d%d%d%d\n%s\n%c%s", path, mpack, man_ofc, std_q, opt_name_style, opt_highlight,
+		secname, ( opt_sec_exclude ) ? '-' : '+', ( opt_sections ) ? opt_sections : "");
+	e = inc_entry(key);
+	if ( !inc_valid(e, &st) ) {
+		mdindex_t	fi = fn_index, li = link_index;
+		mdref_t		**fl = fn_list;
+		int			fc = fn_count, fa = fn_alloc, fb = fn_base, lp = stk_list_p, wl = write_lock;
+		const char	*ls = ln_source, *lpos = ln_pos;
+		int			ln = ln_num, lc = ln_cur;
+		lnidx_t		lx = ln_idx;
+		em_block_t	et = em_text;
+		FILE		*fp = fout;
+		inc_deps_t	*dp = inc_deps, deps = { NULL, 0, 0 };
+		char		*buf = loadfile(path), *roff, *c;
+		size_t		len;
+		mdref_t		*notes = NULL;
+		int			nnotes;
+
+		// convert it, the state of the document is saved
+		for ( c = buf; (c = strchr(c, INC_FN_MARK)) != NULL; c ++ )
+			*c = '\177'; // ignored by groff as well
+		memset(&ln_idx, 0, sizeof(ln_idx));
+		memset(&fn_index, 0, sizeof(fn_index));
+		memset(&link_index, 0, sizeof(link_index));
+		memset(&em_text, 0, sizeof(em_text));
+		fn_list = NULL;
+		fn_count = fn_alloc = fn_base = 0;
+		inc_deps = &deps;
+		inc_stack[++ inc_depth].dev = st.st_dev;
+		inc_stack[inc_depth].ino = st.st_ino;
+		panicif((fout = open_memstream(&roff, &len)) == NULL, "open_memstream failed");
+		inc_secname = secname;
+		md2roff(path, buf);
+		fclose(fout);
+		inc_depth --;
+		if ( (nnotes = fn_count) != 0 ) { // kept for the NOTES of the document
+			panicif((notes = (mdref_t *) calloc(fn_count, sizeof(mdref_t))) == NULL, "out of memory");
+			for ( int k = 0; k < fn_count; k ++ ) {
+				notes[k].text = substr(fn_list[k]->text, fn_list[k]->tlen);
+				notes[k].tlen = fn_list[k]->tlen;
+				}
+			}
+		idx_free(&fn_index);
+		idx_free(&link_index);
+		free(buf);
+		free(fn_list);
+		free(em_text.runs);
+		free(em_text.ops);
+		free(em_text.sorted);
+		em_text = et;
+		fn_base = fb;
+		fn_index = fi;
+		link_index = li;
+		fn_list = fl;
+		fn_count = fc;
+		fn_alloc = fa;
+		stk_list_p = lp;
+		write_lock = wl;
+		free(ln_idx.tab);
+		ln_idx = lx;
+		ln_cur = lc;
+		ln_source = ls;
+		ln_pos = lpos;
+		ln_num = ln;
+		fout = fp;
+		inc_deps = dp;
+
+		e = inc_entry(key);	// the nested includes may have moved it
+		free(e->roff);
+		for ( int k = 0; k < e->nnotes; k ++ )
+			free((char *) e->notes[k].text);
+		free(e->notes);
+		inc_deps_free(&e->deps);
+		e->roff = roff;
+		e->len = len;
+		e->notes = notes;
+		e->nnotes = nnotes;
+		e->deps = deps;
+		e->mtime = st.st_mtim;
+		}
+	if ( inc_deps ) { // the including fragment depends on it and on its includes
+		inc_dep_add(inc_deps, path, st.st_mtim);
+		for ( int k = 0; k < e->deps.count; k ++ )
+			inc_dep_add(inc_deps, e->deps.tab[k].path, e->deps.tab[k].mtime);
+		}
+	inc_write(e->roff, e->len, base);
+	for ( int k = 0; k < e->nnotes; k ++ ) {
+		e->notes[k].num = 0;
+		fn_number(&e->notes[k]);
+		}
+	}
+
+/*
+ *	section selection (--only-sections, --exclude-sections)
+ *
+ *	The skipped sections are not parsed, but they are normalized, indexed
+ *	and searched for the link and footnote definitions with the rest of
+ *	the document: the kept sections can use the definitions of any one.
+ */
+
+/*
+ * returns true if the section 'name' is converted; the text before the
+ * first section has the name "".
+ */
+bool sec_selected(const char *name) {
+	const char *s = opt_sections, *e;
+	size_t	len = strlen(name);
+
+	if ( opt_sections == NULL )
+		return true;
+	while ( *s ) {
+		while ( *s == ',' || *s == ' ' ) s ++;
+		for ( e = s; *e && *e != ','; e ++ );
+		if ( e > s && (size_t) (e - s) == len && strncasecmp(s, name, len) == 0 )
+			return !opt_sec_exclude;
+		s = e;
+		}
+	return opt_sec_exclude;
+	}
+
+/*
+ * returns the beginning of the next '#' or '##' header line after 'p',
+ * from the line index; the lines inside code blocks are skipped.
+ */
+const char *sec_skip(const char *p) {
+	bool	bcode = false;
+	int		i = ln_find(p);
+
+	if ( ln_source + ln_idx.tab[i].off < p )
+		i ++;
+	for ( ; i < ln_idx.count; i ++ ) {
+		const lnent_t *L = &ln_idx.tab[i];
+		if ( L->bq )
+			continue;
+		if ( L->cls == LN_FENCE )
+			bcode = !bcode;
+		else if ( !bcode && L->cls == LN_HEADER && L->level <= 2 ) {
+			const char *h = ln_source + L->off + L->level;
+			if ( *h == ' ' || *h == '\t' )
+				return ln_source + L->off;
+			}
+		}
+	return ln_source + ln_idx.size;
+	}
+
+/*
+ *	this converts the file 'docname',
+ *	that is loaded in 'source', to *-roff.
+ */
+#define KEY_GNUSYN "SYNTAX:"
+#define KEY_NDCCMD "COMMAND:"
+static char *month[] = {
+"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+NULL };
+
+//
+#define MAX_STR	255
+const char *get_man_header(const char *source, char *name, char *section, char *date) {
+	const char *p = source;
+	char *d;
+	int n;
+	
+	while ( ch_blank(*p) ) p ++;
+	d = name;
+	while ( *p ) {
+		if ( ch_space(*p) ) break;
+		if ( d - name > MAX_STR - 4 ) break;
+		n = ch_upper(p, d);		// UTF-8
+		p += n;
+		d += n;
+		}
+	*d = '\0';
+	
+	while ( ch_blank(*p) ) p ++;
+	d = section;
+	while ( *p ) {
+		if ( ch_space(*p) ) break;
+		if ( d - section >= MAX_STR ) break;
+		*d ++ = *p ++;
+		}
+	*d = '\0';
+	
+	while ( ch_blank(*p) ) p ++;
+	if ( *p != '\n' ) {
+		d = date;
+		while ( *p ) {
+			if ( ch_space(*p) ) break;
+			if ( d - date >= MAX_STR ) break;
+			*d ++ = *p ++;
+			}
+		*d = '\0';
+		}
+	else {
+		time_t tt = time(0);   // get time now
+		struct tm *t = localtime(&tt);
+		sprintf(date, "%s %d %d", month[t->tm_mon], t->tm_mday,  t->tm_year+1900);
+		}
+	
+	return p;
+	}
+
+/*
+ *	diagnostics of md2roff()
+ *
+ *	The problems of the text are reported as 'file:line:col: message' and
+ *	counted for --check.
+ */
+static int	lint_count;
+
+static void lint_msg(const char *docname, int line, int col, const char *fmt, ...) {
+	char	msg[1024];
+	int		n;
+	va_list	ap;
+
+	n = snprintf(msg, sizeof(msg), "%s:%d:%d: ", docname, line, col);
+	va_start(ap, fmt);
+	n += vsnprintf(msg + n, sizeof(msg) - n - 1, fmt, ap);
+	va_end(ap);
+	if ( n > (int) sizeof(msg) - 2 )
+		n = sizeof(msg) - 2;
+	msg[n ++] = '\n';
+	write(STDERR_FILENO, msg, n);	// one write, the jobs share stderr
+	lint_count ++;
+	}
+
+/*
+ * reports the strong and emphasis of the resolved block 'b' that are
+ * opened and not closed
+ */
+static void em_lint(const char *docname, const em_block_t *b) {
+	for ( int i = 0; i < b->count; i ++ ) {
+		const em_run_t *r = &b->runs[i];
+		const char *p = b->base + r->off;
+		int		line;
+
+		if ( !r->can_open || r->can_close || r->left == 0 )
+			continue;
+		line = src_line(p);
+		if ( (std_q) ? r->left >= 2 : r->ch == '*' )
+			lint_msg(docname, line, p - ln_pos + 1, "strong (%.*s) is not closed", ( r->left >= 2 ) ? 2 : 1, p);
+		else
+			lint_msg(docname, line, p - ln_pos + 1, "emphasis (%c) is not closed", *p);
+		}
+	}
+
+#define dcopy(c) { for ( const char *s = (c); *s; *d ++ = *s ++ ); }
+static bool pc_use(const char *source);
+
+void md2roff(const char *docname, const char *source) {
+	const char *p = source, *pnext, *pstart;
+	char	*dest, *d;
+	bool	bline = true, bcode = false;
+	bool	inside_list = false;
+	bool	title_level = 0;
+	char	secname[256], appname[256], appsec[256], appdate[256];
+	char	align[MAX_TBL_COLS + 1];
+	char	path[4096];
+	int		ncols;
+	const char *frag = inc_secname;	// section of the include point, NULL = document
+	bool	synopsis;			// secname is SYNOPSIS
+
+	inc_secname = NULL;
+	if ( fout == NULL )
+		fout = stdout;
+	if ( man_ofc && !zdic_ready )
+		zdic_init();
+	stk_list_p = 0; // reset stack
+	snprintf(secname, sizeof(secname), "%s", ( frag ) ? frag : "");
+	synopsis = ( strcmp(secname, "SYNOPSIS") == 0 );
+	appname[0] = appsec[0] = '\0';
+	ln_source = source;
+	if ( !pc_use(source) ) {
+		ln_build(source);
+		refs_collect(source);
+		}
+	em_text.base = em_text.end = NULL;
+	dest = (char *) malloc(64*1024);
+	d = dest;
+
+	if ( !frag ) {
+		oputs(".\\# roff document");
+		oputs(".\\# DO NOT MODIFY THIS FILE! It was generated by md2roff");
+		}
+	if ( !frag ) switch ( mpack ) {
+	case mp_mm:
+		oputs(".do mso m.tmac"); // mm package, AL BL DL LI LE
+		break;
+	case mp_ms:
+		oputs(".do mso ms.tmac"); // ms package
+		while ( ch_space(*p) ) p ++;
+		if ( p[0] == '#' && ch_blank(p[1]) ) {
+			oputs(".TL");
+			p += 2;
+			const char *pn = p;
+			while ( *pn && *pn != '\n' ) pn ++;
+			oprintf("%.*s\n", (int) (pn - p), p);
+			p = ( *pn ) ? pn + 1 : pn;
+			oputs(".\\# .AU");
+			oputs(".\\# Author");
+			oputs(".\\# .AI");
+			oputs(".\\# Author's institution(s)");
+			oputs(".\\# .ND date");
+			oputs(".\\# .AB");
+			oputs(".\\# Abstract; to be placed on the cover sheet of a paper.");
+			oputs(".\\# Line length is 5/6 of normal; use .11 here to change.");
+			oputs(".\\# .AE");
+			oputs(".PP");
+			}
+		break;
+	case mp_mdoc:
+	case mp_man:
+		if ( mpack == mp_mdoc )
+			oputs(".do mso mdoc.tmac"); // BSD man
+		else
+			oputs(".do mso man.tmac"); // Linux man
+		
+		while ( ch_space(*p) ) p ++;
+		if ( p[0] == '#' && ch_blank(p[1]) ) {
+			p = get_man_header(p+2, appname, appsec, appdate);
+			if ( opt_xrefs )
+				xref_page(appname, appsec);
+			if ( mpack == mp_mdoc ) {
+				oprintf(".Dd $Mdocdate: %s $\n", appdate);
+				oprintf(".Dt %s %s\n", appname, appsec);
+				oprintf(".Os\n");
+				while ( *p != '\n' ) p ++;
+				}
+			else { // linux man
+				oprintf(".TH %s %s %s", appname, appsec, appdate);
+				if ( *p != '\n' )
+					p = println(p);
+				else
+					oprintf("\n");
+				}
+			while ( ch_space(*p) ) p ++;
+			}
+		else { // no header specified
+			time_t tt = time(0);   // get time now
+			struct tm *t = localtime(&tt);
+			
+			strcpy(appname, docname);
+			strcpy(appsec, "7");
+			if ( mpack == mp_mdoc ) {
+				oprintf(".Dd $Mdocdate: %s %d %d $\n",
+					month[t->tm_mon], t->tm_mday,  t->tm_year+1900);
+				oprintf(".Dt %s %s\n", appname, "7");
+				oprintf(".Os\n");
+				}
+			else {
+				oprintf(".TH %s 7 %d-%02d-%02d document\n", docname,
+					t->tm_year+1900, t->tm_mon+1, t->tm_mday);
+				}
+			}
+		break;
+	case mp_mom:
+		oputs(".do mso mom.tmac"); // mom
+		oprintf(".TITLE \"%s\"\n", docname);
+		oprintf(".AUTHOR \"md2roff\"\n");
+		oprintf(".PAPER A4\n");
+		oprintf(".PRINTSTYLE TYPESET\n");
+		oprintf(".START\n");
+		break;
+		}
+
+	if ( !frag && !sec_selected("") ) // the text before the first section
+		p = sec_skip(p);
+	while ( *p ) {
+
+		//////////////////////////////////
+		// inside code block
+		//////////////////////////////////
+		if ( bcode ) {
+			d = flushln(d, dest); // we dont care
+			
+			const lnent_t *L = ln_at(p);
+			if ( L->cls == LN_FENCE && L->bq == 0 ) { // end of code-block
+				p += 3;
+				while ( *p != '\n' ) p ++;
+				if ( *p == '\n' ) p ++;
+				bcode = false;
+				roff(cblock_end);
+				d = flushln(d, dest);
+				continue;
+				}
+			else {
+				bool xchg_dot = false;
+				if ( *p == '.' ) {
+					if ( mpack == mp_mom )
+						oputs(".ESC_CHAR !");
+					else
+						oputs(".cc !");
+					xchg_dot = true;
+					}
+				p = ( hl_lang ) ? hl_line(p) : println(p);
+				if ( xchg_dot ) {
+					if ( mpack == mp_mom )
+						oputs(".ESC_CHAR .");
+					else
+						oputs("!cc .");
+					}
+				continue;
+				}
+			}
+
+		//////////////////////////////////
+		// ignore escape characters
+		if ( *p == '\\' ) {
+			p ++;
+			switch (*p) {
+			case 'n': *d ++ = '\n'; break;
+			case 'r': *d ++ = '\r'; break;
+			case 't': *d ++ = '\t'; break;
+			case 'f': *d ++ = '\f'; break;
+			case 'b': *d ++ = '\b'; break;
+			case 'a': *d ++ = '\a'; break;
+			case 'e': *d ++ = '\033'; break;
+			default:
+				*d ++ = *p;
+				}
+			p ++;
+			bline = false;
+			continue;
+			}
+		
+		//////////////////////////////////
+		// beginning of line
+		//////////////////////////////////
+		if ( bline ) {
+			const lnent_t *L = ln_at(p);
+
+			bline = false;
+			bq_level = L->bq;
+			if ( bq_level ) { // open blockquote
+				p += bq_level;
+				d = flushln(d, dest);
+				roff(none);
+				d = flushln(d, dest);
+				}
+
+			//
+			if ( (*p == '<' || *p == ' ') && (pnext = inc_directive(docname, p, path, sizeof(path))) != NULL ) {
+				d = flushln(d, dest);
+				if ( stk_list_p || bq_level ) { // its blocks cannot be nested
+					fprintf(stderr, "%s:%d: include in a list or a blockquote, '%s'\n", docname, src_line(p), path);
+					exit(EXIT_FAILURE);
+					}
+				if ( !write_lock )
+					inc_put(docname, src_line(p), path, secname);
+				p = pnext;
+				bline = true;
+				continue;
+				}
+			else if ( *p == '\n' ) { // empty line
+				d = flushln(d, dest);
+				
+				if ( stk_list_p ) {
+					roff(li_end);
+					roff(lst_close);
+					stk_list_p --;
+					}
+				roff(par_end);
+				bline = true;
+				p ++;
+				continue;
+				}
+			else if ( L->cls == LN_HEADER ) { // header
+				d = flushln(d, dest);
+				
+				int ln = ln_find(p);
+				pnext = ln_end(ln);
+				if ( *pnext ) {
+					if ( *(pnext-1) != '#' ) {
+						int	level = L->level;
+						p += level;
+						while ( *p == ' ' || *p == '\t' ) p ++;
+						switch ( level ) {
+						case 1: roff(new_sh); break; // TH?
+						case 2: {
+							const char *s;
+							char *n;
+							for ( s = p, n = secname; *s && *s != '\n'; s ++ )
+								if ( n < secname + sizeof(secname) - 1 )
+									*n ++ = *s;
+							*n = '\0';
+							synopsis = ( strcmp(secname, "SYNOPSIS") == 0 );
+							if ( opt_whatis && !frag && strcmp(secname, "NAME") == 0
+									&& (mpack == mp_man || mpack == mp_mdoc) )
+								whatis_add(appname, appsec, s + 1);
+							if ( !sec_selected(secname) ) { // skip the section
+								p = sec_skip(s);
+								bline = true;
+								continue;
+								}
+							if ( man_ofc ) {
+								if ( strcmp(secname, "COPYRIGHT") == 0 \
+										|| strcmp(secname, "AUTHOR") == 0 \
+										|| strcmp(secname, "HOMEPAGE") == 0 \
+										|| strcmp(secname, "REPORTING BUGS") == 0 \
+										|| strcmp(secname, "AUTHOR") == 0 \
+										|| strcmp(secname, "AUTHORS") == 0 )
+									write_lock = 1;
+								else
+									write_lock = 0;
+								}
+							if ( !write_lock ) roff(new_sh);
+							}
+							break;
+						case 3: roff(new_ss); break;
+						case 4:
+						default:
+							if ( mpack == mp_ms ) {
+								roff(new_ss);
+								break;
+								}
+							
+							if ( mpack == mp_man ) {
+								d = flushln(d, dest);
+								oprintf(".TP\n");
+								int state = 'R';
+								dcopy("\\fB");
+								while ( ch_blank(*p) ) p ++;
+								while ( ch_word(*p) )
+									*d ++ = *p ++;
+								dcopy("\\fR");
+								while ( *p ) {
+									// continue to the next line
+									if ( *p == '\\' ) {
+										while ( *p && *p != '\n' ) p ++;
+										if ( *p == '\n' ) p ++;
+										continue;
+										}
+									
+									// end of string, reset to defaults and exit loop
+									if ( *p == '\n' ) {
+										if ( state != 'R' )
+											dcopy("\\fR");
+										break;
+										}
+									
+									// other characters
+									switch ( *p ) { // separator, nocolor
+									case ' ': case '\t':
+									case '[': case '{': case '(':
+									case ']': case '}': case ')':
+									case ',': case '|': case '.':
+									case '=':
+										if ( state != 'R' ) {
+											dcopy("\\fR");
+											state = 'R';
+											}
+										*d ++ = *p ++;
+										break;
+									case '+': case '!':
+										if ( state != 'B' ) {
+											dcopy("\\fB");
+											state = 'B';
+											}
+										*d ++ = *p ++;
+										break;
+									case '-': // short or long option, bold
+										if ( state != 'B' ) {
+											dcopy("\\fB");
+											state = 'B';
+											}
+										if ( p[1] == '-' ) // double minus
+											*d ++ = *p ++;
+										*d ++ = *p ++;
+										while ( ch_word(*p) )
+											*d ++ = *p ++;
+										break;
+									default: // normal parameter, italics
+										if ( state != 'I' ) {
+											dcopy("\\fI");
+											state = 'I';
+											}
+										*d ++ = *p ++;
+										}
+									}
+								d = flushln(d, dest);
+								}
+							else
+								roff(new_s4);
+							continue;
+							}
+						p = println_text(p);
+						if ( mpack == mp_ms )
+							oputs(".PP");
+						bline = true;
+						continue;
+						}
+					else {
+						roff(box_open);
+						roff(ln_brk);
+						p = println_text(p);
+						roff(ln_brk);
+						roff(box_close);
+						continue;
+						}
+					}
+				}
+			else if ( (ncols = tbl_detect(p, align)) != 0 ) { // table
+				d = flushln(d, dest);
+				p = tbl_convert(p, ncols, align);
+				bline = true;
+				continue;
+				}
+			else if ( (*p == '[' || *p == ' ') && (pnext = ref_def(p)) != NULL ) { // footnote or link definition
+				p = pnext;
+				bline = true;
+				continue;
+				}
+			else if ( mpack == mp_man && synopsis
+					&& (opt_name_style == 2 || strncmp(p, KEY_GNUSYN, strlen(KEY_GNUSYN)) == 0) ) { // SYNTAX BLOCK (.SY/.YS)
+				bool first;
+				
+				d = flushln(d, dest);
+				if ( opt_name_style != 2 )
+					p += strlen(KEY_GNUSYN);
+				dcopy(".SY ");
+				while ( ch_space(*p) ) p ++;
+				while ( *p && *p != '\n' ) *d ++ = *p ++;
+				if ( *p ) *d ++ = *p ++;
+				while ( *p ) {
+					if ( !ch_blank(*p) ) {
+						if ( *p == '\n' )
+							break;
+						else {
+							int mode = 2;
+							if ( *p == '-' ) mode = 1;
+							if ( mode == 1 )
+								dcopy(".OP \\")
+							else 
+								dcopy(".RI ")
+							first = true;
+							while ( *p && *p != '\n' ) {
+								if ( *p == ' ' && first ) {
+									first = false;
+									if ( mode == 2 )
+										dcopy("\\ ");
+									}
+								else if ( !first ) {
+									if ( *p == ' ' ) {
+										dcopy("\\fR\\");
+										*d ++ = *p ++;
+										dcopy("\\f");
+										*d ++ = (mode == 1) ? 'I' : 'R';
+										continue;
+										}
+									else if ( strchr("[].-{}|", *p) ) {
+										dcopy("\\f");
+										*d ++ = (mode == 1) ? 'B' : 'R';
+										while ( strchr("[].-{}|", *p) )
+											*d ++ = *p ++;
+										dcopy("\\f");
+										*d ++ = (mode == 1) ? 'I' : 'R';
+										continue;
+										}
+									}
+								*d ++ = *p ++;
+								}
+							
+							if ( *p ) *d ++ = *p ++;
+							continue;
+							}
+						}
+					p ++;
+					}
+				dcopy(".YS");
+				*d = '\0';
+				oputs(dest);
+				d = dest;
+				continue;
+				}
+			else if ( mpack == mp_mdoc && synopsis && \
+					(opt_name_style == 3 || strncmp(p, KEY_GNUSYN, strlen(KEY_GNUSYN)) == 0) ) { // SYNTAX BLOCK (.Nm)
+				d = flushln(d, dest);
+				if ( opt_name_style != 3 )
+					p += strlen(KEY_GNUSYN);
+				dcopy(".Nm ");
+				while ( ch_space(*p) ) p ++;
+				while ( *p && *p != '\n' ) *d ++ = *p ++;
+				if ( *p ) *d ++ = *p ++;
+				while ( *p ) {
+					if ( !ch_blank(*p) ) {
+						if ( *p == '\n' )
+							break;
+						else {
+							if ( p[0] == '-' || p[1] == '-' || p[2] == '-' )
+								dcopy(".Op ")
+							else
+								dcopy(".Ar ")
+							while ( *p && *p != '\n' ) {
+								switch ( *p ) {
+								case '-': dcopy(" Fl "); p ++; continue;
+								case '[': dcopy(" Oo "); p ++; continue;
+								case ']': dcopy(" Oc "); p ++; continue;
+								case ' ': dcopy(" Ar "); p ++; continue;
+									};
+								*d ++ = *p ++;
+								}
+							if ( *p ) *d ++ = *p ++;
+							continue;
+							}
+						}
+					p ++;
+					}
+				*d = '\0';
+				oputs(dest);
+				d = dest;
+				continue;
+				}
+			else if ( mpack == mp_man && synopsis
+					&& (opt_name_style == 1 || strncmp(p, KEY_NDCCMD, strlen(KEY_NDCCMD)) == 0) ) { // NDC's pretty style for commands
+				d = flushln(d, dest);
+				if ( opt_name_style != 1 )
+					p += strlen(KEY_NDCCMD);
+				int state = 'R';
+				dcopy("\\fB");
+				while ( ch_blank(*p) ) p ++;
+				while ( ch_word(*p) )
+					*d ++ = *p ++;
+				dcopy("\\fR");
+				while ( *p ) {
+					// continue to the next line
+					if ( *p == '\\' ) {
+						while ( *p && *p != '\n' ) p ++;
+						if ( *p == '\n' ) p ++;
+						continue;
+						}
+					
+					// end of string, reset to defaults and exit loop
+					if ( *p == '\n' ) {
+						if ( state != 'R' )
+							dcopy("\\fR");
+						break;
+						}
+					
+					// other characters
+					switch ( *p ) { // separator, nocolor
+					case ' ': case '\t':
 					case '[': case '{': case '(':
 					case ']': case '}': case ')':
 					case ',': case '|': case '.':
@@ -1098,309 +4283,3448 @@ void md2roff(const char *docname, const char *source) {
 							dcopy("\\fB");
 							state = 'B';
 							}
-						if ( p[1] == '-' ) // double minus
-							*d ++ = *p ++;
-						*d ++ = *p ++;
-						while ( isalnum(*p) )
-							*d ++ = *p ++;
-						break;
-					default: // normal parameter, italics
-						if ( state != 'I' ) {
-							dcopy("\\fI");
-							state = 'I';
+						if ( p[1] == '-' ) // double minus
+							*d ++ = *p ++;
+						*d ++ = *p ++;
+						while ( ch_word(*p) )
+							*d ++ = *p ++;
+						break;
+					default: // normal parameter, italics
+						if ( state != 'I' ) {
+							dcopy("\\fI");
+							state = 'I';
+							}
+						*d ++ = *p ++;
+						}
+					}
+				d = flushln(d, dest);
+				}
+			else if ( L->cls == LN_ULIST ) { // unordered list
+				d = flushln(d, dest);
+				if ( stk_list_p )
+					roff(li_end);
+				else
+					roff(ul_open);
+				roff(li_open);
+				p ++;
+				continue;
+				}
+			else if ( L->cls == LN_OLIST ) { // ordered list
+				char	num[16], *n;
+
+				n = num;
+				while ( ch_digit(*p) ) {
+					if ( n < num + sizeof(num) - 1 )
+						*n ++ = *p;
+					p ++;
+					}
+				*n = '\0';
+				d = flushln(d, dest);
+				if ( stk_list_p )
+					roff(li_end);
+				else
+					roff(ol_open);
+				stk_count[stk_list_p-1] = atoi(num);
+				roff(li_open);
+				p ++;
+				while ( *p == ' ' || *p == '\t' ) p ++;
+				continue;
+				}
+			else if ( L->cls == LN_FENCE ) { // open code-block
+				bcode = true;
+				p += 3;
+				hl_select(p);
+				while ( *p != '\n' ) p ++;
+				if ( *p == '\n' ) p ++;
+				d = flushln(d, dest);
+				roff(cblock_open);
+				continue;
+				}
+			} // inside if ( beginning of line )
+
+		//////////////////////////////////
+		// in line
+		//////////////////////////////////
+		if ( *p == '\n' ) {
+			int ln = ln_find(p + 1);
+			if ( ln_idx.tab[ln].cls == LN_RULE && ln_idx.tab[ln].bq == 0 ) {
+				char rc = *(p+1);
+				char	*prevln;
+				p = ln_end(ln);
+				if ( !*p )
+					break;
+				if ( d == dest ) {
+					p ++;
+					continue;
+					}
+
+				// this is ruler or section
+				*d = '\0';
+				prevln = strrchr(dest, '\n');
+				if ( prevln ) {
+					*prevln = '\0';
+					if ( prevln > dest )
+						oputs(dest);
+					prevln ++;
+					roff(new_sh);
+					oprintf("%s\n", prevln);
+					d = dest;
+					}
+				else {
+					roff(new_sh);
+					d = flushln(d, dest);
+					}
+				
+				p ++;
+				continue;
+				}
+			else
+				*d ++ = ' ';
+
+			bline = true;
+			}
+		else if ( *p == '*' || *p == '_' ) { // strong, emphasis
+			int n;
+			if ( p < em_text.base || p >= em_text.end )
+				em_resolve(&em_text, p, em_block(p), ( p > source ) ? p[-1] : '\n', true);
+			d = stradd(d, em_put(&em_text, p, &n, true));
+			p += n;
+			continue;
+			}
+		else if ( *p == '`' ) { // inline code
+			if ( memchr(p + 1, '`', ln_para_end(p) - (p + 1)) == NULL ) {
+				int line = src_line(p);
+				lint_msg(docname, line, p - ln_pos + 1, "inline code (`) is not closed");
+				*d ++ = *p ++;
+				continue;
+				}
+			p ++;
+			if ( mpack == mp_mom )
+				d = stradd(d, "`\\*[CODE]");
+			else
+				d = stradd(d, "‘\\f[CR]");
+			
+			while ( *p != '`' )
+				*d ++ = *p ++;
+
+			if ( mpack == mp_mom )
+				d = stradd(d, "\\*[CODE OFF]'");
+			else
+				d = stradd(d, "\\fP’");
+			}
+
+		//
+		//	Markdown link:
+		//
+		//	generic link syntax  [text](link)
+		//	image link syntax	![text](link)
+		//	man page syntax      [page section](man)
+		//  cite				 [^digit]
+		//
+		else if (
+				 ( *p == '[' && *(p+1) != '^' ) ||
+				 ( *p == '!' && *(p+1) == '[' )
+				) { // markdown link
+			const char *pfin, *url = NULL;
+			int		ulen = 0;
+			bool	bimg = false;
+			if ( *p == '!' ) {
+				p ++;
+				bimg = true;
+				}
+			const char *lim = ln_para_end(p);
+			pstart = p + 1;
+			pnext = memchr(pstart, ']', lim - pstart);
+			if ( pnext
+					 && ( *(pnext+1) == '(' )
+						 && ((pfin = memchr(pnext+2, ')', lim - (pnext+2))) != NULL)
+			   ) { // inline link
+				url = pnext + 2;
+				ulen = pfin - url;
+				}
+			else if ( pnext && link_index.count ) { // reference link
+				const char *label = pstart, *e;
+				int		llen = pnext - pstart;
+				mdref_t	*r;
+
+				pfin = pnext;
+				if ( *(pnext+1) == '[' ) { // [text][label] or [text][]
+					for ( e = pnext + 2; *e && *e != ']' && *e != '\n'; e ++ );
+					if ( *e == ']' ) {
+						if ( e > pnext + 2 ) {
+							label = pnext + 2;
+							llen = e - label;
+							}
+						pfin = e;
+						}
+					}
+				if ( (r = idx_find(&link_index, label, llen)) != NULL ) {
+					url = r->text;
+					ulen = r->tlen;
+					}
+				}
+			if ( url ) {
+				char *left = substr(pstart, pnext - pstart);
+				char *rght = substr(url, ulen);
+				char punc = '\0';
+
+				d = flushln(d, dest);
+				
+				if ( pfin[1] && strchr(".,)]}", pfin[1]) )
+					punc = pfin[1];
+
+				if ( bimg ) {
+					char *sp = strpbrk(rght, " \t\n");	// ![alt](file "title")
+					if ( sp ) *sp = '\0';
+					punc = '\0';
+					if ( !write_lock )
+						img_put(docname, left, rght, src_line(p));
+					}
+				else if ( strcmp(rght, "man") == 0 ) {
+					if ( opt_xrefs && !write_lock )
+						xref_ref(left, docname, src_line(p));
+					roff(man_ref, left, (int) punc);
+					}
+				else {
+					if ( man_ofc ) {
+						char *fixed = zdic_dup(left);
+						free(left);
+						left = fixed;
+						}
+					roff(url_mark, left, rght, (int) punc);
+					}
+				
+				// finish
+				free(left);
+				free(rght);
+				p = pfin + 1;
+				if ( punc )
+					p ++;
+				continue;
+				}
+			else {
+				if ( bimg )
+					*d ++ = '!';
+				*d ++ = *p ++;
+				continue;
+				}
+			}
+		else if ( *p == '[' && *(p+1) == '^' ) { // footnote reference
+			mdref_t *r = NULL;
+
+			for ( pnext = p + 2; *pnext && *pnext != ']' && *pnext != '\n'; pnext ++ );
+			if ( *pnext == ']' )
+				r = idx_find(&fn_index, p + 2, pnext - (p + 2));
+			if ( r == NULL ) {
+				*d ++ = *p ++;
+				continue;
+				}
+			p = pnext + 1;
+			if ( write_lock )
+				continue;
+			if ( mpack == mp_man || mpack == mp_mdoc ) {
+				if ( inc_deps ) // a fragment, see inc_write()
+					d += sprintf(d, "[%c%d%c]", INC_FN_MARK, fn_number(r), INC_FN_MARK);
+				else
+					d += sprintf(d, "[%d]", fn_number(r));
+				continue;
+				}
+			if ( *p && strchr(".,;:!?)", *p) )
+				*d ++ = *p ++;
+			switch ( mpack ) {
+			case mp_ms: dcopy("\\**"); break;
+			case mp_mm: dcopy("\\*F"); break;
+			default: dcopy("\\c");
+				}
+			d = flushln(d, dest);
+			roff(fn_open);
+			put_inline(r->text, r->tlen);
+			oputc('\n');
+			roff(fn_close);
+			continue;
+			}
+		else {
+			const char *rp;
+			int		n;
+
+			if ( man_ofc && ZDIC_MAYBE(p) && (n = zdic_match(p, &rp)) != 0 ) { // -z correction
+				dcopy(rp);
+				p += n;
+				continue;
+				}
+			*d = *p;
+			d ++;
+			}
+
+		p ++;
+		}
+	d = flushln(d, dest);
+	if ( frag ) { // the lists of a fragment are closed
+		while ( stk_list_p ) {
+			roff(li_end);
+			roff(lst_close);
+			stk_list_p --;
+			}
+		}
+	else if ( mpack == mp_man || mpack == mp_mdoc )
+		fn_notes();
+	if ( !frag ) { // inc_put() takes the footnotes of a fragment first
+		idx_free(&fn_index);
+		idx_free(&link_index);
+		}
+
+	free(dest);
+	}
+
+/*
+ *	terminal renderer (--render)
+ *
+ *	Formats the man page written by md2roff() for the terminal, without
+ *	groff: filled and justified text, hanging indents of .TP/.IP, .RS/.RE,
+ *	.EX/.EE and .nf/.fi blocks, .SY/.OP/.YS synopsis, links and tables.
+ *	Only the requests and the escapes that md2roff() writes are known;
+ *	the rest are ignored. Bold and italic are written with SGR sequences
+ *	or with overstrike (the italic is underlined, as grotty does).
+ */
+enum { rn_sgr, rn_overstrike };
+int opt_render = -1;			// --render, -1 = off
+
+enum { RN_R, RN_B, RN_I };
+#define RN_IPW		7			// default indent of .TP/.IP/.RS
+#define RN_MAXLN	1024		// glyphs per line
+
+typedef struct {
+	char			c[4];		// UTF-8 sequence
+	unsigned char	len, font;
+	} rn_glyph_t;
+
+static struct {
+	FILE		*out;
+	int			style, width;
+	int			base, in, ti;	// left margin, indent, first line indent (-1 none)
+	int			rs[16], rs_n;	// .RS stack of margins
+	int			in_prev, ipw;	// .in, indent of last .TP/.IP
+	int			font, prev_font;
+	bool		fill, spaced, join, tp_tag, pad;
+	const char	*url;			// of .UR/.MT
+	int			urlen;
+	char		cc;				// control character
+	rn_glyph_t	word[RN_MAXLN], line[RN_MAXLN];
+	int			wlen, llen, gaps[RN_MAXLN], ngaps, lines;
+	char		th[5][256];		// .TH arguments
+	} rn;
+
+/*
+ * writes 'n' glyphs with their fonts
+ */
+static void rn_put(const rn_glyph_t *g, int n) {
+	int font = RN_R;
+
+	for ( int i = 0; i < n; i ++ ) {
+		if ( rn.style == rn_sgr ) {
+			if ( g[i].font != font ) {
+				fputs("\033[0m", rn.out);
+				if ( g[i].font == RN_B ) fputs("\033[1m", rn.out);
+				if ( g[i].font == RN_I ) fputs("\033[4m", rn.out);
+				font = g[i].font;
+				}
+			}
+		else if ( g[i].font != RN_R && g[i].c[0] != ' ' ) {
+			if ( g[i].font == RN_B )
+				fwrite(g[i].c, 1, g[i].len, rn.out);
+			else
+				putc('_', rn.out);
+			putc('\b', rn.out);
+			}
+		fwrite(g[i].c, 1, g[i].len, rn.out);
+		}
+	if ( font != RN_R )
+		fputs("\033[0m", rn.out);
+	}
+
+/*
+ * writes an output line of 'n' glyphs at the column 'indent'
+ */
+static void rn_putln(int indent, const rn_glyph_t *g, int n) {
+	while ( n && g[n - 1].c[0] == ' ' && g[n - 1].font == RN_R ) n --;
+	if ( n ) {
+		fprintf(rn.out, "%*s", indent, "");
+		rn_put(g, n);
+		}
+	putc('\n', rn.out);
+	rn.spaced = false;
+	rn.lines ++;
+	}
+
+static int rn_indent() {
+	return ( rn.ti >= 0 ) ? rn.ti : rn.in;
+	}
+
+/*
+ * writes the pending line; if 'justify' the spaces are stretched to the
+ * line length.
+ */
+static void rn_flush(bool justify) {
+	rn_glyph_t	out[RN_MAXLN * 2];
+	int			extra, rem, n = 0, g = 0;
+	static bool	right;			// the odd spaces go to the right or to the left
+
+	if ( rn.llen == 0 ) {
+		rn.ti = -1;
+		return;
+		}
+	extra = rn.width - rn_indent() - rn.llen;
+	if ( !justify || extra <= 0 || rn.ngaps == 0 || !rn.fill )
+		extra = 0;
+	rem = ( rn.ngaps ) ? extra % rn.ngaps : 0;
+	right = !right;
+	for ( int i = 0; i < rn.llen && n < RN_MAXLN * 2; i ++ ) {
+		out[n ++] = rn.line[i];
+		if ( g < rn.ngaps && rn.gaps[g] == i ) { // the extra spaces of the gap
+			int k = extra / rn.ngaps + ( (right) ? g >= rn.ngaps - rem : g < rem );
+			while ( k -- > 0 && n < RN_MAXLN * 2 )
+				out[n ++] = rn.line[i];
+			g ++;
+			}
+		}
+	rn_putln(rn_indent(), out, n);
+	rn.llen = rn.ngaps = 0;
+	rn.ti = -1;
+	}
+
+/*
+ * ends the current word and adds it to the line
+ */
+static void rn_word_end() {
+	int avail = rn.width - rn_indent();
+
+	if ( rn.wlen == 0 )
+		return;
+	if ( rn.llen && rn.llen + 1 + rn.wlen > avail )
+		rn_flush(true);
+	if ( rn.llen && !rn.pad && rn.llen < RN_MAXLN - 1 ) {
+		rn.gaps[rn.ngaps ++] = rn.llen;
+		rn.line[rn.llen].c[0] = ' ';
+		rn.line[rn.llen].len = 1;
+		rn.line[rn.llen ++].font = RN_R;
+		}
+	for ( int i = 0; i < rn.wlen && rn.llen < RN_MAXLN; i ++ )
+		rn.line[rn.llen ++] = rn.word[i];
+	rn.wlen = 0;
+	rn.pad = false;
+	}
+
+static void rn_glyph(const char *c, int len, int font) {
+	if ( rn.wlen < RN_MAXLN && len <= 4 ) {
+		memcpy(rn.word[rn.wlen].c, c, len);
+		rn.word[rn.wlen].len = len;
+		rn.word[rn.wlen ++].font = font;
+		}
+	}
+
+/*
+ * break: writes the pending text without justification
+ */
+static void rn_break() {
+	rn_word_end();
+	rn_flush(false);
+	}
+
+/*
+ * vertical space of one line, only once
+ */
+static void rn_space() {
+	rn_break();
+	if ( !rn.spaced && rn.lines ) {
+		putc('\n', rn.out);
+		rn.lines ++;
+		}
+	rn.spaced = true;
+	}
+
+/*
+ * the special characters \(xx and \[xx]
+ */
+static const char *rn_special(const char *name, int len) {
+	static const char *tab[][2] = {
+		{ "bu", "\xe2\x80\xa2" }, { "em", "\xe2\x80\x94" }, { "en", "\xe2\x80\x93" },
+		{ "lq", "\xe2\x80\x9c" }, { "rq", "\xe2\x80\x9d" }, { "oq", "\xe2\x80\x98" },
+		{ "cq", "\xe2\x80\x99" }, { "aq", "'" }, { "dq", "\"" }, { "ga", "`" },
+		{ "ti", "~" }, { "ha", "^" }, { "rs", "\\" }, { "lB", "[" }, { "rB", "]" },
+		{ "hy", "-" }, { "mi", "-" }, { "co", "\xc2\xa9" }, { "rg", "\xc2\xae" },
+		{ "de", "\xc2\xb0" }, { "mu", "\xc3\x97" }, { "->", "\xe2\x86\x92" },
+		{ "<-", "\xe2\x86\x90" }, { "<=", "\xe2\x89\xa4" }, { ">=", "\xe2\x89\xa5" },
+		};
+	for ( size_t i = 0; i < sizeof(tab) / sizeof(tab[0]); i ++ )
+		if ( (int) strlen(tab[i][0]) == len && strncmp(tab[i][0], name, len) == 0 )
+			return tab[i][1];
+	return "?";
+	}
+
+/*
+ * parses the text 's' with its escapes into glyphs; the unescaped spaces
+ * end the words when 'fill'. Returns true if the line ends with \c.
+ */
+static bool rn_text(const char *s, const char *e, bool fill) {
+	const char *sp;
+	int		len;
+
+	rn.join = false;
+	while ( s < e ) {
+		if ( *s == '\\' && s + 1 < e ) {
+			s ++;
+			switch ( *s ++ ) {
+			case 'f': { // font: B, BI, I, P, R, CR, ...
+				const char *f = s;
+				int		nf;
+				if ( *s == '[' ) {
+					for ( f = ++ s; s < e && *s != ']'; s ++ );
+					len = s - f;
+					if ( s < e ) s ++;
+					}
+				else if ( *s == '(' ) {
+					f = ++ s;
+					len = ( s + 2 <= e ) ? 2 : e - s;
+					s += len;
+					}
+				else {
+					len = ( s < e ) ? 1 : 0;
+					s += len;
+					}
+				if ( len > 1 && *f == 'C' ) { // CR, CB, CI
+					f ++;
+					len --;
+					}
+				if ( len == 1 && *f == 'P' )
+					nf = rn.prev_font;
+				else if ( len && *f == 'B' )
+					nf = RN_B;
+				else if ( len && *f == 'I' )
+					nf = RN_I;
+				else
+					nf = RN_R;
+				rn.prev_font = rn.font;
+				rn.font = nf;
+				}
+				break;
+			case '(': // \(xx
+				if ( s + 2 <= e ) {
+					sp = rn_special(s, 2);
+					rn_glyph(sp, strlen(sp), rn.font);
+					s += 2;
+					}
+				break;
+			case '[': // \[xx]
+				for ( sp = s; s < e && *s != ']'; s ++ )
+					;
+				sp = rn_special(sp, s - sp);
+				rn_glyph(sp, strlen(sp), rn.font);
+				if ( s < e ) s ++;
+				break;
+			case '*': // strings
+				if ( *s == '[' ) {
+					while ( s < e && *s != ']' ) s ++;
+					if ( s < e ) s ++;
+					}
+				else if ( *s == '(' )
+					s += ( s + 3 <= e ) ? 3 : e - s;
+				else if ( s < e )
+					s ++;
+				break;
+			case '"': // comment
+				s = e;
+				break;
+			case 'c':
+				if ( s == e ) rn.join = true;
+				break;
+			case '&': case '|': case '^': case ')':
+				break;
+			case ' ': case '~': case '0':
+				rn_glyph(" ", 1, rn.font);
+				break;
+			case 'e':
+				rn_glyph("\\", 1, rn.font);
+				break;
+			case '-':
+				rn_glyph("-", 1, rn.font);
+				break;
+			default:
+				rn_glyph(s - 1, 1, rn.font);
+				}
+			continue;
+			}
+		if ( fill && (*s == ' ' || *s == '\t') ) {
+			rn_word_end();
+			s ++;
+			continue;
+			}
+		if ( *s == '\t' ) {
+			rn_glyph(" ", 1, rn.font);
+			s ++;
+			continue;
+			}
+		for ( len = 1; s + len < e && len < 4 && (s[len] & 0xC0) == 0x80; len ++ );
+		rn_glyph(s, len, rn.font);
+		s += len;
+		}
+	return rn.join;
+	}
+
+/*
+ * splits the arguments of a request, with "quotes"; returns their count
+ */
+static int rn_args(const char *s, const char *e, const char **av, int *al, int max) {
+	int n = 0;
+
+	while ( s < e && n < max ) {
+		while ( s < e && (*s == ' ' || *s == '\t') ) s ++;
+		if ( s >= e )
+			break;
+		if ( *s == '"' ) {
+			av[n] = ++ s;
+			while ( s < e && *s != '"' ) s ++;
+			al[n] = s - av[n];
+			n ++;
+			if ( s < e ) s ++;
+			}
+		else {
+			av[n] = s;
+			while ( s < e && *s != ' ' && *s != '\t' ) {
+				if ( *s == '\\' && s + 1 < e ) s ++;
+				s ++;
+				}
+			al[n] = s - av[n];
+			n ++;
+			}
+		}
+	return n;
+	}
+
+/*
+ * text of the arguments with alternating fonts (.BR, .IR, .RI, ...)
+ */
+static void rn_alt(const char *s, const char *e, int f1, int f2) {
+	const char *av[16];
+	int		al[16], n = rn_args(s, e, av, al, 16);
+
+	for ( int i = 0; i < n; i ++ ) {
+		rn.font = ( i % 2 ) ? f2 : f1;
+		rn_text(av[i], av[i] + al[i], false);
+		}
+	rn.font = rn.prev_font = RN_R;
+	if ( rn.fill )
+		rn_word_end();
+	}
+
+/*
+ * hanging paragraph (.TP, .IP)
+ */
+static void rn_hang(int ipw) {
+	rn_space();
+	rn.font = rn.prev_font = RN_R;
+	rn.ipw = ipw;
+	rn.ti = rn.base;
+	rn.in = rn.base + ipw;
+	}
+
+/*
+ * ends the tag of a .TP or .IP; the body continues in the same line if
+ * the tag fits in the indent.
+ */
+static void rn_tag_end() {
+	rn_word_end();
+	if ( rn.llen + 1 > rn.ipw ) {
+		rn_flush(false);
+		return;
+		}
+	while ( rn.llen < rn.ipw ) {
+		rn.line[rn.llen].c[0] = ' ';
+		rn.line[rn.llen].len = 1;
+		rn.line[rn.llen ++].font = RN_R;
+		}
+	rn.ngaps = 0;
+	rn.ti = rn.base;
+	rn.pad = true;		// the body follows the padding without a gap
+	}
+
+/*
+ * the .TH header line
+ */
+static void rn_title(bool top) {
+	char	left[600], right[600], *center;
+	int		w, lw, cw;
+
+	snprintf(right, sizeof(right), "%s(%s)", rn.th[0], rn.th[1]);
+	if ( top ) {
+		strcpy(left, right);
+		center = rn.th[4];
+		}
+	else {
+		snprintf(left, sizeof(left), "%s", rn.th[3]);
+		center = rn.th[2];
+		}
+	lw = strlen(left);
+	cw = strlen(center);
+	w = rn.width - lw - (int) strlen(right);
+	if ( w < cw + 2 )
+		fprintf(rn.out, "%s  %s  %s\n", left, center, right);
+	else
+		fprintf(rn.out, "%s%*s%s%*s%s\n", left, (w - cw) / 2, "", center, w - cw - (w - cw) / 2, "", right);
+	rn.lines ++;
+	}
+
+/*
+ * table (.TS/.TE); 'p' points after the .TS line, returns the pointer
+ * after the .TE line.
+ */
+static const char *rn_table(const char *p) {
+	typedef struct { rn_glyph_t *g; int n; } cell_t;
+	cell_t	*cells = NULL;
+	char	fmt[2][MAX_TBL_COLS];
+	bool	fbold[2][MAX_TBL_COLS];
+	int		nfmt = 0, ncols = 0, nrows = 0, alloc = 0;
+	int		wid[MAX_TBL_COLS];
+	const char *e;
+
+	memset(fmt, 'l', sizeof(fmt));
+	memset(fbold, 0, sizeof(fbold));
+	for ( ; *p; p = ( *e ) ? e + 1 : e ) { // options and format
+		e = strchr(p, '\n');
+		if ( e == NULL ) e = p + strlen(p);
+		if ( memchr(p, ';', e - p) )
+			continue;
+		int c = 0, f = ( nfmt < 2 ) ? nfmt : 1;
+		for ( const char *s = p; s < e; s ++ ) {
+			if ( strchr("lcrLCR", *s) && c < MAX_TBL_COLS )
+				fmt[f][c ++] = ch_tolower(*s);
+			else if ( *s == 'B' && c )
+				fbold[f][c - 1] = true;
+			}
+		if ( c > ncols ) ncols = c;
+		nfmt ++;
+		if ( e > p && e[-1] == '.' ) {
+			p = ( *e ) ? e + 1 : e;
+			break;
+			}
+		}
+	if ( nfmt == 1 ) {
+		memcpy(fmt[1], fmt[0], MAX_TBL_COLS);
+		memcpy(fbold[1], fbold[0], sizeof(fbold[0]));
+		}
+
+	// rows
+	while ( *p && strncmp(p, ".TE", 3) != 0 ) {
+		if ( nrows * ncols + ncols > alloc ) {
+			alloc = ( alloc ) ? alloc * 2 : 64 * ncols;
+			cells = (cell_t *) realloc(cells, alloc * sizeof(cell_t));
+			panicif(cells == NULL, "out of memory");
+			}
+		for ( int c = 0; c < ncols; c ++ ) {
+			const char *s = p;
+			bool tblock = ( strncmp(p, "T{", 2) == 0 && (p[2] == '\n' || p[2] == '\0') );
+			cell_t *cl = &cells[nrows * ncols + c];
+
+			rn.wlen = 0;
+			rn.font = rn.prev_font = ( fbold[( nrows ) ? 1 : 0][c] ) ? RN_B : RN_R;
+			if ( tblock ) {
+				for ( p += 3; *p && strncmp(p, "T}", 2) != 0; p = ( *e ) ? e + 1 : e ) {
+					e = strchr(p, '\n');
+					if ( e == NULL ) e = p + strlen(p);
+					if ( rn.wlen ) rn_glyph(" ", 1, RN_R);
+					rn_text(p, e, false);
+					}
+				if ( *p ) p += 2;
+				}
+			else {
+				for ( e = s; *e && *e != '\t' && *e != '\n'; e ++ );
+				rn_text(s, e, false);
+				p = e;
+				}
+			cl->n = rn.wlen;
+			cl->g = (rn_glyph_t *) malloc(sizeof(rn_glyph_t) * (rn.wlen + 1));
+			panicif(cl->g == NULL, "out of memory");
+			memcpy(cl->g, rn.word, sizeof(rn_glyph_t) * rn.wlen);
+			rn.wlen = 0;
+			if ( *p == '\t' )
+				p ++;
+			}
+		while ( *p && *p != '\n' ) p ++;
+		if ( *p ) p ++;
+		nrows ++;
+		}
+	while ( *p && *p != '\n' ) p ++;
+	if ( *p ) p ++;
+	rn.font = rn.prev_font = RN_R;
+
+	// widths, the widest columns are reduced to fit the line
+	int total, avail = rn.width - rn.in - 1 - 3 * ncols;
+	for ( int c = 0; c < ncols; c ++ ) {
+		wid[c] = 1;
+		for ( int r = 0; r < nrows; r ++ )
+			if ( cells[r * ncols + c].n > wid[c] )
+				wid[c] = cells[r * ncols + c].n;
+		}
+	for ( ;; ) {
+		int m = 0;
+		total = 0;
+		for ( int c = 0; c < ncols; c ++ ) {
+			total += wid[c];
+			if ( wid[c] > wid[m] ) m = c;
+			}
+		if ( total <= avail || wid[m] <= 8 )
+			break;
+		wid[m] --;
+		}
+
+	// rows, the cells are wrapped at the spaces
+	const char *rule[3][3] = {
+		{ "\xe2\x94\x8c", "\xe2\x94\xac", "\xe2\x94\x90" },
+		{ "\xe2\x94\x9c", "\xe2\x94\xbc", "\xe2\x94\xa4" },
+		{ "\xe2\x94\x94", "\xe2\x94\xb4", "\xe2\x94\x98" } };
+	int		pos[MAX_TBL_COLS];
+	rn_break();
+	for ( int r = 0; r <= nrows; r ++ ) {
+		int k = ( r == 0 ) ? 0 : ( r == nrows ) ? 2 : 1;
+		fprintf(rn.out, "%*s%s", rn.in, "", rule[k][0]);
+		for ( int c = 0; c < ncols; c ++ ) {
+			for ( int i = 0; i < wid[c] + 2; i ++ )
+				fputs("\xe2\x94\x80", rn.out);
+			fputs(( c + 1 < ncols ) ? rule[k][1] : rule[k][2], rn.out);
+			}
+		putc('\n', rn.out);
+		rn.lines ++;
+		if ( r == nrows )
+			break;
+		memset(pos, 0, sizeof(pos));
+		for ( bool more = true; more; ) {
+			more = false;
+			fprintf(rn.out, "%*s\xe2\x94\x82", rn.in, "");
+			for ( int c = 0; c < ncols; c ++ ) {
+				cell_t *cl = &cells[r * ncols + c];
+				int s = pos[c], n = cl->n - s, pad;
+				if ( n > wid[c] ) { // wrap
+					n = wid[c];
+					for ( int i = wid[c]; i > 0; i -- )
+						if ( cl->g[s + i].c[0] == ' ' ) {
+							n = i;
+							break;
+							}
+					}
+				pad = wid[c] - n;
+				if ( fmt[( r ) ? 1 : 0][c] == 'r' )
+					fprintf(rn.out, " %*s", pad, "");
+				else if ( fmt[( r ) ? 1 : 0][c] == 'c' )
+					fprintf(rn.out, " %*s", pad / 2, "");
+				else
+					putc(' ', rn.out);
+				rn_put(cl->g + s, n);
+				if ( fmt[( r ) ? 1 : 0][c] == 'c' )
+					fprintf(rn.out, "%*s \xe2\x94\x82", pad - pad / 2, "");
+				else if ( fmt[( r ) ? 1 : 0][c] == 'r' )
+					fputs(" \xe2\x94\x82", rn.out);
+				else
+					fprintf(rn.out, "%*s \xe2\x94\x82", pad, "");
+				s += n;
+				while ( s < cl->n && cl->g[s].c[0] == ' ' ) s ++;
+				pos[c] = s;
+				if ( s < cl->n )
+					more = true;
+				}
+			putc('\n', rn.out);
+			rn.lines ++;
+			}
+		}
+	for ( int i = 0; i < nrows * ncols; i ++ )
+		free(cells[i].g);
+	free(cells);
+	rn.spaced = false;
+	return p;
+	}
+
+/*
+ * request line 'p' ... 'e', after the control character
+ */
+static void rn_request(const char *p, const char *e) {
+	const char *a, *av[8];
+	int		al[8], n, len;
+
+	for ( a = p; a < e && *a != ' ' && *a != '\t'; a ++ );
+	len = a - p;
+	#define RQ(s)	(len == (int) strlen(s) && strncmp(p, s, len) == 0)
+	if ( RQ("TH") ) {
+		n = rn_args(a, e, av, al, 5);
+		for ( int i = 0; i < 5; i ++ )
+			snprintf(rn.th[i], sizeof(rn.th[i]), "%.*s", ( i < n ) ? al[i] : 0, ( i < n ) ? av[i] : "");
+		rn_title(true);
+		rn.spaced = false;
+		}
+	else if ( RQ("SH") || RQ("SS") ) {
+		rn_space();
+		rn.rs_n = 0;
+		rn.base = rn.in = ( RQ("SH") ) ? 0 : 3;
+		rn.font = rn.prev_font = RN_B;
+		rn.ti = -1;
+		rn_text(a, e, true);
+		rn_word_end();
+		rn_flush(false);
+		rn.font = rn.prev_font = RN_R;
+		rn.base = rn.in = RN_IPW;
+		rn.spaced = true;	// no space after the heading
+		}
+	else if ( RQ("PP") || RQ("LP") || RQ("P") ) {
+		rn_space();
+		rn.font = rn.prev_font = RN_R;
+		rn.in = rn.base;
+		rn.ipw = RN_IPW;
+		}
+	else if ( RQ("br") )
+		rn_break();
+	else if ( RQ("TP") ) {
+		rn_hang(RN_IPW);
+		rn.tp_tag = true;
+		}
+	else if ( RQ("IP") ) {
+		n = rn_args(a, e, av, al, 2);
+		rn_hang(( n > 1 ) ? atoi(av[1]) : RN_IPW);
+		if ( n ) {
+			rn_text(av[0], av[0] + al[0], true);
+			rn_tag_end();
+			}
+		}
+	else if ( RQ("RS") ) {
+		rn_break();
+		if ( rn.rs_n < 16 )
+			rn.rs[rn.rs_n ++] = rn.base;
+		rn.base = rn.in = rn.base + ( (n = rn_args(a, e, av, al, 1)) ? atoi(av[0]) : RN_IPW );
+		}
+	else if ( RQ("RE") ) {
+		rn_break();
+		if ( rn.rs_n )
+			rn.base = rn.in = rn.rs[-- rn.rs_n];
+		}
+	else if ( RQ("in") ) {
+		rn_break();
+		n = rn_args(a, e, av, al, 1);
+		int	old = rn.in;
+		if ( n == 0 )
+			rn.in = rn.in_prev;
+		else if ( *av[0] == '+' || *av[0] == '-' )
+			rn.in += atoi(av[0]);
+		else
+			rn.in = atoi(av[0]);
+		if ( rn.in < 0 ) rn.in = 0;
+		rn.in_prev = old;
+		}
+	else if ( RQ("EX") || RQ("nf") ) {
+		rn_break();
+		rn.fill = false;
+		}
+	else if ( RQ("EE") || RQ("fi") ) {
+		rn_break();
+		rn.fill = true;
+		}
+	else if ( RQ("B") || RQ("I") ) {
+		rn.font = rn.prev_font = ( *p == 'B' ) ? RN_B : RN_I;
+		rn_text(a, e, rn.fill);
+		rn.font = rn.prev_font = RN_R;
+		if ( rn.fill ) rn_word_end();
+		}
+	else if ( len == 2 && strchr("BIR", p[0]) && strchr("BIR", p[1]) && p[0] != p[1] )
+		rn_alt(a, e, ( p[0] == 'B' ) ? RN_B : ( p[0] == 'I' ) ? RN_I : RN_R,
+				( p[1] == 'B' ) ? RN_B : ( p[1] == 'I' ) ? RN_I : RN_R);
+	else if ( RQ("FT") ) {
+		n = rn_args(a, e, av, al, 1);
+		rn.prev_font = rn.font;
+		rn.font = ( n && *av[0] == 'B' ) ? RN_B : ( n && *av[0] == 'I' ) ? RN_I : RN_R;
+		}
+	else if ( RQ("UR") || RQ("MT") ) { // the address is written at .UE/.ME
+		n = rn_args(a, e, av, al, 1);
+		rn.url = ( n ) ? av[0] : NULL;
+		rn.urlen = ( n ) ? al[0] : 0;
+		rn_word_end();
+		}
+	else if ( RQ("UE") || RQ("ME") ) {
+		rn_word_end();
+		if ( rn.url ) {
+			rn_glyph("<", 1, RN_R);
+			rn_text(rn.url, rn.url + rn.urlen, false);
+			rn_glyph(">", 1, RN_R);
+			}
+		rn_text(a, e, true);	// punctuation
+		rn_word_end();
+		rn.url = NULL;
+		}
+	else if ( RQ("SY") ) {
+		rn_space();
+		rn.font = RN_B;
+		rn_text(a, e, true);
+		rn_word_end();
+		rn.font = rn.prev_font = RN_R;
+		rn.ti = rn.in;
+		rn.in += rn.llen + 1;
+		}
+	else if ( RQ("OP") ) {
+		n = rn_args(a, e, av, al, 2);
+		rn_glyph("[", 1, RN_R);
+		if ( n ) { rn.font = RN_B; rn_text(av[0], av[0] + al[0], false); }
+		if ( n > 1 ) { rn_glyph(" ", 1, RN_R); rn.font = RN_I; rn_text(av[1], av[1] + al[1], false); }
+		rn.font = rn.prev_font = RN_R;
+		rn_glyph("]", 1, RN_R);
+		rn_word_end();
+		}
+	else if ( RQ("YS") ) {
+		rn_break();
+		rn.in = rn.base;
+		}
+	else if ( RQ("cc") ) {
+		n = rn_args(a, e, av, al, 1);
+		rn.cc = ( n ) ? *av[0] : '.';
+		}
+	#undef RQ
+	}
+
+/*
+ * renders the man page 'src' (as written by md2roff) to 'out'
+ */
+void render_man(const char *src, FILE *out) {
+	const char *p = src, *e;
+	const char *cols = getenv("COLUMNS");
+
+	memset(&rn, 0, sizeof(rn));
+	rn.out = out;
+	rn.style = opt_render;
+	rn.width = ( cols && atoi(cols) > 0 ) ? atoi(cols) : 80;
+	rn.width = ( rn.width > 22 ) ? rn.width - 2 : 20;
+	if ( rn.width > RN_MAXLN / 2 ) rn.width = RN_MAXLN / 2;
+	rn.base = rn.in = rn.in_prev = RN_IPW;
+	rn.ipw = RN_IPW;
+	rn.ti = -1;
+	rn.fill = true;
+	rn.cc = '.';
+	for ( ; *p; p = ( *e ) ? e + 1 : e ) {
+		e = strchr(p, '\n');
+		if ( e == NULL ) e = p + strlen(p);
+		if ( *p == rn.cc || *p == '\'' ) {
+			const char *r = p + 1;
+			while ( r < e && (*r == ' ' || *r == '\t') ) r ++;
+			if ( r + 2 <= e && r[0] == 'T' && r[1] == 'S' ) {
+				e = rn_table(e + ( *e != '\0' )) - 1;
+				continue;
+				}
+			rn_request(r, e);
+			continue;
+			}
+		if ( !rn.fill ) { // literal line
+			rn_break();
+			rn_text(p, e, false);
+			rn.llen = 0;
+			rn_putln(rn.in, rn.word, rn.wlen);
+			rn.wlen = 0;
+			continue;
+			}
+		if ( p == e ) { // empty line
+			rn_space();
+			continue;
+			}
+		if ( *p == ' ' )
+			rn_break();
+		rn_text(p, e, true);
+		if ( !rn.join )
+			rn_word_end();
+		if ( rn.tp_tag ) {
+			rn.tp_tag = false;
+			rn_tag_end();
+			}
+		}
+	rn_break();
+	if ( rn.th[0][0] ) {
+		rn_space();
+		rn_title(false);
+		}
+	}
+
+/*
+ *	peephole optimizer (--no-peephole to disable)
+ *
+ *	The roff code of md2roff() passes through a filter that removes what
+ *	does not change the typeset page: a font change that returns to the
+ *	state before it (\fB..\fP\fB.. is \fB....), a .br before a request that
+ *	breaks the line anyway, the paragraph macro after a heading or after
+ *	another paragraph macro, and the .RS/.RE pairs that indent nothing.
+ *	One request line is kept pending until the next line decides it.
+ */
+#define PEEP_RS_MAX		64
+#define PEEP_RUN_MAX	16
+#define PEEP_FLUSH		0x10000
+typedef struct {
+	FILE	*out;
+	char	*line, *pend, *obuf;	// incomplete line, pending request, output
+	size_t	len, alloc, plen, palloc, olen, oalloc;
+	int		pkind;					// PK_* of the pending request
+	bool	has_pend;
+	bool	rs_clean[PEEP_RS_MAX];	// .RS of the level has no argument and the
+	int		rs_depth;				// prevailing indent is not changed inside
+	bool	re_clean;				// the last .RE closed a clean level
+	} peep_t;
+
+// the kinds of the request lines
+#define PK_BREAK	0x01	// breaks the line
+#define PK_PARA		0x02	// paragraph macro
+#define PK_HEAD		0x04	// heading, with its text on the line
+#define PK_INDENT	0x08	// .TP, .HP, .IP that set the prevailing indent
+#define PK_BR		0x10
+#define PK_RS		0x20
+#define PK_RE		0x40
+#define PK_ARGS		0x80	// .RS with argument
+
+// the requests by macropackage_t: line breaks, paragraphs, headings
+static const char *peep_breaks[] = {
+	" br sp P H ", " br sp PP LP P TP IP HP SH SS RS RE ", " br sp Pp Sh Ss ", " br sp ", " br sp PP LP IP QP SH NH " };
+static const char *peep_paras[] = { NULL, " PP LP P ", " Pp ", NULL, NULL };
+static const char *peep_heads[] = { NULL, " SH SS ", " Sh Ss ", NULL, NULL };
+
+static void peep_grow(char **buf, size_t *alloc, size_t need) {
+	if ( need > *alloc ) {
+		*alloc = need + 256;
+		panicif((*buf = (char *) realloc(*buf, *alloc)) == NULL, "out of memory");
+		}
+	}
+
+// returns true if the request 'name' of 'n' bytes is one of the 'list'
+static bool peep_in(const char *list, const char *name, int n) {
+	const char *p;
+
+	if ( list == NULL || n == 0 || n > 2 )
+		return false;
+	for ( p = list + 1; *p; p ++ ) {
+		if ( p[-1] == ' ' && p[0] == name[0] && (n == 1 || p[1] == name[1]) && p[n] == ' ' )
+			return true;
+		}
+	return false;
+	}
+
+// returns the kind of the request line 's' of 'n' bytes, PK_*
+static int peep_kind(const char *s, size_t n) {
+	const char	*p = s + 1, *e = s + n, *name = p;
+	int			len, nargs = 0, k = 0;
+
+	while ( p < e && *p != ' ' && *p != '\t' )
+		p ++;
+	len = p - name;
+	while ( p < e ) {
+		while ( p < e && (*p == ' ' || *p == '\t') )
+			p ++;
+		if ( p == e )
+			break;
+		nargs ++;
+		if ( *p == '"' ) {
+			for ( p ++; p < e && !(*p == '"' && (p + 1 == e || p[1] != '"')); p ++ )
+				p += ( *p == '"' );
+			p ++;
+			}
+		else while ( p < e && *p != ' ' && *p != '\t' )
+			p ++;
+		}
+
+	if ( peep_in(peep_breaks[mpack], name, len) )
+		k |= PK_BREAK;
+	if ( peep_in(peep_paras[mpack], name, len) )
+		k |= PK_PARA;
+	if ( nargs && peep_in(peep_heads[mpack], name, len) )
+		k |= PK_HEAD;
+	if ( len == 2 && name[0] == 'b' && name[1] == 'r' )
+		k |= PK_BR;
+	if ( mpack == mp_man && len == 2 ) {
+		if ( name[0] == 'R' && name[1] == 'S' )
+			k |= PK_RS | (( nargs ) ? PK_ARGS : 0);
+		else if ( name[0] == 'R' && name[1] == 'E' )
+			k |= PK_RE;
+		else if ( ((name[0] == 'T' || name[0] == 'H') && name[1] == 'P' && nargs >= 1)
+				|| (name[0] == 'I' && name[1] == 'P' && nargs >= 2) )
+			k |= PK_INDENT;
+		}
+	return k;
+	}
+
+// appends the line 's' to the output
+static void peep_put(peep_t *pp, const char *s, size_t n) {
+	peep_grow(&pp->obuf, &pp->oalloc, pp->olen + n + 1);
+	memcpy(pp->obuf + pp->olen, s, n);
+	pp->olen += n;
+	pp->obuf[pp->olen ++] = '\n';
+	}
+
+static void peep_flush(peep_t *pp) {
+	if ( pp->has_pend ) {
+		peep_put(pp, pp->pend, pp->plen);
+		pp->has_pend = false;
+		}
+	}
+
+static void peep_hold(peep_t *pp, const char *s, size_t n, int kind) {
+	peep_grow(&pp->pend, &pp->palloc, n);
+	memcpy(pp->pend, s, n);
+	pp->plen = n;
+	pp->pkind = kind;
+	pp->has_pend = true;
+	}
+
+/*
+ * the font of the escape \f at 's' packed in a number and its length in 'n';
+ * 0 for \fP and \f[], 1 if it is not a font escape.
+ */
+static uint64_t peep_font(const char *s, const char *e, int *n) {
+	const char	*p = s + 2, *f;
+	uint64_t	v = 0;
+	int			len;
+
+	if ( p >= e )
+		return 1;
+	if ( *p == '(' ) {
+		if ( e - p < 3 )
+			return 1;
+		f = p + 1, len = 2, *n = 5;
+		}
+	else if ( *p == '[' ) {
+		const char *q = (const char *) memchr(p, ']', e - p);
+		if ( q == NULL || q - p > 9 )
+			return 1;
+		f = p + 1, len = q - f, *n = q + 1 - s;
+		}
+	else
+		f = p, len = 1, *n = 3;
+	if ( len == 0 || (len == 1 && *f == 'P') )
+		return 0;
+	for ( int i = 0; i < len; i ++ )
+		v = (v << 8) | (unsigned char) f[i];
+	return v | (1ULL << 63);
+	}
+
+// returns true if the next escape after 'p' that reads or sets the font sets it
+static bool peep_explicit(const char *p, const char *e) {
+	int		k;
+
+	for ( ; p + 1 < e; p ++ ) {
+		if ( *p == '\\' ) {
+			if ( p[1] == 'f' ) {
+				uint64_t f = peep_font(p, e, &k);
+				if ( f != 1 )
+					return ( f != 0 );
+				}
+			if ( p[1] == '*' || p[1] == '$' )
+				return false;
+			p ++;
+			}
+		}
+	return false;
+	}
+
+/*
+ * writes the text line 's' without the font changes that return to the
+ * state before them. The state is the current and the previous font (\fP
+ * swaps them); it is not known at the start of the line, nor after a string
+ * or an argument that can change it, those get new numbers. The previous
+ * font does not matter if the next font escape of the line is not \fP.
+ */
+static void peep_text(peep_t *pp, const char *s, size_t n) {
+	struct { size_t at; uint64_t cur, prev; } run[PEEP_RUN_MAX];
+	const char	*e = s + n, *p;
+	uint64_t	cur = 2, prev = 3, unknown = 4, f;
+	int			nrun = 0, len;
+	size_t		o;
+
+	if ( (p = (const char *) memchr(s, '\\', n)) == NULL ) {
+		peep_put(pp, s, n);
+		return;
+		}
+	peep_grow(&pp->obuf, &pp->oalloc, pp->olen + n + 1);
+	o = pp->olen;
+	memcpy(pp->obuf + o, s, p - s);
+	o += p - s;
+	while ( p < e ) {
+		if ( *p != '\\' || p + 1 == e ) {
+			const char *q = (const char *) memchr(p + 1, '\\', e - p - 1);
+			if ( q == NULL )
+				q = e;
+			memcpy(pp->obuf + o, p, q - p);
+			o += q - p;
+			p = q;
+			nrun = 0;
+			continue;
+			}
+		if ( p[1] == '*' || p[1] == '$' ) {
+			cur = unknown ++;
+			prev = unknown ++;
+			}
+		if ( p[1] != 'f' || (f = peep_font(p, e, &len)) == 1 ) {
+			pp->obuf[o ++] = *p ++;
+			pp->obuf[o ++] = *p ++;
+			nrun = 0;
+			continue;
+			}
+
+		if ( nrun == PEEP_RUN_MAX )
+			nrun = 0;
+		run[nrun].at = o;
+		run[nrun].cur = cur;
+		run[nrun].prev = prev;
+		nrun ++;
+		memcpy(pp->obuf + o, p, len);
+		o += len;
+		p += len;
+		if ( f == 0 ) {
+			uint64_t t = cur;
+			cur = prev;
+			prev = t;
+			}
+		else {
+			prev = cur;
+			cur = f;
+			}
+
+		// the earliest escape of the run from where the state is the same
+		for ( int i = 0; i < nrun; i ++ ) {
+			if ( run[i].cur == cur && (run[i].prev == prev || peep_explicit(p, e)) ) {
+				o = run[i].at;
+				prev = run[i].prev;
+				nrun = i;
+				break;
+				}
+			}
+		}
+	pp->obuf[o ++] = '\n';
+	pp->olen = o;
+	}
+
+// the line 's' of 'n' bytes without the newline
+static void peep_line(peep_t *pp, const char *s, size_t n) {
+	int		k, q;
+
+	if ( n == 0 || *s != '.' ) {
+		peep_flush(pp);
+		peep_text(pp, s, n);
+		return;
+		}
+	k = peep_kind(s, n);
+	if ( pp->has_pend ) {
+		q = pp->pkind;
+		if ( (q & PK_BR) && (k & PK_BREAK) )
+			pp->has_pend = false;
+		else if ( (k & PK_PARA) && (q & (PK_PARA | PK_HEAD)) )
+			return;
+		else if ( (q & PK_PARA) && (k & PK_INDENT) )
+			pp->has_pend = false;
+		else if ( (q & PK_RS) && (k & PK_RE) ) {
+			if ( pp->rs_depth > 0 )
+				pp->rs_depth --;
+			peep_hold(pp, ".br", 3, PK_BR | PK_BREAK);
+			return;
+			}
+		else if ( (q & PK_RE) && pp->re_clean && (k & (PK_RS | PK_ARGS)) == PK_RS ) {
+			if ( pp->rs_depth < PEEP_RS_MAX )
+				pp->rs_clean[pp->rs_depth ++] = true;
+			peep_hold(pp, ".br", 3, PK_BR | PK_BREAK);
+			return;
+			}
+		peep_flush(pp);
+		}
+
+	// the levels of .RS
+	if ( k & PK_RS ) {
+		if ( pp->rs_depth < PEEP_RS_MAX )
+			pp->rs_clean[pp->rs_depth ++] = !(k & PK_ARGS);
+		}
+	else if ( k & PK_RE )
+		pp->re_clean = ( pp->rs_depth > 0 && pp->rs_clean[-- pp->rs_depth] );
+	else if ( (k & PK_INDENT) && pp->rs_depth > 0 )
+		pp->rs_clean[pp->rs_depth - 1] = false;
+
+	if ( k & (PK_BR | PK_RS | PK_RE | PK_PARA | PK_HEAD) )
+		peep_hold(pp, s, n, k);
+	else
+		peep_put(pp, s, n);
+	}
+
+static ssize_t peep_fwrite(void *cookie, const char *s, size_t n) {
+	peep_t		*pp = (peep_t *) cookie;
+	const char	*e = s + n, *nl;
+
+	while ( (nl = (const char *) memchr(s, '\n', e - s)) != NULL ) {
+		if ( pp->len ) {
+			peep_grow(&pp->line, &pp->alloc, pp->len + (nl - s));
+			memcpy(pp->line + pp->len, s, nl - s);
+			peep_line(pp, pp->line, pp->len + (nl - s));
+			pp->len = 0;
+			}
+		else
+			peep_line(pp, s, nl - s);
+		s = nl + 1;
+		}
+	if ( s < e ) { // the start of the next line
+		peep_grow(&pp->line, &pp->alloc, pp->len + (e - s));
+		memcpy(pp->line + pp->len, s, e - s);
+		pp->len += e - s;
+		}
+	if ( pp->olen >= PEEP_FLUSH ) {
+		fwrite(pp->obuf, 1, pp->olen, pp->out);
+		pp->olen = 0;
+		}
+	return n;
+	}
+
+static int peep_fclose(void *cookie) {
+	peep_t	*pp = (peep_t *) cookie;
+
+	peep_flush(pp);
+	if ( pp->olen )
+		fwrite(pp->obuf, 1, pp->olen, pp->out);
+	if ( pp->len ) // without the final newline
+		fwrite(pp->line, 1, pp->len, pp->out);
+	free(pp->line);
+	free(pp->pend);
+	free(pp->obuf);
+	return 0;
+	}
+
+/*
+ * returns a stream that writes to 'out' through the optimizer 'pp'
+ */
+FILE *peep_open(peep_t *pp, FILE *out) {
+	cookie_io_functions_t io = { NULL, peep_fwrite, NULL, peep_fclose };
+	FILE	*fp;
+
+	memset(pp, 0, sizeof(*pp));
+	pp->out = out;
+	panicif((fp = fopencookie(pp, "w", io)) == NULL, "fopencookie failed");
+	setvbuf(fp, NULL, _IOFBF, 64 * 1024);
+	__fsetlocking(fp, FSETLOCKING_BYCALLER);	// the stream of the converter thread only
+	return fp;
+	}
+
+/*
+ * converts the document to fout; with --render the man page is rendered
+ * for the terminal.
+ */
+void convert_doc(const char *docname, const char *source) {
+	FILE	*fp = ( fout ) ? fout : stdout, *ms = NULL;
+	char	*buf;
+	size_t	size;
+	peep_t	pp;
+
+	fout = fp;
+	if ( opt_render >= 0 )
+		panicif((fout = ms = open_memstream(&buf, &size)) == NULL, "open_memstream failed");
+	if ( opt_peephole )
+		fout = peep_open(&pp, fout);
+	md2roff(docname, source);
+	if ( opt_peephole )
+		fclose(fout);
+	fout = fp;
+	if ( ms ) {
+		fclose(ms);
+		render_man(buf, fout);
+		free(buf);
+		}
+	}
+
+/*
+ *	check mode (--check)
+ *
+ *	A scan of the document that writes nothing: the blocks are taken from
+ *	the line index as md2roff() takes them, and only the characters that
+ *	can open an inline element are visited, with the helpers of md2roff()
+ *	(em_resolve(), em_link(), the inline code and the footnote rules).
+ *	The problems are reported with lint_msg(). There is no check of the
+ *	list nesting, since md2roff() does not nest lists (an item ends the
+ *	previous one). Returns the number of the problems.
+ */
+
+// skips the line of a command of the SYNOPSIS and its '\' continuations
+static const char *chk_cmd_line(const char *p) {
+	while ( *p && *p != '\n' ) {
+		if ( *p == '\\' ) {
+			while ( *p && *p != '\n' ) p ++;
+			if ( *p == '\n' ) p ++;
+			}
+		else
+			p ++;
+		}
+	return p;
+	}
+
+// skips a .SY/.Nm block of the SYNOPSIS, up to its empty line
+static const char *chk_syn_block(const char *p) {
+	while ( ch_space(*p) ) p ++;
+	p = eoln(p);
+	if ( *p ) p ++;
+	while ( *p ) {
+		const char *s = p;
+		while ( ch_blank(*s) ) s ++;
+		if ( *s == '\n' )
+			return s;
+		p = eoln(s);
+		if ( *p ) p ++;
+		}
+	return p;
+	}
+
+int md2roff_check(const char *docname, const char *source) {
+	const char *p = source, *pnext;
+	char	secname[256], align[MAX_TBL_COLS + 1], path[4096], buf[MAX_STR + 1];
+	bool	bline = true, bcode = false, synopsis = false;
+	bool	has_name = false, has_synopsis = false, in_list = false;
+	int		fence_line = 0, n;
+	int		syn_style = ( mpack == mp_man ) ? 2 : 3;	// -p of the .SY or .Nm blocks
+
+	lint_count = 0;
+	secname[0] = '\0';
+	ln_source = source;
+	ln_build(source);
+	refs_collect(source);
+	em_text.base = em_text.end = NULL;
+
+	// the header of the document
+	if ( mpack == mp_man || mpack == mp_mdoc || mpack == mp_ms ) {
+		while ( ch_space(*p) ) p ++;
+		if ( p[0] == '#' && ch_blank(p[1]) ) {
+			if ( mpack != mp_ms )
+				get_man_header(p + 2, buf, buf, buf);
+			p = eoln(p);
+			if ( *p ) p ++;
+			if ( mpack != mp_ms )
+				while ( ch_space(*p) ) p ++;
+			}
+		else if ( mpack != mp_ms )
+			lint_msg(docname, src_line(p), 1, "missing '# name section date' header");
+		}
+	if ( !sec_selected("") )
+		p = sec_skip(p);
+
+	while ( *p ) {
+		if ( bcode ) { // p is at the beginning of a line
+			const lnent_t *L = ln_at(p);
+			if ( L->cls == LN_FENCE && L->bq == 0 )
+				bcode = false;
+			p = eoln(p);
+			if ( *p ) p ++;
+			continue;
+			}
+		if ( *p == '\\' ) {
+			p += ( p[1] ) ? 2 : 1;
+			bline = false;
+			continue;
+			}
+
+		// blocks
+		if ( bline ) {
+			const lnent_t *L = ln_at(p);
+
+			bline = false;
+			p += L->bq;
+			if ( (*p == '<' || *p == ' ') && (pnext = inc_directive(docname, p, path, sizeof(path))) != NULL ) {
+				if ( in_list || L->bq )
+					lint_msg(docname, src_line(p), 1, "include in a list or a blockquote");
+				p = pnext;	// the fragment is checked on its own
+				bline = true;
+				continue;
+				}
+			else if ( *p == '\n' ) {
+				in_list = false;
+				bline = true;
+				p ++;
+				continue;
+				}
+			else if ( L->cls == LN_HEADER ) {
+				pnext = ln_end(ln_find(p));
+				if ( *pnext ) {
+					if ( pnext[-1] == '#' ) { // box
+						p = pnext + 1;
+						continue;
+						}
+					p += L->level;
+					while ( *p == ' ' || *p == '\t' ) p ++;
+					if ( L->level == 2 ) {
+						snprintf(secname, sizeof(secname), "%.*s", (int) (pnext - p), p);
+						synopsis = ( strcmp(secname, "SYNOPSIS") == 0 );
+						has_name |= ( strcmp(secname, "NAME") == 0 );
+						has_synopsis |= synopsis;
+						if ( !sec_selected(secname) ) {
+							p = sec_skip(pnext);
+							bline = true;
+							continue;
 							}
-						*d ++ = *p ++;
 						}
+					else if ( L->level >= 4 && mpack != mp_ms ) { // the text of .TP, or of the header
+						if ( mpack == mp_man )
+							p = chk_cmd_line(p);
+						continue;
+						}
+					p = pnext + 1;
+					bline = true;
+					continue;
 					}
-				d = flushln(d, dest);
 				}
-			else if ( (*(p+1) == ' ' || *(p+1) == '\t')
-				&& (*p == '*' || *p == '+' || *p == '-') ) { // unordered list
-				d = flushln(d, dest);
-				if ( stk_list_p )
-					roff(li_end);
-				else
-					roff(ul_open);
-				roff(li_open);
+			else if ( (n = tbl_detect(p, align)) != 0 ) {
+				p = eoln(eoln(p) + 1);
+				if ( *p ) p ++;
+				while ( *p && tbl_row_at(p) ) {
+					p = eoln(p);
+					if ( *p ) p ++;
+					}
+				bline = true;
+				continue;
+				}
+			else if ( (*p == '[' || *p == ' ') && (pnext = ref_def(p)) != NULL ) {
+				p = pnext;
+				bline = true;
+				continue;
+				}
+			else if ( synopsis && (mpack == mp_man || mpack == mp_mdoc)
+					&& (opt_name_style == syn_style || strncmp(p, KEY_GNUSYN, strlen(KEY_GNUSYN)) == 0) ) { // .SY or .Nm
+				if ( opt_name_style != syn_style )
+					p += strlen(KEY_GNUSYN);
+				p = chk_syn_block(p);
+				continue;
+				}
+			else if ( mpack == mp_man && synopsis
+					&& (opt_name_style == 1 || strncmp(p, KEY_NDCCMD, strlen(KEY_NDCCMD)) == 0) ) {
+				if ( opt_name_style != 1 )
+					p += strlen(KEY_NDCCMD);
+				p = chk_cmd_line(p);
+				}
+			else if ( L->cls == LN_ULIST ) {
+				in_list = true;
+				p ++;
+				continue;
+				}
+			else if ( L->cls == LN_OLIST ) {
+				in_list = true;
+				while ( ch_digit(*p) ) p ++;
+				p ++;
+				while ( *p == ' ' || *p == '\t' ) p ++;
+				continue;
+				}
+			else if ( L->cls == LN_FENCE ) {
+				bcode = true;
+				fence_line = src_line(p);
+				p = eoln(p);
+				if ( *p ) p ++;
+				continue;
+				}
+			}
+
+		// inline
+		switch ( *p ) {
+		case '\n': {
+			int ln = ln_find(p + 1);
+			if ( ln_idx.tab[ln].cls == LN_RULE && ln_idx.tab[ln].bq == 0 ) {
+				p = ln_end(ln);
+				if ( *p ) p ++;
+				continue;
+				}
+			bline = true;
+			p ++;
+			}
+			continue;
+		case '*': case '_':
+			if ( p < em_text.base || p >= em_text.end ) {
+				em_resolve(&em_text, p, em_block(p), ( p > source ) ? p[-1] : '\n', true);
+				em_lint(docname, &em_text);
+				}
+			em_put(&em_text, p, &n, true);
+			p += n;
+			continue;
+		case '`':
+			if ( (pnext = memchr(p + 1, '`', ln_para_end(p) - (p + 1))) == NULL ) {
+				int line = src_line(p);
+				lint_msg(docname, line, p - ln_pos + 1, "inline code (`) is not closed");
 				p ++;
+				}
+			else
+				p = pnext + 1;
+			continue;
+		case '!':
+			if ( p[1] != '[' )
+				break;
+			p ++;
+			if ( (pnext = em_link(p, ln_para_end(p))) != NULL ) { // image
+				p = pnext;
+				continue;
+				}
+			break;
+		case '[':
+			if ( p[1] == '^' ) { // footnote reference
+				for ( pnext = p + 2; *pnext && *pnext != ']' && *pnext != '\n'; pnext ++ );
+				if ( *pnext == ']' && idx_find(&fn_index, p + 2, pnext - (p + 2)) != NULL )
+					p = pnext;
+				}
+			else if ( (pnext = em_link(p, ln_para_end(p))) != NULL ) {
+				p = pnext;
+				continue;
+				}
+			break;
+			}
+		p ++;
+		p += strcspn(p, "\\\n*_`![");
+		}
+
+	if ( bcode )
+		lint_msg(docname, fence_line, 1, "code block (```) is not closed");
+	if ( mpack == mp_man && !has_name )
+		lint_msg(docname, 1, 1, "missing NAME section");
+	if ( mpack == mp_man && !has_synopsis )
+		lint_msg(docname, 1, 1, "missing SYNOPSIS section");
+	idx_free(&fn_index);
+	idx_free(&link_index);
+	return lint_count;
+	}
+
+/*
+ * checks the 'count' files with 'jobs' processes; the processes take the
+ * next file from a pipe. Returns the number of failed processes/files.
+ */
+int check_files(const char **list, int count, int jobs) {
+	int		fd[2], idx, status, failed = 0;
+	pid_t	pid;
+
+	if ( jobs > count )
+		jobs = count;
+	if ( jobs <= 1 ) {
+		for ( int i = 0; i < count; i ++ ) {
+			char *buf = loadfile(list[i]);
+			failed += ( md2roff_check(list[i], buf) ) ? 1 : 0;
+			free(buf);
+			}
+		return failed;
+		}
+
+	panicif(pipe(fd) == -1, "pipe failed");
+	for ( int j = 0; j < jobs; j ++ ) {
+		panicif((pid = fork()) == -1, "fork failed");
+		if ( pid == 0 ) {
+			close(fd[1]);
+			while ( read(fd[0], &idx, sizeof(idx)) == sizeof(idx) ) { // atomic, < PIPE_BUF
+				char *buf = loadfile(list[idx]);
+				failed += ( md2roff_check(list[idx], buf) ) ? 1 : 0;
+				free(buf);
+				}
+			_exit(( failed ) ? EXIT_FAILURE : EXIT_SUCCESS);
+			}
+		}
+	close(fd[0]);
+	for ( idx = 0; idx < count; idx ++ )
+		panicif(write(fd[1], &idx, sizeof(idx)) != sizeof(idx), "write failed");
+	close(fd[1]);
+	while ( wait(&status) > 0 )
+		if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+			failed ++;
+	return failed;
+	}
+
+/*
+ * --- main() ---
+ */
+#define APPVER	"1.8"
+
+static char *usage ="\
+usage: md2roff [options] [file1 .. [fileN]]\n\
+\t-n, --man\n\t\tuse man package (default)\n\
+\t-d, --mdoc\n\t\tuse mdoc package (BSD man-pages)\n\
+\t-m, --mm\n\t\tuse mm package\n\
+\t-s, --ms\n\t\tuse ms package\n\
+\t-o, --mom\n\t\tuse mom package\n\
+\t-z, --man-official\n\t\ttry to be as official as man-pages(7)\n\
+\t-q, --non-std-q\n\t\tnon-standard emphasis/strong quotation\n\
+\t-pX,--synopsis-style=X\n\t\tFor man-pages, styles of SYNOPSIS section. where X, 0 = normal, 1 = md2roff highlight, 2 = .SY/.OP style, 3 = .Nm style\n\
+\t--check-xrefs[=MANPATH]\n\t\treport the references to man pages that do not exist in MANPATH\n\
+\t--whatis FILE\n\t\twrite the whatis entries of the man pages to FILE\n\
+\t-O DIR\n\t\twrite each page to DIR, in the path of its input, as name.section\n\
+\t--if-changed\n\t\twith -O, --split-pages and --whatis, do not replace the files that\n\t\thave the same content\n\
+\t--files-from=FILE, @FILE\n\t\tread the input files from FILE, one per line or '\\0' separated\n\
+\t--check\n\t\tonly check the files and report the problems as file:line:col\n\
+\t-jN, --jobs=N\n\t\tnumber of processes for --check and --split-pages (default: number of\n\t\tcores)\n\
+\t--only-sections=LIST, --exclude-sections=LIST\n\t\tconvert only the sections, or all but the sections, of the comma\n\t\tseparated LIST\n\
+\t--render=utf8, --render=overstrike\n\t\twrite the man page formatted for the terminal, without groff; bold\n\t\tand italic with escape sequences or with overstrike\n\
+\t--expand-tabs[=N]\n\t\texpand the tabs of the input to spaces, every N columns (default 8)\n\
+\t--highlight\n\t\thighlight the code blocks of sh, c, make, ini and diff, by the info\n\t\tstring of the fence\n\
+\t--no-peephole\n\t\twrite the roff code without removing the redundant requests and\n\t\tfont changes\n\
+\t--split-pages[=gz]\n\t\twrite each '# name section' page of the input to its name.section\n\t\tfile of -O (default: .), or compressed to name.section.gz\n\
+\t--from-tar[=FILE]\n\t\tconvert the .md and .markdown members of the tar archive FILE\n\t\t(default: stdin)\n\
+\t--to-tar[=gz]\n\t\twrite the pages to stdout as a tar archive, in the paths of -O, or\n\t\tcompressed to name.section.gz\n\
+\t--parse-cache=FILE\n\t\tsave the parsing of the input file to FILE and convert it from FILE\n\t\tthe next times; without input file, convert the document of FILE\n\
+\t--pipeline\n\t\tread, convert and write each file in parallel threads\n\
+\t--sync-io\n\t\tdo not use io_uring to read and write many files\n\
+\t-h, --help\n\t\tprint this screen\n\
+\t-v, --version\n\t\tprint version information\n\
+";
+
+static char *version ="\
+md2roff, version "APPVER"\n\
+Copyright (C) 2017-2022 Nicholas Christopoulos <mailto:nereus@freemail.gr>.\n\
+License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\n\
+This is free software: you are free to change and redistribute it.\n\
+There is NO WARRANTY, to the extent permitted by law.\n\
+";
+
+/*
+ * the list of the input files
+ */
+static const char **files;
+static int fc, falloc;
+
+static void add_file(const char *fname) {
+	if ( fc == falloc ) {
+		falloc = ( falloc ) ? falloc * 2 : 64;
+		files = (const char **) realloc(files, sizeof(char *) * falloc);
+		panicif(files == NULL, "out of memory");
+		}
+	files[fc ++] = fname;
+	}
+
+/*
+ * adds the files of the manifest 'fname' ("-" = stdin); the names are
+ * separated by '\0' if there is any, otherwise by new-lines.
+ */
+static void add_manifest(const char *fname) {
+	FILE	*fp = ( strcmp(fname, "-") == 0 ) ? stdin : fopen(fname, "r");
+	size_t	len = 0, alloc = 4096, n;
+	char	*buf, *p, *e, sep;
+
+	panicif(fp == NULL, "Unable to open '%s'", fname);
+	buf = (char *) malloc(alloc);
+	while ( (n = fread(buf + len, 1, alloc - len - 1, fp)) > 0 ) {
+		len += n;
+		if ( alloc - len - 1 == 0 ) {
+			alloc *= 2;
+			buf = (char *) realloc(buf, alloc);
+			panicif(buf == NULL, "out of memory");
+			}
+		}
+	panicif(ferror(fp), "Unable to read '%s'", fname);
+	if ( fp != stdin )
+		fclose(fp);
+	buf[len] = '\0';
+	sep = ( memchr(buf, '\0', len) ) ? '\0' : '\n';
+	for ( p = buf; p < buf + len; p = e + 1 ) {
+		if ( (e = memchr(p, sep, buf + len - p)) == NULL )
+			e = buf + len;
+		*e = '\0';
+		if ( e > p && e[-1] == '\r' )
+			e[-1] = '\0';
+		if ( *p )
+			add_file(p);	// the buffer is never freed
+		}
+	}
+
+/*
+ * stores in 'path' the output file of the document under the directory
+ * 'dir', which is created; it is the directory of the input and
+ * 'name.section' from the header of man pages, or the base name with the
+ * package extension. With 'dir' NULL the path is relative (--to-tar).
+ */
+static void out_path(const char *docname, const char *source, const char *dir, char *path, size_t size) {
+	const char *p, *e, *base;
+	char	name[256], sec[256];
+	int		n;
+
+	n = snprintf(path, size, "%s", ( dir ) ? dir : "");
+	base = strrchr(docname, '/');
+	base = ( base ) ? base + 1 : docname;
+	for ( p = docname; p < base; p = e + 1 ) { // mirror the directories
+		e = strchr(p, '/');
+		if ( e - p == 0 || (e - p == 1 && *p == '.') || (e - p == 2 && p[0] == '.' && p[1] == '.') )
+			continue;
+		n += snprintf(path + n, size - n, "/%.*s", (int) (e - p), p);
+		}
+	if ( dir )
+		mkdirs(path);
+
+	// base name without extension
+	e = strrchr(base, '.');
+	if ( e == NULL || e == base )
+		e = base + strlen(base);
+	snprintf(name, sizeof(name), "%.*s", (int) (e - base), base);
+	switch ( mpack ) {
+	case mp_man:
+	case mp_mdoc:
+		strcpy(sec, "7");
+		for ( p = source; ch_space(*p); p ++ );
+		if ( p[0] == '#' && ch_blank(p[1]) ) {
+			for ( p ++; ch_blank(*p); p ++ );
+			for ( e = p; *e && !ch_space(*e); e ++ );
+			if ( e > p && e - p < (int) sizeof(name) )
+				snprintf(name, sizeof(name), "%.*s", (int) (e - p), p);
+			for ( p = e; ch_blank(*p); p ++ );
+			for ( e = p; *e && !ch_space(*e); e ++ );
+			if ( e > p && e - p < (int) sizeof(sec) )
+				snprintf(sec, sizeof(sec), "%.*s", (int) (e - p), p);
+			}
+		break;
+	case mp_ms:  strcpy(sec, "ms"); break;
+	case mp_mm:  strcpy(sec, "mm"); break;
+	case mp_mom: strcpy(sec, "mom"); break;
+		}
+	for ( char *c = name; *c; c ++ ) // the header must not leave the directory
+		if ( *c == '/' ) *c = '_';
+	for ( char *c = sec; *c; c ++ )
+		if ( *c == '/' ) *c = '_';
+	snprintf(path + n, size - n, "/%s.%s", name, sec);
+	if ( dir == NULL )
+		memmove(path, path + 1, strlen(path));
+	}
+
+/*
+ * when it is set, convert_buf() converts to memory and gives the output
+ * for 'path' (NULL = stdout) to it; set by convert_uring()
+ */
+static void (*out_submit)(const char *path, char *buf, size_t size);
+static void convert_buf(const char *docname, char *buf, time_t mtime);
+
+#ifdef HAVE_IO_URING
+/*
+ *	io_uring batch I/O (Linux)
+ *
+ *	The input files are read ahead, up to URING_READS at once, while the
+ *	previous file is converted by convert_buf(); the output of each file is
+ *	kept in memory and written asynchronously (to its -O file, or in order
+ *	to stdout). Only the reads and the writes are done here. The read
+ *	buffers are recycled. If io_uring is not available, the caller falls
+ *	back to convert().
+ */
+#define URING_ENTRIES	256
+#define URING_READS		64
+#define URING_WRITES	128
+
+typedef struct {
+	int			fd;
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	unsigned	to_submit, inflight;
+	} uring_t;
+
+typedef struct {				// read of an input file
+	const char	*fname;
+	int			fd;
+	char		*buf;
+	size_t		size, alloc, done;
+	time_t		mtime;
+	bool		ready;
+	} uring_rd_t;
+
+typedef struct {				// write of an output
+	int			fd;
+	char		*buf, path[4096], tmpname[4096 + 8];
+	size_t		size, done;
+	bool		busy;
+	} uring_wr_t;
+
+static uring_t		ring;
+static uring_rd_t	urd[URING_READS];
+static uring_wr_t	uwr[URING_WRITES];
+static char			*upool[URING_READS];	// free read buffers
+static size_t		upool_size[URING_READS];
+static int			upool_count;
+static int			uwr_stdout_q[URING_WRITES], uwr_q_head, uwr_q_count; // stdout, in order
+static bool			uwr_stdout_busy;
+
+#define URING_RD	0x10000		// user_data tags
+#define URING_WR	0x20000
+
+static int uring_init(uring_t *r, unsigned entries) {
+	struct io_uring_params p;
+	size_t	sq_size, cq_size;
+	char	*sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	if ( (r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0 )
+		return -1;
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( cq_size > sq_size ) sq_size = cq_size;
+		cq_size = sq_size;
+		}
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if ( sq == MAP_FAILED ) {
+		close(r->fd);
+		return -1;
+		}
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+		cq = sq;
+	else if ( (cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED ) {
+		close(r->fd);
+		return -1;
+		}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if ( r->sqes == MAP_FAILED ) {
+		close(r->fd);
+		return -1;
+		}
+	r->sq_head  = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head  = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+	}
+
+/*
+ * queues a read or write request
+ */
+static void uring_prep(uring_t *r, int op, int fd, void *buf, unsigned len, uint64_t off, uint64_t tag) {
+	unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = tag;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit ++;
+	r->inflight ++;
+	}
+
+/*
+ * submits the queued requests and waits for 'wait' completions
+ */
+static int uring_enter(uring_t *r, unsigned wait) {
+	int n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait,
+				( wait ) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		} while ( n < 0 && errno == EINTR );
+	if ( n >= 0 )
+		r->to_submit -= n;
+	return n;
+	}
+
+static void uring_write_next(int slot);
+
+/*
+ * handles the completion of a write; if it is complete the file is
+ * renamed (-O) or the next stdout write is started.
+ */
+static void uring_write_done(int slot, int res) {
+	uring_wr_t *w = &uwr[slot];
+
+	panicif(res < 0, "write failed (%s)", strerror(-res));
+	w->done += res;
+	if ( w->done < w->size && res > 0 ) { // short write
+		uring_write_next(slot);
+		return;
+		}
+	free(w->buf);
+	w->buf = NULL;
+	if ( w->fd == STDOUT_FILENO ) {
+		uwr_stdout_busy = false;
+		if ( uwr_q_count ) {
+			int next = uwr_stdout_q[uwr_q_head];
+			uwr_q_head = (uwr_q_head + 1) % URING_WRITES;
+			uwr_q_count --;
+			uwr_stdout_busy = true;
+			uring_write_next(next);
+			}
+		}
+	else {
+		panicif(close(w->fd) != 0 || rename(w->tmpname, w->path) != 0, "Unable to write '%s'", w->path);
+		}
+	w->busy = false;
+	}
+
+static void uring_write_next(int slot) {
+	uring_wr_t *w = &uwr[slot];
+	uint64_t off = ( w->fd == STDOUT_FILENO ) ? (uint64_t) -1 : w->done;
+	uring_prep(&ring, IORING_OP_WRITE, w->fd, w->buf + w->done, w->size - w->done, off, URING_WR | slot);
+	}
+
+/*
+ * handles the completion of a read
+ */
+static void uring_read_done(int slot, int res) {
+	uring_rd_t *rd = &urd[slot];
+
+	panicif(res < 0, "Unable to read '%s' (%s)", rd->fname, strerror(-res));
+	rd->done += res;
+	if ( res > 0 && rd->done < rd->size ) { // short read
+		uring_prep(&ring, IORING_OP_READ, rd->fd, rd->buf + rd->done, rd->size - rd->done, rd->done, URING_RD | slot);
+		return;
+		}
+	close(rd->fd);
+	rd->ready = true;
+	}
+
+/*
+ * processes the completions
+ */
+static void uring_reap(uring_t *r) {
+	unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	while ( head != tail ) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		uint64_t tag = cqe->user_data;
+		int res = cqe->res;
+
+		head ++;
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		r->inflight --;
+		if ( tag & URING_RD )
+			uring_read_done(tag & 0xffff, res);
+		else
+			uring_write_done(tag & 0xffff, res);
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+
+/*
+ * opens the file and starts its read into a recycled buffer
+ */
+static void uring_read_start(int slot, const char *fname) {
+	uring_rd_t *rd = &urd[slot];
+	struct stat st;
+
+	rd->fname = fname;
+	rd->ready = false;
+	rd->done = 0;
+	panicif((rd->fd = open(fname, O_RDONLY)) == -1, "Unable to open '%s'", fname);
+	panicif(fstat(rd->fd, &st) == -1, "fstat failed");
+	rd->size = st.st_size;
+	rd->mtime = st.st_mtime;
+	rd->buf = NULL;
+	for ( int i = 0; i < upool_count; i ++ ) { // a free buffer that fits
+		if ( upool_size[i] > rd->size ) {
+			rd->buf = upool[i];
+			rd->alloc = upool_size[i];
+			upool[i] = upool[-- upool_count];
+			upool_size[i] = upool_size[upool_count];
+			break;
+			}
+		}
+	if ( rd->buf == NULL ) {
+		if ( upool_count ) { // grow the last free one
+			rd->buf = upool[-- upool_count];
+			free(rd->buf);
+			}
+		rd->alloc = rd->size + 1;
+		panicif((rd->buf = (char *) malloc(rd->alloc)) == NULL, "out of memory");
+		}
+	if ( rd->size == 0 ) {
+		rd->buf[0] = '\0';
+		close(rd->fd);
+		rd->ready = true;
+		return;
+		}
+	uring_prep(&ring, IORING_OP_READ, rd->fd, rd->buf, rd->size, 0, URING_RD | slot);
+	}
+
+/*
+ * starts the write of the output 'buf' of a file to 'path' (NULL =
+ * stdout, in order), when a write slot is free; 'buf' is freed when it
+ * is written.
+ */
+static void uring_write_submit(const char *path, char *buf, size_t size) {
+	uring_wr_t *w;
+	FILE	*fp;
+	int		slot;
+
+	for ( ;; ) { // a free write slot
+		for ( slot = 0; slot < URING_WRITES && uwr[slot].busy; slot ++ );
+		if ( slot < URING_WRITES && ring.inflight < URING_ENTRIES - 1 )
+			break;
+		panicif(uring_enter(&ring, 1) < 0, "io_uring_enter failed");
+		uring_reap(&ring);
+		}
+	w = &uwr[slot];
+	w->buf = buf;
+	w->size = size;
+	w->done = 0;
+	w->busy = true;
+	if ( path ) {
+		snprintf(w->path, sizeof(w->path), "%s", path);
+		panicif((fp = atomic_open(w->path, w->tmpname, sizeof(w->tmpname))) == NULL, "Unable to create '%s'", w->path);
+		w->fd = dup(fileno(fp));
+		fclose(fp);
+		uring_write_next(slot);
+		}
+	else {
+		w->fd = STDOUT_FILENO;
+		if ( uwr_stdout_busy ) {
+			uwr_stdout_q[(uwr_q_head + uwr_q_count) % URING_WRITES] = slot;
+			uwr_q_count ++;
+			}
+		else {
+			uwr_stdout_busy = true;
+			uring_write_next(slot);
+			}
+		}
+	}
+
+/*
+ * converts the 'count' files of 'list' with io_uring; returns -1 if
+ * io_uring is not available.
+ */
+int convert_uring(const char **list, int count) {
+	int		head = 0, tail = 0;
+
+	if ( uring_init(&ring, URING_ENTRIES) != 0 )
+		return -1;
+	out_submit = uring_write_submit;
+	while ( head < count ) {
+		// read ahead
+		while ( tail < count && tail - head < URING_READS && ring.inflight < URING_ENTRIES - 1 ) {
+			uring_read_start(tail % URING_READS, list[tail]);
+			tail ++;
+			}
+
+		// wait for the next file
+		uring_rd_t *rd = &urd[head % URING_READS];
+		while ( !rd->ready ) {
+			panicif(uring_enter(&ring, 1) < 0, "io_uring_enter failed");
+			uring_reap(&ring);
+			}
+		uring_enter(&ring, 0);
+
+		// convert, as convert() does
+		norm_buffer(&rd->buf, &rd->alloc, rd->done);
+		convert_buf(rd->fname, rd->buf, rd->mtime);
+		upool[upool_count] = rd->buf;	// recycle
+		upool_size[upool_count ++] = rd->alloc;
+		head ++;
+		}
+
+	// wait for the writes
+	out_submit = NULL;
+	while ( ring.inflight ) {
+		panicif(uring_enter(&ring, 1) < 0, "io_uring_enter failed");
+		uring_reap(&ring);
+		}
+	for ( int i = 0; i < upool_count; i ++ )
+		free(upool[i]);
+	upool_count = 0;
+	close(ring.fd);
+	return 0;
+	}
+#endif
+
+/*
+ *	pipelined conversion (--pipeline)
+ *
+ *	A reader thread reads and normalizes the input files and a writer
+ *	thread writes the blocks of the output to stdout, while the main
+ *	thread converts. The output is a single producer, single consumer ring
+ *	of blocks, the input a ring of PIPE_DOCS whole documents; the counters
+ *	are atomic and a side sleeps (futex) only when its ring is empty or
+ *	full. The parser needs the whole document (references, footnotes can
+ *	be defined at its end), so a document is converted when it is read:
+ *	the reading of the next files overlaps with its conversion, and the
+ *	conversion with the writing.
+ */
+#define PIPE_SLOTS	8
+#define PIPE_BLOCK	(256 * 1024)
+#define PIPE_DOCS	2			// documents read ahead
+
+typedef struct {
+	char		*blk[PIPE_SLOTS];
+	size_t		len[PIPE_SLOTS];	// 0 = end of data
+	uint32_t	head, tail;			// consumed, produced
+	uint32_t	wait_head, wait_tail;	// the producer or the consumer sleeps
+	int			fd, err;
+	} pipe_ring_t;
+
+static void pipe_sleep(uint32_t *addr, uint32_t val, uint32_t *waiting) {
+	for ( int i = 0; i < 100; i ++ ) // spin a little
+		if ( __atomic_load_n(addr, __ATOMIC_ACQUIRE) != val )
+			return;
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	if ( __atomic_load_n(addr, __ATOMIC_SEQ_CST) == val )
+#ifdef __linux__
+		syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+		sched_yield();
+#endif
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+	}
+
+static void pipe_wake(uint32_t *addr, uint32_t *waiting) {
+	if ( __atomic_load_n(waiting, __ATOMIC_SEQ_CST) ) {
+#ifdef __linux__
+		syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+		}
+	}
+
+/*
+ * producer: returns the next free block
+ */
+static char *pipe_get(pipe_ring_t *r) {
+	uint32_t h;
+
+	while ( r->tail - (h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == PIPE_SLOTS )
+		pipe_sleep(&r->head, h, &r->wait_head);
+	return r->blk[r->tail % PIPE_SLOTS];
+	}
+
+/*
+ * producer: publishes the block with 'len' bytes
+ */
+static void pipe_put(pipe_ring_t *r, size_t len) {
+	r->len[r->tail % PIPE_SLOTS] = len;
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+	pipe_wake(&r->tail, &r->wait_tail);
+	}
+
+/*
+ * consumer: returns the next block and its length
+ */
+static char *pipe_next(pipe_ring_t *r, size_t *len) {
+	uint32_t t;
+
+	while ( (t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == r->head )
+		pipe_sleep(&r->tail, t, &r->wait_tail);
+	*len = r->len[r->head % PIPE_SLOTS];
+	return r->blk[r->head % PIPE_SLOTS];
+	}
+
+/*
+ * consumer: releases the block
+ */
+static void pipe_done(pipe_ring_t *r) {
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+	pipe_wake(&r->head, &r->wait_head);
+	}
+
+static void *pipe_reader(void *arg) {
+	pipe_ring_t *r = (pipe_ring_t *) arg;
+	ssize_t	n;
+
+	do {
+		char *b = pipe_get(r);
+		while ( (n = read(r->fd, b, PIPE_BLOCK)) == -1 && errno == EINTR );
+		if ( n < 0 ) {
+			r->err = errno;
+			n = 0;
+			}
+		pipe_put(r, n);
+		} while ( n );
+	return NULL;
+	}
+
+static void *pipe_writer(void *arg) {
+	pipe_ring_t *r = (pipe_ring_t *) arg;
+	size_t	len, done;
+	ssize_t	n;
+	char	*b;
+
+	while ( (b = pipe_next(r, &len), len) ) {
+		for ( done = 0; done < len && !r->err; done += ( n > 0 ) ? n : 0 ) {
+			if ( (n = write(r->fd, b + done, len - done)) == -1 && errno != EINTR )
+				r->err = errno;
+			}
+		pipe_done(r);
+		}
+	pipe_done(r);
+	return NULL;
+	}
+
+// the output stream of the converter
+typedef struct {
+	pipe_ring_t	*r;
+	char		*blk;
+	size_t		len;
+	} pipe_out_t;
+
+static ssize_t pipe_fwrite(void *cookie, const char *s, size_t n) {
+	pipe_out_t *o = (pipe_out_t *) cookie;
+	size_t	k;
+
+	for ( size_t done = 0; done < n; done += k ) {
+		if ( o->blk == NULL ) {
+			o->blk = pipe_get(o->r);
+			o->len = 0;
+			}
+		k = ( n - done < PIPE_BLOCK - o->len ) ? n - done : PIPE_BLOCK - o->len;
+		memcpy(o->blk + o->len, s + done, k);
+		o->len += k;
+		if ( o->len == PIPE_BLOCK ) {
+			pipe_put(o->r, o->len);
+			o->blk = NULL;
+			}
+		}
+	return n;
+	}
+
+static int pipe_fclose(void *cookie) {
+	pipe_out_t *o = (pipe_out_t *) cookie;
+
+	if ( o->blk && o->len ) {
+		pipe_put(o->r, o->len);
+		o->blk = NULL;
+		}
+	if ( o->blk == NULL )
+		pipe_get(o->r);
+	pipe_put(o->r, 0);
+	return 0;
+	}
+
+static void pipe_init(pipe_ring_t *r, int fd) {
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	for ( int i = 0; i < PIPE_SLOTS; i ++ )
+		panicif((r->blk[i] = (char *) malloc(PIPE_BLOCK)) == NULL, "out of memory");
+	}
+
+static void pipe_free(pipe_ring_t *r) {
+	for ( int i = 0; i < PIPE_SLOTS; i ++ )
+		free(r->blk[i]);
+	}
+
+// the documents of the reader thread
+typedef struct {
+	const char	**list;			// the files, NULL = stdin
+	int			count;
+	char		*buf[PIPE_DOCS];
+	int			err[PIPE_DOCS];	// errno of the open or of the read
+	bool		eopen[PIPE_DOCS];
+	uint32_t	head, tail;		// converted, read
+	uint32_t	wait_head, wait_tail;
+	} pipe_docs_t;
+
+/*
+ * reads and normalizes the file 'fname' (NULL = stdin) into the slot 'k'
+ * of 'd'; an error is kept in the slot for the main thread.
+ */
+static void pipe_load(pipe_docs_t *d, int k, const char *fname) {
+	norm_t	ns = { false, false, 0, 0, false };
+	size_t	len = 0, alloc = 0;
+	ssize_t	n;
+	char	*buf = NULL, *chunk;
+	int		fd = STDIN_FILENO;
+
+	d->buf[k] = NULL;
+	d->err[k] = 0;
+	d->eopen[k] = false;
+	if ( fname && (fd = open(fname, O_RDONLY)) == -1 ) {
+		d->err[k] = errno;
+		d->eopen[k] = true;
+		return;
+		}
+	panicif((chunk = (char *) malloc(PIPE_BLOCK)) == NULL, "out of memory");
+	while ( (n = read(fd, chunk, PIPE_BLOCK)) != 0 ) {
+		if ( n == -1 ) {
+			if ( errno == EINTR )
 				continue;
+			d->err[k] = errno;
+			break;
+			}
+		if ( len + NORM_MAX(n) + 1 > alloc ) {
+			alloc = alloc * 2 + NORM_MAX(n) + 1;
+			panicif((buf = (char *) realloc(buf, alloc)) == NULL, "out of memory");
+			}
+		len += norm_chunk(&ns, buf + len, chunk, n);
+		}
+	free(chunk);
+	if ( fname ) close(fd);
+	if ( buf == NULL )
+		panicif((buf = (char *) malloc(alloc = 1)) == NULL, "out of memory");
+	len += norm_end(&ns, buf + len);
+	buf[len] = '\0';
+	d->buf[k] = buf;
+	}
+
+static void *pipe_docs_reader(void *arg) {
+	pipe_docs_t *d = (pipe_docs_t *) arg;
+	uint32_t h;
+
+	for ( int i = 0; i < d->count; i ++ ) {
+		while ( d->tail - (h = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE)) == PIPE_DOCS )
+			pipe_sleep(&d->head, h, &d->wait_head);
+		pipe_load(d, d->tail % PIPE_DOCS, d->list[i]);
+		__atomic_store_n(&d->tail, d->tail + 1, __ATOMIC_SEQ_CST);
+		pipe_wake(&d->tail, &d->wait_tail);
+		}
+	return NULL;
+	}
+
+/*
+ * converts the 'count' files of 'list' (NULL = stdin) to stdout with the
+ * reader and the writer threads; returns -1 if the threads cannot be
+ * created.
+ */
+int convert_pipeline(const char **list, int count) {
+	pipe_docs_t	in;
+	pipe_ring_t	out;
+	pipe_out_t	po = { &out, NULL, 0 };
+	cookie_io_functions_t io = { NULL, pipe_fwrite, NULL, pipe_fclose };
+	pthread_t	rth, wth;
+	uint32_t	t;
+
+	memset(&in, 0, sizeof(in));
+	in.list = list;
+	in.count = count;
+	if ( pthread_create(&rth, NULL, pipe_docs_reader, &in) != 0 )
+		return -1;
+	fflush(stdout);
+	pipe_init(&out, STDOUT_FILENO);
+	panicif(pthread_create(&wth, NULL, pipe_writer, &out) != 0, "Unable to create a thread");
+	panicif((fout = fopencookie(&po, "w", io)) == NULL, "fopencookie failed");
+	setvbuf(fout, NULL, _IOFBF, 64 * 1024);
+
+	for ( int i = 0; i < count; i ++ ) {
+		const char *docname = ( list[i] ) ? list[i] : "stdin";
+		int		k = in.head % PIPE_DOCS;
+
+		while ( (t = __atomic_load_n(&in.tail, __ATOMIC_ACQUIRE)) == in.head )
+			pipe_sleep(&in.tail, t, &in.wait_tail);
+		if ( in.err[k] ) { // the pages before it are written first
+			fclose(fout);
+			pthread_join(wth, NULL);
+			errno = in.err[k];
+			panicif(in.eopen[k], "Unable to open '%s'", docname);
+			panicif(true, "Unable to read '%s' (%s)", docname, strerror(in.err[k]));
+			}
+		convert_doc(docname, in.buf[k]);
+		free(in.buf[k]);
+		__atomic_store_n(&in.head, in.head + 1, __ATOMIC_SEQ_CST);
+		pipe_wake(&in.head, &in.wait_head);
+		}
+	pthread_join(rth, NULL);
+	fclose(fout);
+	fout = stdout;
+	pthread_join(wth, NULL);
+	panicif(out.err, "Unable to write (%s)", strerror(out.err));
+	pipe_free(&out);
+	return 0;
+	}
+
+/*
+ *	pages of one source (--split-pages)
+ *
+ *	A source with many man pages, each one from its `# name section`
+ *	header, is read once and its pages are converted by --jobs processes,
+ *	each to its name.section file of -O, as the files of -O are.
+ */
+typedef struct { char *start, *end; } page_t;
+
+// returns true if the line 'p' is a '# name section' header, with a man section
+static bool page_header(const char *p) {
+	const char *e;
+
+	if ( p[0] != '#' || !ch_blank(p[1]) )
+		return false;
+	for ( p ++; ch_blank(*p); p ++ );
+	for ( e = p; *e && !ch_space(*e); e ++ );
+	if ( e == p )
+		return false;
+	for ( p = e; ch_blank(*p); p ++ );
+	for ( e = p; *e && !ch_space(*e); e ++ );
+	if ( e - p == 1 && (*p == 'n' || *p == 'l') ) // Tcl and local pages
+		return true;
+	if ( !ch_digit(*p) || e - p > 8 ) // 1, 3p, 3ssl, 8x
+		return false;
+	while ( ++ p < e )
+		if ( !ch_alnum(*p) )
+			return false;
+	return true;
+	}
+
+/*
+ * stores in 'list' the pages of 'buf' and returns their number; the text
+ * before the first header is a page too, if it is not blank.
+ */
+static int page_split(char *buf, page_t **list) {
+	int		count = 0, alloc = 0;
+	bool	fence = false;
+	char	*p, *s;
+
+	*list = NULL;
+	for ( p = buf; *p; p = ( s ) ? s + 1 : p + strlen(p) ) {
+		for ( s = p; *s == ' ' && s - p < 3; s ++ );
+		if ( strncmp(s, "```", 3) == 0 ) // the only fence of md2roff()
+			fence = !fence;
+		else if ( !fence && page_header(p) ) {
+			bool	pre = false;	// not blank text before the first page
+
+			if ( count == 0 ) {
+				for ( s = buf; s < p && ch_space(*s); s ++ );
+				pre = ( s < p );
 				}
-			else if ( isdigit(*p) ) { // ordered list
-				char	num[16], *n;
-				const char *pstub = p;
+			if ( count + 2 > alloc ) {
+				alloc += 64;
+				panicif((*list = (page_t *) realloc(*list, sizeof(page_t) * alloc)) == NULL, "out of memory");
+				}
+			if ( pre )
+				(*list)[count ++].start = buf;
+			if ( count )
+				(*list)[count - 1].end = p;
+			(*list)[count ++].start = p;
+			}
+		s = strchr(p, '\n');
+		}
+	if ( count == 0 ) {
+		panicif((*list = (page_t *) malloc(sizeof(page_t))) == NULL, "out of memory");
+		(*list)[count ++].start = buf;
+		}
+	(*list)[count - 1].end = p;
+	return count;
+	}
+
+/*
+ * starts gzip(1) that writes to 'out'; the pipe to its input is stored in
+ * 'in'. Returns its pid, or -1.
+ */
+static pid_t gzip_spawn(int out, int *in) {
+	int		fd[2];
+	pid_t	pid;
+
+	if ( pipe(fd) == -1 )
+		return -1;
+	if ( (pid = fork()) == -1 ) {
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+		}
+	if ( pid == 0 ) {
+		dup2(fd[0], STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		close(fd[0]);
+		close(fd[1]);
+		execlp("gzip", "gzip", "-9", "-n", "-c", (char *) NULL);
+		_exit(127);
+		}
+	close(fd[0]);
+	*in = fd[1];
+	return pid;
+	}
+
+// waits for gzip(1); returns 0 if it was successful
+static int gzip_wait(pid_t pid) {
+	int		status;
+
+	if ( waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+		return -1;
+	return 0;
+	}
+
+// writes the 'len' bytes of 'buf' to 'fd'; returns 0 on success
+static int write_all(int fd, const char *buf, size_t len) {
+	ssize_t	n;
+
+	for ( size_t done = 0; done < len; done += n ) {
+		if ( (n = write(fd, buf + done, len - done)) <= 0 ) {
+			if ( n == -1 && errno == EINTR )
+				n = 0;
+			else
+				return -1;
+			}
+		}
+	return 0;
+	}
+
+/*
+ * writes 'len' bytes of 'buf' compressed by gzip(1) to 'fp'
+ */
+static int gzip_write(FILE *fp, const char *buf, size_t len) {
+	int		in, err;
+	pid_t	pid;
+
+	fflush(fp);
+	if ( (pid = gzip_spawn(fileno(fp), &in)) == -1 )
+		return -1;
+	err = write_all(in, buf, len);
+	close(in);
+	return ( gzip_wait(pid) == 0 ) ? err : -1;
+	}
+
+/*
+ * compresses 'len' bytes of 'buf' by gzip(1) to the allocated 'out'; a
+ * child process feeds gzip(1) while this one reads its output.
+ */
+static int gzip_mem(const char *buf, size_t len, char **out, size_t *olen) {
+	int		fd[2], in, err = 0;
+	pid_t	pid, feeder;
+	char	blk[64 * 1024];
+	ssize_t	n;
+	FILE	*fp;
+
+	if ( pipe(fd) == -1 )
+		return -1;
+	pid = gzip_spawn(fd[1], &in);
+	close(fd[1]);
+	if ( pid == -1 ) {
+		close(fd[0]);
+		return -1;
+		}
+	if ( (feeder = fork()) == 0 ) {
+		close(fd[0]);
+		_exit(( write_all(in, buf, len) == 0 ) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	close(in);
+	panicif((fp = open_memstream(out, olen)) == NULL, "open_memstream failed");
+	while ( (n = read(fd[0], blk, sizeof(blk))) != 0 ) {
+		if ( n > 0 )
+			fwrite(blk, 1, n, fp);
+		else if ( errno != EINTR ) {
+			err = -1;
+			break;
+			}
+		}
+	close(fd[0]);
+	fclose(fp);
+	if ( feeder == -1 || gzip_wait(feeder) != 0 )
+		err = -1;
+	if ( gzip_wait(pid) != 0 )
+		err = -1;
+	return err;
+	}
+
+// converts the page 'pg' of the source 'docname'
+static void page_convert(const char *docname, page_t *pg) {
+	char	path[4096], tmpname[4096 + 8], *buf, c = *pg->end;
+	size_t	size;
+	FILE	*fp;
+
+	*pg->end = '\0';
+	out_path(docname, pg->start, opt_outdir, path, sizeof(path) - 3);
+	if ( opt_split_gz )
+		strcat(path, ".gz");
+	panicif((fp = atomic_open(path, tmpname, sizeof(tmpname))) == NULL, "Unable to create '%s'", path);
+	if ( opt_split_gz ) {
+		panicif((fout = open_memstream(&buf, &size)) == NULL, "open_memstream failed");
+		convert_doc(docname, pg->start);
+		fclose(fout);
+		panicif(gzip_write(fp, buf, size) != 0, "Unable to compress '%s'", path);
+		free(buf);
+		}
+	else {
+		fout = fp;
+		convert_doc(docname, pg->start);
+		}
+	fout = stdout;
+	*pg->end = c;
+	panicif(atomic_close(fp, tmpname, path) != 0, "Unable to write '%s'", path);
+	}
+
+/*
+ * converts the pages of 'buf' with 'jobs' processes that take the next
+ * page from a pipe, as check_files() does. The pages are converted in
+ * this process if they report to --whatis or --check-xrefs.
+ */
+static void split_pages(const char *docname, char *buf, int jobs) {
+	page_t	*list;
+	int		count = page_split(buf, &list), fd[2], idx, status, failed = 0;
+	pid_t	pid;
+
+	if ( opt_outdir == NULL )
+		opt_outdir = ".";
+	if ( jobs > count )
+		jobs = count;
+	if ( jobs <= 1 || opt_whatis || opt_xrefs ) {
+		for ( idx = 0; idx < count; idx ++ )
+			page_convert(docname, &list[idx]);
+		free(list);
+		return;
+		}
+
+	fflush(stdout);
+	panicif(pipe(fd) == -1, "pipe failed");
+	for ( int j = 0; j < jobs; j ++ ) {
+		panicif((pid = fork()) == -1, "fork failed");
+		if ( pid == 0 ) {
+			close(fd[1]);
+			while ( read(fd[0], &idx, sizeof(idx)) == sizeof(idx) ) // atomic, < PIPE_BUF
+				page_convert(docname, &list[idx]);
+			_exit(EXIT_SUCCESS);
+			}
+		}
+	close(fd[0]);
+	for ( idx = 0; idx < count; idx ++ )
+		panicif(write(fd[1], &idx, sizeof(idx)) != sizeof(idx), "write failed");
+	close(fd[1]);
+	while ( wait(&status) > 0 )
+		if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+			failed ++;
+	free(list);
+	panicif(failed, "Unable to convert the pages of '%s'", docname);
+	}
+
+/*
+ *	tar archives (--from-tar, --to-tar)
+ *
+ *	The members of an input archive are read by the reader thread of
+ *	--pipeline while the main thread converts them, and the pages are
+ *	written as ustar members to a stream whose blocks the writer thread
+ *	writes to stdout. Nothing is extracted to the disk.
+ */
+#define TAR_BLOCK	512
+
+static struct {
+	pipe_ring_t	r;
+	pipe_out_t	po;
+	pthread_t	th;
+	FILE		*fp;
+	} tar_out;
+
+// stores the ustar header of the member 'path' in 'h'
+static void tar_header(char *h, const char *path, uint64_t size, time_t mtime, char type) {
+	size_t		len = strlen(path);
+	const char	*s;
+	unsigned	sum = 0;
+
+	memset(h, 0, TAR_BLOCK);
+	for ( s = strchr(path, '/'); s && len > 100; s = strchr(s + 1, '/') ) // prefix/name
+		if ( s > path && s - path <= 155 && len - (s - path) - 1 <= 100 )
+			break;
+	if ( len > 100 && s ) {
+		memcpy(h + 345, path, s - path);
+		memcpy(h, s + 1, len - (s - path) - 1);
+		}
+	else
+		memcpy(h, path, ( len > 100 ) ? 100 : len);
+	snprintf(h + 100, 8, "%07o", 0644);
+	snprintf(h + 108, 8, "%07o", 0);
+	snprintf(h + 116, 8, "%07o", 0);
+	snprintf(h + 124, 12, "%011llo", (unsigned long long) size);
+	snprintf(h + 136, 12, "%011llo", (unsigned long long) (( mtime > 0 ) ? mtime : 0) & 077777777777ULL);
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	strcpy(h + 265, "root");
+	strcpy(h + 297, "root");
+	memset(h + 148, ' ', 8);
+	for ( int i = 0; i < TAR_BLOCK; i ++ )
+		sum += (unsigned char) h[i];
+	snprintf(h + 148, 7, "%06o", sum);
+	}
+
+// writes the 'size' bytes of 'data' and the padding of their last block
+static void tar_data(const char *data, uint64_t size) {
+	static const char zero[TAR_BLOCK];
+
+	fwrite(data, 1, size, tar_out.fp);
+	if ( size % TAR_BLOCK )
+		fwrite(zero, 1, TAR_BLOCK - size % TAR_BLOCK, tar_out.fp);
+	}
+
+/*
+ * adds the member 'path' to the output archive; the names that do not fit
+ * in the ustar header are stored in a GNU long name member before it.
+ */
+static void tar_put(const char *path, const char *data, size_t size, time_t mtime) {
+	char	h[TAR_BLOCK];
+	size_t	len = strlen(path);
+
+	tar_header(h, path, size, mtime, '0');
+	if ( len > 100 && h[345] == '\0' ) {
+		char	lh[TAR_BLOCK];
+
+		tar_header(lh, "././@LongLink", len + 1, 0, 'L');
+		fwrite(lh, 1, TAR_BLOCK, tar_out.fp);
+		tar_data(path, len + 1);
+		}
+	fwrite(h, 1, TAR_BLOCK, tar_out.fp);
+	tar_data(data, size);
+	}
+
+// starts the output archive
+static void tar_begin(void) {
+	cookie_io_functions_t io = { NULL, pipe_fwrite, NULL, pipe_fclose };
+
+	fflush(stdout);
+	pipe_init(&tar_out.r, STDOUT_FILENO);
+	tar_out.po.r = &tar_out.r;
+	panicif(pthread_create(&tar_out.th, NULL, pipe_writer, &tar_out.r) != 0, "Unable to create a thread");
+	panicif((tar_out.fp = fopencookie(&tar_out.po, "w", io)) == NULL, "fopencookie failed");
+	setvbuf(tar_out.fp, NULL, _IOFBF, 64 * 1024);
+	__fsetlocking(tar_out.fp, FSETLOCKING_BYCALLER);
+	}
+
+// writes the end of the output archive
+static void tar_end(void) {
+	static const char zero[TAR_BLOCK * 2];
+
+	fwrite(zero, 1, sizeof(zero), tar_out.fp);
+	fclose(tar_out.fp);
+	pthread_join(tar_out.th, NULL);
+	panicif(tar_out.r.err, "Unable to write (%s)", strerror(tar_out.r.err));
+	pipe_free(&tar_out.r);
+	}
+
+static int check_errors;
+
+/*
+ * converts the document 'buf' of 'docname' to stdout, to a file of the -O
+ * directory, or to a member of the --to-tar archive with the time 'mtime'
+ */
+static void convert_buf(const char *docname, char *buf, time_t mtime) {
+	char	path[4096], tmpname[4096 + 8], *obuf, *gz;
+	size_t	osize, gzsize;
+	FILE	*fp;
+
+	if ( opt_check ) {
+		if ( md2roff_check(docname, buf) )
+			check_errors ++;
+		}
+	else if ( opt_split )
+		split_pages(docname, buf, ( opt_jobs > 0 ) ? opt_jobs : sysconf(_SC_NPROCESSORS_ONLN));
+	else if ( opt_to_tar ) {
+		out_path(docname, buf, NULL, path, sizeof(path) - 3);
+		panicif((fout = open_memstream(&obuf, &osize)) == NULL, "open_memstream failed");
+		convert_doc(docname, buf);
+		fclose(fout);
+		fout = stdout;
+		if ( opt_to_tar_gz ) {
+			strcat(path, ".gz");
+			panicif(gzip_mem(obuf, osize, &gz, &gzsize) != 0, "Unable to compress '%s'", path);
+			tar_put(path, gz, gzsize, mtime);
+			free(gz);
+			}
+		else
+			tar_put(path, obuf, osize, mtime);
+		free(obuf);
+		}
+	else if ( out_submit ) { // the writes are left to it
+		if ( opt_outdir )
+			out_path(docname, buf, opt_outdir, path, sizeof(path));
+		panicif((fout = open_memstream(&obuf, &osize)) == NULL, "open_memstream failed");
+		convert_doc(docname, buf);
+		fclose(fout);
+		fout = stdout;
+		if ( opt_outdir && opt_if_changed && same_file(path, -1, obuf, osize) )
+			free(obuf);
+		else
+			out_submit(( opt_outdir ) ? path : NULL, obuf, osize);
+		}
+	else if ( opt_outdir ) {
+		out_path(docname, buf, opt_outdir, path, sizeof(path));
+		panicif((fp = atomic_open(path, tmpname, sizeof(tmpname))) == NULL, "Unable to create '%s'", path);
+		fout = fp;
+		convert_doc(docname, buf);
+		fout = stdout;
+		panicif(atomic_close(fp, tmpname, path) != 0, "Unable to write '%s'", path);
+		}
+	else
+		convert_doc(docname, buf);
+	}
+
+/*
+ * converts the file 'fname' (NULL = stdin) to stdout, to a file of the
+ * -O directory or to the --to-tar archive; the file is replaced atomically.
+ */
+void convert(const char *fname) {
+	const char *docname = ( fname ) ? fname : "stdin";
+	struct stat	st;
+	char	*buf;
+
+	if ( opt_pipeline && !opt_check && !opt_outdir && !opt_split && !opt_to_tar && convert_pipeline(&fname, 1) == 0 )
+		return;
+	buf = loadfile(fname);
+	convert_buf(docname, buf, ( fname && stat(fname, &st) == 0 ) ? st.st_mtime : time(NULL));
+	free(buf);
+	}
+
+// the input archive
+typedef struct {
+	pipe_ring_t	r;
+	char		*blk;
+	size_t		len, pos;
+	} tar_in_t;
+
+// returns the unread bytes of the current block; 'n' is 0 at the end
+static const char *tar_chunk(tar_in_t *t, size_t *n) {
+	if ( t->pos == t->len && (t->blk == NULL || t->len) ) {
+		if ( t->blk )
+			pipe_done(&t->r);
+		t->blk = pipe_next(&t->r, &t->len);
+		t->pos = 0;
+		}
+	*n = t->len - t->pos;
+	return t->blk + t->pos;
+	}
 
-				n = num;
-				while ( isdigit(*p) )
-					*n ++ = *p ++;
-				*n = '\0';
-				if ( *p == '.' ) {
-					d = flushln(d, dest);
-					if ( stk_list_p )
-						roff(li_end);
-					else
-						roff(ol_open);
-					stk_count[stk_list_p-1] = atoi(num);
-					roff(li_open);
-					p ++;
-					while ( *p == ' ' || *p == '\t' ) p ++;
-					continue;
-					}
-				p = pstub;
-				}
-			else if ( strncmp(p, "```", 3) == 0 ) { // open code-block
-				bcode = true;
-				p += 3;
-				while ( *p != '\n' ) p ++;
-				if ( *p == '\n' ) p ++;
-				d = flushln(d, dest);
-				roff(cblock_open);
-				continue;
-				}
-			} // inside if ( beginning of line )
+// copies the next 'n' bytes to 'dst' (NULL = skips them); returns the bytes read
+static size_t tar_read(tar_in_t *t, char *dst, size_t n) {
+	size_t	done, k;
+	const char *p;
 
-		//////////////////////////////////
-		// in line
-		//////////////////////////////////
-		if ( *p == '\n' ) {
-			if ( strncmp(p+1, "===", 3) == 0
-				|| strncmp(p+1, "---", 3) == 0
-				|| strncmp(p+1, "***", 3) == 0 ) {
-				char rc = *(p+1);
-				char	*prevln;
-				p = strchr(p+1, '\n');
-				if ( !p )
-					return;
-				if ( d == dest ) {
-					p ++;
-					continue;
-					}
+	for ( done = 0; done < n; done += k ) {
+		p = tar_chunk(t, &k);
+		if ( k == 0 )
+			break;
+		if ( k > n - done )
+			k = n - done;
+		if ( dst )
+			memcpy(dst + done, p, k);
+		t->pos += k;
+		}
+	return done;
+	}
 
-				// this is ruler or section
-				*d = '\0';
-				prevln = strrchr(dest, '\n');
-				if ( prevln ) {
-					*prevln = '\0';
-					if ( prevln > dest )
-						puts(dest);
-					prevln ++;
-					roff(new_sh);
-					printf("%s\n", prevln);
-					d = dest;
-					}
-				else {
-					roff(new_sh);
-					d = flushln(d, dest);
-					}
-				
-				p ++;
-				continue;
-				}
-			else
-				*d ++ = ' ';
+// returns the octal (or base-256) number of the header field 'f'
+static uint64_t tar_num(const char *f, size_t n) {
+	uint64_t v = 0;
 
-			bline = true;
-			}
-		else if (
-			(std_q && (*p == '*' && *(p+1) == '*' ) || ( *p == '_' && *(p+1) == '_' ))
-			||
-			(!std_q && (*p == '*' && *(p+1) == '*' ))
-			||
-			(!std_q && (*p == '*' ))
-			) { // strong
-			if ( bold ) {
-				bold = false;
-				if ( mpack == mp_mom )
-					d = stradd(d, "\\*[PREV]");
-				else
-					d = stradd(d, "\\fP");
-				}
-			else {
-				char pc = (p > source) ? *(p-1) : ' ';
-				if ( strchr("({[,.;`'\" \t\n\r", pc) != NULL ) {
-					if ( pc == ';' || pc == ',' || pc == '.' ) *d ++ = ' ';
-					bold = true;
-					if ( mpack == mp_mom )
-						d = stradd(d, "\\*[BD]");
-					else
-						d = stradd(d, "\\fB");
-					}
-				else {
-					*d ++ = *p;
-					if ( p[1] == '*' || p[1] == '_' )
-						*d ++ = *(p+1);
-					}
-				}
-			if ( p[1] == '*' || p[1] == '_' )
-				p ++;
-			p ++;
-			continue;
-			}
-		else if ( // emphasis
-				(std_q && (*p == '*' || *p == '_'))
-				||
-				(!std_q && (*p == '_' && *(p+1) == '_'))
-				||
-				(!std_q && (*p == '_') )
-				) {
-		   	// emphasis
-			if ( italics ) {
-				italics = false;
-				if ( mpack == mp_mom )
-					d = stradd(d, "\\*[PREV]");
-				else
-					d = stradd(d, "\\fP");
-				}
-			else {
-				char pc = (p > source) ? *(p-1) : ' ';
-				if ( strchr("({[,.;`'\" \t\n\r", pc) != NULL ) {
-					if ( pc == ';' || pc == ',' || pc == '.' ) *d ++ = ' ';
-					italics = true;
-					if ( mpack == mp_mom )
-						d = stradd(d, "\\*[IT]");
-					else
-						d = stradd(d, "\\fI");
-					}
-				else {
-					*d ++ = *p;
-					if ( p[1] == '*' || p[1] == '_' )
-						*d ++ = *(p+1);
-					}
+	if ( (unsigned char) *f & 0x80 ) {
+		for ( size_t i = 1; i < n; i ++ )
+			v = v << 8 | (unsigned char) f[i];
+		return v;
+		}
+	for ( ; n && *f == ' '; f ++, n -- );
+	for ( ; n && *f >= '0' && *f <= '7'; f ++, n -- )
+		v = v * 8 + (*f - '0');
+	return v;
+	}
+
+// returns true if the checksum of the header 'h' is right
+static bool tar_valid(const char *h) {
+	unsigned	sum = 0;
+	int			ssum = 0;
+
+	for ( int i = 0; i < TAR_BLOCK; i ++ ) {
+		sum += ( i >= 148 && i < 156 ) ? ' ' : (unsigned char) h[i];
+		ssum += ( i >= 148 && i < 156 ) ? ' ' : (signed char) h[i];
+		}
+	return ( tar_num(h + 148, 8) == sum || (int) tar_num(h + 148, 8) == ssum );
+	}
+
+// returns true if the member 'name' is a Markdown source
+static bool tar_markdown(const char *name) {
+	const char *e = strrchr(name, '.');
+
+	return ( e && (strcasecmp(e, ".md") == 0 || strcasecmp(e, ".markdown") == 0) );
+	}
+
+/*
+ * converts the Markdown members of the tar archive 'fname' (NULL = stdin)
+ * as convert() does with the files, in the order of the archive; a GNU
+ * long name or a pax 'path' record names the next member. Returns -1 if
+ * the reader thread cannot be created.
+ */
+int convert_tar(const char *fname) {
+	const char *docname = ( fname ) ? fname : "stdin";
+	tar_in_t	t;
+	pthread_t	th;
+	char		h[TAR_BLOCK], name[4096], lname[4096] = "", *buf = NULL, *ext, *e;
+	size_t		len, alloc = 0, n, k;
+	uint64_t	size, pad;
+	const char	*p;
+	int			fd = STDIN_FILENO;
+
+	if ( fname )
+		panicif((fd = open(fname, O_RDONLY)) == -1, "Unable to open '%s'", fname);
+	memset(&t, 0, sizeof(t));
+	pipe_init(&t.r, fd);
+	if ( pthread_create(&th, NULL, pipe_reader, &t.r) != 0 ) {
+		pipe_free(&t.r);
+		if ( fname ) close(fd);
+		return -1;
+		}
+	while ( (n = tar_read(&t, h, TAR_BLOCK)) == TAR_BLOCK ) {
+		for ( k = 0; k < TAR_BLOCK && h[k] == '\0'; k ++ );
+		if ( k == TAR_BLOCK ) // end of archive
+			break;
+		panicif(!tar_valid(h), "'%s' is not a tar archive", docname);
+		size = tar_num(h + 124, 12);
+		pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+		if ( h[156] == 'L' || h[156] == 'x' ) { // the name of the next member
+			panicif(size > 1024 * 1024, "'%s': header too long", docname);
+			panicif((ext = (char *) malloc(size + 1)) == NULL, "out of memory");
+			panicif(tar_read(&t, ext, size) != size, "'%s' is truncated", docname);
+			ext[size] = '\0';
+			if ( h[156] == 'L' )
+				snprintf(lname, sizeof(lname), "%s", ext);
+			for ( char *r = ext; h[156] == 'x' && r < ext + size; r += k ) { // "len key=value\n"
+				if ( (k = strtoul(r, &e, 10)) == 0 || r + k > ext + size )
+					break;
+				if ( strncmp(e, " path=", 6) == 0 )
+					snprintf(lname, sizeof(lname), "%.*s", (int) (r + k - 1 - (e + 6)), e + 6);
 				}
-			if ( p[1] == '_' || p[1] == '*' )
-				p ++;
-			p ++;
-			continue;
+			free(ext);
+			size = 0;
 			}
-		else if ( *p == '`' ) { // inline code
-			p ++;
-			if ( mpack == mp_mom )
-				d = stradd(d, "`\\*[CODE]");
+		else {
+			if ( lname[0] )
+				snprintf(name, sizeof(name), "%s", lname);
+			else if ( h[345] )
+				snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
 			else
-				d = stradd(d, "‘\\f[CR]");
-			
-			while ( *p != '`' ) {
-				if ( *p == '\0' ) {
-					fprintf(stderr, "%s", "inline code (`) didnt closed.");
-					exit(EXIT_FAILURE);
+				snprintf(name, sizeof(name), "%.100s", h);
+			lname[0] = '\0';
+
+			if ( (h[156] == '0' || h[156] == '\0' || h[156] == '7') && tar_markdown(name) ) {
+				norm_t	ns = { false, false, 0, 0, false };
+
+				if ( buf == NULL )
+					panicif((buf = (char *) malloc(alloc = NORM_MAX(TAR_BLOCK) + 1)) == NULL, "out of memory");
+				for ( len = 0; size; size -= k ) { // normalize straight from the blocks
+					p = tar_chunk(&t, &k);
+					panicif(k == 0, "'%s' is truncated", docname);
+					if ( k > size )
+						k = size;
+					if ( len + NORM_MAX(k) + 1 > alloc ) {
+						alloc = alloc * 2 + NORM_MAX(k) + 1;
+						panicif((buf = (char *) realloc(buf, alloc)) == NULL, "out of memory");
+						}
+					len += norm_chunk(&ns, buf + len, p, k);
+					t.pos += k;
 					}
-				*d ++ = *p ++;
+				len += norm_end(&ns, buf + len);
+				buf[len] = '\0';
+				convert_buf(name, buf, tar_num(h + 136, 12));
 				}
-
-			if ( mpack == mp_mom )
-				d = stradd(d, "\\*[CODE OFF]'");
-			else
-				d = stradd(d, "\\fP’");
 			}
+		panicif(tar_read(&t, NULL, size + pad) != size + pad, "'%s' is truncated", docname);
+		}
+	panicif(n && n < TAR_BLOCK, "'%s' is truncated", docname);
+	while ( tar_chunk(&t, &n), n ) // up to the end of the stream
+		t.pos += n;
+	pthread_join(th, NULL);
+	panicif(t.r.err, "Unable to read '%s' (%s)", docname, strerror(t.r.err));
+	pipe_free(&t.r);
+	if ( fname ) close(fd);
+	free(buf);
+	return 0;
+	}
 
-		//
-		//	Markdown link:
-		//
-		//	generic link syntax  [text](link)
-		//	image link syntax	![text](link)
-		//	man page syntax      [page section](man)
-		//  cite				 [^digit]
-		//
-		else if (
-				 ( *p == '[' && *(p+1) != '^' ) ||
-				 ( *p == '!' && *(p+1) == '[' )
-				) { // markdown link
-			const char *pfin;
-			bool bimg = false;
-			if ( *p == '!' ) {
-				p ++;
-				bimg = true;
-				}
-			pstart = p + 1;
-			pnext = strchr(pstart, ']');
-			if ( pnext
-					 && ( *(pnext+1) == '(' )
-						 && ((pfin = strchr(pnext+2, ')')) != NULL)
-			   ) {
-				char *left = strdup(pstart);
-				char *rght = strdup(pnext+2);
-				char *cp, punc = '\0';
+/*
+ *	parse cache (--parse-cache)
+ *
+ *	The results of the parsing that do not depend on the package or on the
+ *	options of the output are saved to a file, which is memory-mapped when
+ *	the document is converted again; the conversion then skips the reading
+ *	and the normalization of the source, the line index, the collection of
+ *	the references and, when the cache is made with -z, the search of the
+ *	-z words. The inline text (emphasis, links, escapes) is parsed again
+ *	at every conversion, as it is written. The file is flat and
+ *	every string is an (offset, length) span of the normalized text:
+ *		header (magic, version, size, time and checksum of the source)
+ *		the name of the document and the text, '\0' terminated
+ *		the line records (lnent_t), the blocks of md2roff()
+ *		the footnote and the link definitions (pc_ref_t)
+ *		the -z matches (zspan_t), sorted by offset, if made with -z
+ *	The header holds a checksum of the rest of the file too.
+ */
+#define PC_MAGIC	"md2rpars"
+#define PC_VERSION	2
+#define PC_SIZES	((uint32_t) (sizeof(lnent_t) << 16 | sizeof(pc_ref_t) << 8 | sizeof(zspan_t)))
 
-				d = flushln(d, dest);
-				
-				cp = strchr(left, ']');	*cp = '\0';
-				cp = strchr(rght, ')');	*cp = '\0';
-				if ( strchr(".,)]}", cp[1]) )
-					punc = cp[1];
+typedef struct {
+	char		magic[8];
+	uint32_t	version, sizes;			// PC_SIZES
+	uint32_t	tabs;					// --expand-tabs of the text
+	uint32_t	zdic;					// the -z matches are saved
+	uint32_t	name, text, text_len;	// offsets in the file, length
+	uint32_t	lines, nlines, refs, nrefs, zspans, nzspans;
+	int64_t		src_mtime, src_nsec;
+	uint64_t	src_size, size;			// of the source, of the file
+	uint64_t	text_sum, sum;			// of the text, of the file after the header
+	} pc_hdr_t;
 
-//				if ( bimg ) // RTFM
-				if ( strcmp(rght, "man") == 0 )
-					roff(man_ref, left, (int) punc);
-				else
-					roff(url_mark, left, rght, (int) punc);
-				
-				// finish
-				free(left);
-				free(rght);
-				p = pfin + 1;
-				if ( punc )
-					p ++;
-				continue;
-				}
-			else {
-				*d ++ = *p ++;
-				continue;
+typedef struct {
+	uint32_t	fn;						// footnote or link
+	uint32_t	key, klen, text, tlen;
+	} pc_ref_t;
+
+static struct {
+	char		*img;
+	size_t		size;
+	const pc_hdr_t *h;
+	const char	*text;
+	bool		active;					// md2roff() takes the parsing from it
+	} pc;
+
+/*
+ * checksum of 'n' bytes, eight at a time
+ */
+static uint64_t pc_sum(const char *p, size_t n) {
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ n, v;
+
+	for ( ; n >= 8; p += 8, n -= 8 ) {
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+		}
+	v = 0;
+	memcpy(&v, p, n);
+	h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+	return h ^ (h >> 33);
+	}
+
+// writes 'n' bytes to 'fp' from the offset aligned to 8 and returns it
+static uint32_t pc_put(FILE *fp, const void *p, size_t n) {
+	static const char zero[8];
+	long	off = ftell(fp);
+
+	if ( off % 8 ) {
+		fwrite(zero, 1, 8 - off % 8, fp);
+		off += 8 - off % 8;
+		}
+	if ( n )
+		fwrite(p, 1, n, fp);
+	return off;
+	}
+
+/*
+ * parses the text 'source' of the file 'docname' and stores the image of
+ * its cache file in 'img'
+ */
+static void pc_build(const char *docname, const char *source, const struct stat *st, char **img, size_t *size) {
+	pc_hdr_t	h;
+	pc_ref_t	r;
+	zspan_t		z;
+	mdindex_t	*ix[2] = { &link_index, &fn_index };
+	FILE		*fp;
+	int			n, word;
+
+	ln_source = source;
+	ln_build(source);
+	refs_collect(source);
+	memset(&h, 0, sizeof(h));
+	panicif((fp = open_memstream(img, size)) == NULL, "open_memstream failed");
+	fwrite(&h, 1, sizeof(h), fp);
+	h.name = pc_put(fp, docname, strlen(docname) + 1);
+	h.text_len = ln_idx.size;
+	h.text = pc_put(fp, source, h.text_len + 1);
+	h.nlines = ln_idx.count;
+	h.lines = pc_put(fp, ln_idx.tab, sizeof(lnent_t) * ln_idx.count);
+	h.refs = pc_put(fp, NULL, 0);
+	for ( r.fn = 0; r.fn < 2; r.fn ++ ) {
+		for ( int i = 0; i < ix[r.fn]->size; i ++ ) {
+			const mdref_t *m = &ix[r.fn]->tab[i];
+			if ( m->key ) {
+				r.key = m->key - source;
+				r.klen = m->klen;
+				r.text = m->text - source;
+				r.tlen = m->tlen;
+				fwrite(&r, 1, sizeof(r), fp);
+				h.nrefs ++;
 				}
 			}
-		else if ( *p == '[' && *(p+1) == '^' ) {
-			*d ++ = *p ++;
-			p ++;
-			continue;
-			}
-		else {
-			*d = *p;
-			d ++;
+		}
+	h.zspans = pc_put(fp, NULL, 0);
+	h.zdic = man_ofc;
+	for ( uint32_t off = 0; h.zdic && off < h.text_len; off ++ ) {
+		if ( (n = zdic_find(source + off, &word)) != 0 ) {
+			z.off = off;
+			z.len = n;
+			z.word = word;
+			fwrite(&z, 1, sizeof(z), fp);
+			h.nzspans ++;
 			}
+		}
+	fclose(fp);
 
-		p ++;
+	memcpy(h.magic, PC_MAGIC, 8);
+	h.version = PC_VERSION;
+	h.sizes = PC_SIZES;
+	h.tabs = opt_tabs;
+	h.src_size = st->st_size;
+	h.src_mtime = st->st_mtim.tv_sec;
+	h.src_nsec = st->st_mtim.tv_nsec;
+	h.size = *size;
+	h.text_sum = pc_sum(source, h.text_len);
+	h.sum = pc_sum(*img + sizeof(h), *size - sizeof(h));
+	memcpy(*img, &h, sizeof(h));
+	}
+
+// true if the 'n' records of 'size' bytes at 'off' are in the file
+static bool pc_inside(uint64_t off, uint64_t n, size_t size) {
+	return ( off % 8 == 0 && off >= sizeof(pc_hdr_t) && off + n * size <= pc.size );
+	}
+
+/*
+ * true if the records of the mapped file are in the text and in order,
+ * as the code that reads them expects
+ */
+static bool pc_records() {
+	const pc_hdr_t	*h = pc.h;
+	const lnent_t	*L = (const lnent_t *) (pc.img + h->lines);
+	const pc_ref_t	*r = (const pc_ref_t *) (pc.img + h->refs);
+	const zspan_t	*z = (const zspan_t *) (pc.img + h->zspans);
+
+	if ( L[0].off != 0 )
+		return false;
+	for ( uint32_t i = 0; i < h->nlines; i ++ ) {
+		if ( L[i].off > h->text_len || (i && L[i].off <= L[i - 1].off) || L[i].para < i
+				|| L[i].para >= h->nlines || L[i].cls > LN_OLIST )
+			return false;
 		}
-	d = flushln(d, dest);
+	for ( uint32_t i = 0; i < h->nrefs; i ++ ) {
+		if ( (uint64_t) r[i].key + r[i].klen > h->text_len || (uint64_t) r[i].text + r[i].tlen > h->text_len )
+			return false;
+		}
+	for ( uint32_t i = 0; i < h->nzspans; i ++ ) {
+		if ( z[i].len == 0 || (uint64_t) z[i].off + z[i].len > h->text_len || z[i].word >= MDIC_SIZE - 1
+				|| (i && z[i].off <= z[i - 1].off) )
+			return false;
+		}
+	return true;
+	}
 
-	free(dest);
+static void pc_unmap() {
+	if ( pc.img )
+		munmap(pc.img, pc.size);
+	memset(&pc, 0, sizeof(pc));
 	}
 
 /*
- * --- main() ---
+ * maps the cache file 'fname' if it is valid
  */
-#define APPVER	"1.8"
+static bool pc_map(const char *fname) {
+	struct stat st;
+	const pc_hdr_t *h;
+	int		fd;
+	void	*img;
 
-static char *usage ="\
-usage: md2roff [options] [file1 .. [fileN]]\n\
-\t-n, --man\n\t\tuse man package (default)\n\
-\t-d, --mdoc\n\t\tuse mdoc package (BSD man-pages)\n\
-\t-m, --mm\n\t\tuse mm package\n\
-\t-s, --ms\n\t\tuse ms package\n\
-\t-o, --mom\n\t\tuse mom package\n\
-\t-z, --man-official\n\t\ttry to be as official as man-pages(7)\n\
-\t-q, --non-std-q\n\t\tnon-standard emphasis/strong quotation\n\
-\t-pX,--synopsis-style=X\n\t\tFor man-pages, styles of SYNOPSIS section. where X, 0 = normal, 1 = md2roff highlight, 2 = .SY/.OP style, 3 = .Nm style\n\
-\t-h, --help\n\t\tprint this screen\n\
-\t-v, --version\n\t\tprint version information\n\
-";
+	if ( (fd = open(fname, O_RDONLY)) == -1 )
+		return false;
+	if ( fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(pc_hdr_t) ) {
+		close(fd);
+		return false;
+		}
+	img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); // --split-pages writes
+	close(fd);
+	if ( img == MAP_FAILED )
+		return false;
+	pc.img = (char *) img;
+	pc.size = st.st_size;
+	pc.h = h = (const pc_hdr_t *) img;
+	if ( memcmp(h->magic, PC_MAGIC, 8) != 0 || h->version != PC_VERSION || h->sizes != PC_SIZES
+			|| h->size != pc.size || !pc_inside(h->text, h->text_len + 1, 1)
+			|| pc.img[h->text + h->text_len] != '\0' || !pc_inside(h->name, 1, 1)
+			|| memchr(pc.img + h->name, '\0', pc.size - h->name) == NULL
+			|| !pc_inside(h->lines, h->nlines, sizeof(lnent_t)) || h->nlines == 0
+			|| !pc_inside(h->refs, h->nrefs, sizeof(pc_ref_t))
+			|| !pc_inside(h->zspans, h->nzspans, sizeof(zspan_t))
+			|| pc_sum(pc.img + sizeof(pc_hdr_t), pc.size - sizeof(pc_hdr_t)) != h->sum ) {
+		pc_unmap();
+		return false;
+		}
+	if ( !pc_records() ) {
+		pc_unmap();
+		return false;
+		}
+	pc.text = pc.img + h->text;
+	return true;
+	}
 
-static char *version ="\
-md2roff, version "APPVER"\n\
-Copyright (C) 2017-2022 Nicholas Christopoulos <mailto:nereus@freemail.gr>.\n\
-License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\n\
-This is free software: you are free to change and redistribute it.\n\
-There is NO WARRANTY, to the extent permitted by law.\n\
-";
+/*
+ * if 'source' is the text of the cache, restores the line index and the
+ * references from it instead of parsing, and returns true
+ */
+static bool pc_use(const char *source) {
+	const pc_hdr_t *h = pc.h;
+	const pc_ref_t *r;
+	mdref_t *m;
+
+	if ( !pc.active || source != pc.text )
+		return false;
+	r = (const pc_ref_t *) (pc.img + h->refs);
+	if ( ln_idx.alloc < (int) h->nlines ) {
+		ln_idx.alloc = h->nlines;
+		panicif((ln_idx.tab = (lnent_t *) realloc(ln_idx.tab, ln_idx.alloc * sizeof(lnent_t))) == NULL, "out of memory");
+		}
+	memcpy(ln_idx.tab, pc.img + h->lines, h->nlines * sizeof(lnent_t));
+	ln_idx.count = h->nlines;
+	ln_idx.size = h->text_len;
+	ln_cur = 0;
+	idx_free(&fn_index);
+	idx_free(&link_index);
+	fn_count = 0;
+	for ( uint32_t i = 0; i < h->nrefs; i ++, r ++ ) {
+		if ( (m = idx_add(( r->fn ) ? &fn_index : &link_index, source + r->key, r->klen)) != NULL ) {
+			m->text = source + r->text;
+			m->tlen = r->tlen;
+			}
+		}
+	return true;
+	}
+
+/*
+ * converts the file 'fname' from its parse cache 'cache', which is made
+ * again if it is not of the file: the size and the time of the file are
+ * checked, and if they differ the checksum of its text. With 'fname' NULL
+ * the document is converted from the cache alone.
+ */
+void convert_cached(const char *fname, const char *cache) {
+	struct stat st;
+	char	*buf = NULL, *img, tmpname[4096 + 8];
+	size_t	size;
+	FILE	*fp;
+	bool	valid = pc_map(cache);
+	int		fd;
+
+	if ( fname == NULL )
+		panicif(!valid, "'%s' is not a parse cache", cache);
+	else {
+		panicif(stat(fname, &st) == -1, "Unable to open '%s'", fname);
+		if ( valid && (pc.h->src_size != (uint64_t) st.st_size || pc.h->src_mtime != st.st_mtim.tv_sec
+				|| pc.h->src_nsec != st.st_mtim.tv_nsec || pc.h->tabs != (uint32_t) opt_tabs) ) {
+			buf = loadfile(fname);
+			valid = ( pc.h->tabs == (uint32_t) opt_tabs && strlen(buf) == pc.h->text_len
+				&& pc_sum(buf, pc.h->text_len) == pc.h->text_sum );
+			if ( valid && (fd = open(cache, O_WRONLY)) != -1 ) { // the same text, only the time
+				pc_hdr_t h = *pc.h;
+				h.src_size = st.st_size;
+				h.src_mtime = st.st_mtim.tv_sec;
+				h.src_nsec = st.st_mtim.tv_nsec;
+				if ( pwrite(fd, &h, sizeof(h), 0) != sizeof(h) )
+					fprintf(stderr, "Unable to update '%s'\n", cache);
+				close(fd);
+				}
+			}
+		if ( valid && man_ofc && !pc.h->zdic ) // made without -z
+			valid = false;
+		if ( !valid ) {
+			pc_unmap();
+			if ( buf == NULL )
+				buf = loadfile(fname);
+			pc_build(fname, buf, &st, &img, &size);
+			panicif((fp = atomic_open(cache, tmpname, sizeof(tmpname))) == NULL, "Unable to create '%s'", cache);
+			fwrite(img, 1, size, fp);
+			panicif(atomic_close(fp, tmpname, cache) != 0, "Unable to write '%s'", cache);
+			free(img);
+			panicif(!pc_map(cache), "Unable to read '%s'", cache);
+			}
+		free(buf);
+		}
+
+	if ( !opt_split ) { // the pages of --split-pages are parsed on their own
+		pc.active = true;
+		if ( pc.h->zdic )
+			zdic_spans = (const zspan_t *) (pc.img + pc.h->zspans);
+		zdic_count = pc.h->nzspans;
+		zdic_text = pc.text;
+		zdic_len = pc.h->text_len;
+		zdic_cur = 0;
+		}
+	convert_buf(( fname ) ? fname : pc.img + pc.h->name, pc.img + pc.h->text, pc.h->src_mtime);
+	zdic_spans = NULL;
+	pc_unmap();
+	}
 
+/*
+ * bench.c includes this file without main()
+ */
+#ifndef MD2ROFF_NO_MAIN
 int main(int argc, char *argv[]) {
-	int files[64];
-	int fc = 0;
-	
+	fout = stdout;
 	for ( int i = 1; i < argc; i ++ ) {
 		if ( argv[i][0] == '-' ) {
-			if ( argv[i][1] == '\0' ) { // read from stdin
-				char *buf = loadfile(NULL);
-				md2roff("stdin", buf);
-				free(buf);
-				}
+			if ( argv[i][1] == '\0' ) // read from stdin
+				convert(NULL);
 			else if ( strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 )
 				printf("%s", usage);
 			else if ( strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0 )
@@ -1427,21 +7751,119 @@ int main(int argc, char *argv[]) {
 				opt_name_style = 2;
 			else if ( strcmp(argv[i], "-p3") == 0 || strcmp(argv[i], "--synopsis-style=3") == 0 )
 				opt_name_style = 3;
+			else if ( strcmp(argv[i], "--check-xrefs") == 0 ) {
+				opt_xrefs = getenv("MANPATH");
+				if ( opt_xrefs == NULL || *opt_xrefs == '\0' )
+					opt_xrefs = "/usr/share/man:/usr/local/share/man";
+				}
+			else if ( strncmp(argv[i], "--check-xrefs=", 14) == 0 )
+				opt_xrefs = argv[i] + 14;
+			else if ( strcmp(argv[i], "--whatis") == 0 && i + 1 < argc )
+				opt_whatis = argv[++ i];
+			else if ( strncmp(argv[i], "--whatis=", 9) == 0 )
+				opt_whatis = argv[i] + 9;
+			else if ( strncmp(argv[i], "--only-sections=", 16) == 0 ) {
+				opt_sections = argv[i] + 16;
+				opt_sec_exclude = 0;
+				}
+			else if ( strncmp(argv[i], "--exclude-sections=", 19) == 0 ) {
+				opt_sections = argv[i] + 19;
+				opt_sec_exclude = 1;
+				}
+			else if ( strcmp(argv[i], "--render=utf8") == 0 ) {
+				opt_render = rn_sgr;
+				mpack = mp_man;
+				}
+			else if ( strcmp(argv[i], "--render=overstrike") == 0 ) {
+				opt_render = rn_overstrike;
+				mpack = mp_man;
+				}
+			else if ( strcmp(argv[i], "--highlight") == 0 )
+				opt_highlight = 1;
+			else if ( strcmp(argv[i], "--no-peephole") == 0 )
+				opt_peephole = 0;
+			else if ( strcmp(argv[i], "--expand-tabs") == 0 )
+				opt_tabs = 8;
+			else if ( strncmp(argv[i], "--expand-tabs=", 14) == 0 )
+				opt_tabs = ( atoi(argv[i] + 14) > 0 ) ? atoi(argv[i] + 14) : 8;
+			else if ( strcmp(argv[i], "--pipeline") == 0 )
+				opt_pipeline = 1;
+			else if ( strcmp(argv[i], "--if-changed") == 0 )
+				opt_if_changed = 1;
+			else if ( strcmp(argv[i], "--split-pages") == 0 )
+				opt_split = 1;
+			else if ( strcmp(argv[i], "--split-pages=gz") == 0 )
+				opt_split = opt_split_gz = 1;
+			else if ( strcmp(argv[i], "--from-tar") == 0 )
+				opt_from_tar = "-";
+			else if ( strncmp(argv[i], "--from-tar=", 11) == 0 )
+				opt_from_tar = argv[i] + 11;
+			else if ( strcmp(argv[i], "--to-tar") == 0 )
+				opt_to_tar = 1;
+			else if ( strcmp(argv[i], "--to-tar=gz") == 0 )
+				opt_to_tar = opt_to_tar_gz = 1;
+			else if ( strncmp(argv[i], "--parse-cache=", 14) == 0 )
+				opt_parse_cache = argv[i] + 14;
+			else if ( strcmp(argv[i], "--sync-io") == 0 )
+				opt_sync_io = 1;
+			else if ( strcmp(argv[i], "--check") == 0 )
+				opt_check = 1;
+			else if ( strncmp(argv[i], "-j", 2) == 0 && ch_digit(argv[i][2]) )
+				opt_jobs = atoi(argv[i] + 2);
+			else if ( strncmp(argv[i], "--jobs=", 7) == 0 )
+				opt_jobs = atoi(argv[i] + 7);
+			else if ( strcmp(argv[i], "-O") == 0 && i + 1 < argc ) {
+				opt_outdir = argv[++ i];
+				panicif(*opt_outdir == '\0', "-O needs a directory");
+				}
+			else if ( strncmp(argv[i], "-O", 2) == 0 ) {
+				opt_outdir = argv[i] + 2;
+				panicif(*opt_outdir == '\0', "-O needs a directory");
+				}
+			else if ( strcmp(argv[i], "--files-from") == 0 && i + 1 < argc )
+				add_manifest(argv[++ i]);
+			else if ( strncmp(argv[i], "--files-from=", 13) == 0 )
+				add_manifest(argv[i] + 13);
 			else
 				fprintf(stderr, "unknown option: [%s]\n", argv[i]);
 			}
-		else {
-			files[fc] = i;
-			fc ++;
-			}
+		else if ( argv[i][0] == '@' && argv[i][1] )
+			add_manifest(argv[i] + 1);
+		else
+			add_file(argv[i]);
 		}
 		
-	for ( int i = 0; i < fc; i ++ ) {
-		char *buf = loadfile(argv[files[i]]);
-		md2roff(argv[files[i]], buf);
-		free(buf);
+	if ( opt_to_tar && !opt_check )
+		tar_begin();
+	if ( opt_from_tar )
+		panicif(convert_tar(( strcmp(opt_from_tar, "-") ) ? opt_from_tar : NULL) != 0, "Unable to create a thread");
+	if ( opt_parse_cache ) {
+		panicif(fc > 1, "--parse-cache takes one input file");
+		convert_cached(( fc ) ? files[0] : NULL, opt_parse_cache);
+		fc = 0;
 		}
+	if ( opt_check ) {
+		if ( opt_jobs <= 0 )
+			opt_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		check_errors += check_files(files, fc, opt_jobs);
+		return ( check_errors ) ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+	fflush(stdout);
+	if ( fc > 1 && opt_pipeline && !opt_check && !opt_outdir && !opt_split && !opt_to_tar && convert_pipeline(files, fc) == 0 )
+		fc = 0;
+#ifdef HAVE_IO_URING
+	if ( fc > 1 && !opt_sync_io && !opt_pipeline && convert_uring(files, fc) == 0 )
+		fc = 0;
+#endif
+	for ( int i = 0; i < fc; i ++ )
+		convert(files[i]);
+	if ( opt_to_tar )
+		tar_end();
 
+	if ( opt_whatis )
+		panicif(whatis_write(opt_whatis) != 0, "Unable to write '%s'", opt_whatis);
+	if ( opt_xrefs && xref_report() )
+		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
 	}
-
+#endif
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+#	test of the peephole optimizer: the pages typeset by groff -Tutf8 must
+#	be the same with and without --no-peephole, for each macro package.
+#	Without groff the man pages are compared as md2roff --render formats
+#	them, and the other packages are reported as SKIP; the exit status is
+#	then 77 if nothing failed.
+#
+#	usage: test-peephole.sh [FILE...]
+#
+
+md2roff=${MD2ROFF:-./md2roff}
+[ $# -gt 0 ] || set -- md2roff.md examples/*.md
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+rc=0
+skip=0
+compare() { # file package
+	if cmp -s "$tmp/before" "$tmp/after"; then
+		echo "ok   $1 $2"
+	else
+		echo "FAIL $1 $2"
+		diff "$tmp/before" "$tmp/after" | head -20
+		rc=1
+	fi
+}
+
+for f in "$@"; do
+	for p in n:man d:mdoc m:mm s:ms o:mom; do
+		if command -v groff > /dev/null; then
+			"$md2roff" --no-peephole -${p%%:*} "$f" | groff -Tutf8 -m${p#*:} 2> /dev/null > "$tmp/before"
+			"$md2roff" -${p%%:*} "$f" | groff -Tutf8 -m${p#*:} 2> /dev/null > "$tmp/after"
+			compare "$f" -m${p#*:}
+		elif [ ${p%%:*} = n ]; then
+			"$md2roff" --no-peephole --render=utf8 "$f" > "$tmp/before"
+			"$md2roff" --render=utf8 "$f" > "$tmp/after"
+			compare "$f" "--render"
+		else
+			echo "SKIP $f -m${p#*:} (groff not found)"
+			skip=1
+		fi
+	done
+done
+[ $rc = 0 ] && [ $skip = 1 ] && exit 77
+exit $rc
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+#	test of --check-xrefs against the fake man pages of examples/xrefs: the
+#	dangling references must be the same when the index is built, when it
+#	is read from the cache, when the cache file of another MANPATH is found
+#	under the name of this one, and when the cache file is corrupted.
+#
+#	usage: test-xrefs.sh
+#
+
+md2roff=${MD2ROFF:-./md2roff}
+dir=examples/xrefs
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+XDG_CACHE_HOME=$tmp/cache
+export XDG_CACHE_HOME
+
+rc=0
+check() { # name manpath expected
+	"$md2roff" --check-xrefs="$2" $dir/refs.md 2> "$tmp/out" > /dev/null
+	printf "$3" > "$tmp/expected"
+	if cmp -s "$tmp/expected" "$tmp/out"; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		diff "$tmp/expected" "$tmp/out"
+		rc=1
+	fi
+}
+
+one="$dir/refs.md:9: dangling reference to mount(8)\n"
+two="$dir/refs.md:10: dangling reference to ls(8)\n$dir/refs.md:11: dangling reference to nosuch(1)\n"
+
+check "build" $dir/man "$one$two"
+check "cache" $dir/man "$one$two"
+first=$(ls "$XDG_CACHE_HOME"/md2roff)
+check "two directories" $dir/man:$dir/other "$two"
+for f in "$XDG_CACHE_HOME"/md2roff/*; do
+	[ "${f##*/}" = "$first" ] || cp "$XDG_CACHE_HOME/md2roff/$first" "$f"
+done
+check "cache of another MANPATH" $dir/man:$dir/other "$two"
+cache="$XDG_CACHE_HOME/md2roff/$first"
+printf '\377\377\377\177' | dd of="$cache" bs=1 seek=24 conv=notrunc 2> /dev/null
+check "cache with a bad offset" $dir/man "$one$two"
+printf 'x' | dd of="$cache" bs=1 seek=$(( $(wc -c < "$cache") - ${#dir} - 6 )) conv=notrunc 2> /dev/null
+check "cache with a name not terminated" $dir/man "$one$two"
+exit $rc